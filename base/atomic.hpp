@@ -36,6 +36,7 @@
 #define atomic_and  __sync_and_and_fetch
 #define atomic_or  __sync_or_and_fetch
 #define atomic_xor __sync_xor_and_fetch
+#define atomic_fetch_or __sync_fetch_and_or
 
 template <class T>
 void intrusive_ptr_add_ref(T *t) {
@@ -44,10 +45,8 @@ void intrusive_ptr_add_ref(T *t) {
 
 template <class T>
 void intrusive_ptr_release(T *t) {
-  if (atomic_compare_and_swap(&t->intrusive_count_, 1, 0)) {
+  if (atomic_dec(&t->intrusive_count_, 1) == 0) {
     delete t;
-  } else {
-    atomic_dec(&t->intrusive_count_, 1);
   }
 }
 #endif  // ATOMIC_HPP_
@@ -61,11 +61,18 @@ bool ClientConnection::Connect() {
   boost::asio::ip::tcp::resolver::iterator end;
   // Try each endpoint until we successfully establish a connection.
   boost::system::error_code error = boost::asio::error::host_not_found;
-  boost::asio::ip::tcp::socket *socket =
-    new boost::asio::ip::tcp::socket(io_service_pool_->get_io_service());
+  boost::asio::ip::tcp::socket *socket = new boost::asio::ip::tcp::socket(
+      io_service_pool_->get_least_loaded_io_service());
   while (error && endpoint_iterator != end) {
     socket->close();
-    socket->connect(*endpoint_iterator++, error);
+    const boost::asio::ip::tcp::endpoint endpoint = *endpoint_iterator++;
+    socket->open(endpoint.protocol(), error);
+    if (error) {
+      continue;
+    }
+    // The buffer sizes must be set before connect to get the window scale.
+    socket_profile().ApplyBuffers(socket);
+    socket->connect(endpoint, error);
   }
   if (error) {
     delete socket;
@@ -30,3 +30,51 @@
  */
 #include "server/connection.hpp"
 int Connection::global_connection_id = 0;
+
+void RpcController::StartCancel() {
+  boost::shared_ptr<Connection> connection = call_connection_.lock();
+  if (connection.get() != NULL) {
+    connection->CancelCall(call_id_);
+  }
+}
+
+ServiceController *ServiceController::Get(google::protobuf::Closure *done) {
+  ServiceClosure *closure = dynamic_cast<ServiceClosure*>(done);
+  return closure != NULL ? &closure->controller : NULL;
+}
+
+void ServiceController::NotifyOnCancel(google::protobuf::Closure *callback) {
+  {
+    boost::mutex::scoped_lock locker(mutex_);
+    if (!canceled_ && !finished_) {
+      CHECK(cancel_callback_ == NULL) << "NotifyOnCancel twice";
+      cancel_callback_ = callback;
+      return;
+    }
+  }
+  callback->Run();
+}
+
+google::protobuf::Closure *ServiceController::Cancel() {
+  boost::mutex::scoped_lock locker(mutex_);
+  if (canceled_ || finished_) {
+    return NULL;
+  }
+  canceled_ = true;
+  google::protobuf::Closure *callback = cancel_callback_;
+  cancel_callback_ = NULL;
+  return callback;
+}
+
+void ServiceController::Finish() {
+  google::protobuf::Closure *callback;
+  {
+    boost::mutex::scoped_lock locker(mutex_);
+    finished_ = true;
+    callback = cancel_callback_;
+    cancel_callback_ = NULL;
+  }
+  if (callback != NULL) {
+    callback->Run();
+  }
+}
@@ -46,14 +46,60 @@
 #include <protobuf/service.h>
 #include "thread/notifier.hpp"
 #include "server/timer.hpp"
+#include "base/executor.hpp"
+#include "base/time.hpp"
 
+class Connection;
 class RpcController : virtual public google::protobuf::RpcController {
  public:
-  RpcController(const string name = "NoNameRpcController") : notifier_(new Notifier(name)) {
+  RpcController(const string name = "NoNameRpcController") : notifier_(new Notifier(name)),
+    attachment_field_(0), timeout_ms_(0), call_id_(0), canceled_(false) {
   }
   void Reset() {
     failed_.clear();
     notifier_.reset(new Notifier("RPCController"));
+    attachment_field_ = 0;
+    attachment_ = FileRegion();
+    encoded_request_.reset();
+    timeout_ms_ = 0;
+    call_connection_.reset();
+    call_id_ = 0;
+    canceled_ = false;
+  }
+  // The time the server has to start the call in, sent with the request,
+  // 0 is no limit. The server drops the call once it's past.
+  void set_timeout_ms(int timeout_ms) {
+    timeout_ms_ = timeout_ms;
+  }
+  int timeout_ms() const {
+    return timeout_ms_;
+  }
+  // The call in flight, set by the connection sending it.
+  void set_call(const boost::weak_ptr<Connection> &connection,
+                uint64 call_id) {
+    call_connection_ = connection;
+    call_id_ = call_id;
+  }
+  // Send the block as the serialized request, instead of serializing the
+  // request again. One block can be sent on many connections.
+  void set_encoded_request(const SharedBlockPtr &block) {
+    encoded_request_ = block;
+  }
+  const SharedBlockPtr &encoded_request() const {
+    return encoded_request_;
+  }
+  // Send the file region as the bytes field of the request by sendfile,
+  // instead of copying it into the request. The field in the request
+  // should be empty.
+  void set_attachment(int field_number, const FileRegion &region) {
+    attachment_field_ = field_number;
+    attachment_ = region;
+  }
+  const FileRegion *attachment() const {
+    return attachment_.file.get() ? &attachment_ : NULL;
+  }
+  int attachment_field() const {
+    return attachment_field_;
   }
   void SetFailed(const string &failed) {
     failed_ = failed;
@@ -64,18 +110,31 @@ class RpcController : virtual public google::protobuf::RpcController {
   string ErrorText() const {
     return failed_;
   }
-  void StartCancel() {
-  }
+  // Drop the call in flight and ask the server to cancel it, the call
+  // fails with "Canceled" unless it had completed. The cancel is only sent
+  // once a response shows the server decodes the control frames.
+  void StartCancel();
+  // The call was still pending when it's canceled.
   bool IsCanceled() const {
-    return false;
+    return canceled_;
+  }
+  // Set by the connection before it completes the canceled call.
+  void set_canceled() {
+    canceled_ = true;
   }
   void NotifyOnCancel(google::protobuf::Closure *callback) {
   }
   bool Wait() {
     return notifier_->Wait();
   }
+  // Cancel the call on timeout, a late response isn't written into the
+  // response after the false.
   bool Wait(int timeout_ms) {
-    return notifier_->Wait(timeout_ms);
+    if (notifier_->Wait(timeout_ms)) {
+      return true;
+    }
+    StartCancel();
+    return false;
   }
   void Notify() {
     notifier_->Notify();
@@ -84,6 +143,13 @@ class RpcController : virtual public google::protobuf::RpcController {
   string failed_;
   bool responsed_;
   boost::shared_ptr<Notifier> notifier_;
+  int attachment_field_;
+  FileRegion attachment_;
+  SharedBlockPtr encoded_request_;
+  int timeout_ms_;
+  boost::weak_ptr<Connection> call_connection_;
+  uint64 call_id_;
+  bool canceled_;
 };
 
 class Connection : virtual public RpcController,
@@ -98,34 +164,43 @@ class Connection : virtual public RpcController,
   };
   Connection(const string &name) :
     RpcController(name), name_(name), id_(++global_connection_id),
-    status_(new RawConnectionStatus) {
+    status_(new RawConnectionStatus), registry_shard_(-1),
+    registry_slot_(-1), listeners_closed_(false) {
   }
 
-  virtual bool RegisterService(google::protobuf::Service *service) = 0;
+  virtual bool RegisterService(google::protobuf::Service *service,
+                               Executor *executor = NULL) = 0;
   virtual void CallMethod(const google::protobuf::MethodDescriptor *method,
                           google::protobuf::RpcController *controller,
                           const google::protobuf::Message *request,
                           google::protobuf::Message *response,
                           google::protobuf::Closure *done) = 0;
 
+  // Return false if the connection is already closed, the listener won't
+  // be called.
   bool RegisterAsyncCloseListener(boost::weak_ptr<AsyncCloseListener> listener) {
     boost::mutex::scoped_lock locker(listener_mutex_);
+    if (listeners_closed_) {
+      return false;
+    }
     listeners_.push_back(listener);
     return true;
   }
 
   virtual void Disconnect() {
+    // The impl_ is released once the handlers entered leave.
+    status_->Enter();
     if (status_->closing()) {
-      VLOG(2) << "Disconnect " << name() << " but is closing";
+      VLOG(2) << "Disconnect " << name_ << " but is closing";
+      status_->Leave();
       return;
     }
     VLOG(2) << "Disconnect " << name();
-    status_->mutex().lock_shared();
     if (impl_) {
       impl_->Disconnect(status_, false);
       return;
     }
-    status_->mutex().unlock_shared();
+    status_->Leave();
     VLOG(2) << "Disconnected " << name();
   }
 
@@ -135,6 +210,38 @@ class Connection : virtual public RpcController,
   const string name() const {
     return impl_.get() ? impl_->name() : name_;
   }
+  // The read statistics of the underlying connection.
+  ReceiveStats receive_stats() {
+    RawConnectionStatus::Locker locker(status_.get());
+    if (status_->closing() || impl_.get() == NULL) {
+      return ReceiveStats();
+    }
+    return impl_->receive_stats();
+  }
+  // The write statistics of the underlying connection.
+  SendStats send_stats() {
+    RawConnectionStatus::Locker locker(status_.get());
+    if (status_->closing() || impl_.get() == NULL) {
+      return SendStats();
+    }
+    return impl_->send_stats();
+  }
+  // The flush policy of the connections attached after, a server
+  // connection passes it to the connections it spans.
+  void set_flush_policy(const FlushPolicy &flush_policy) {
+    flush_policy_ = flush_policy;
+  }
+  const FlushPolicy &flush_policy() const {
+    return flush_policy_;
+  }
+  // The socket options of the connections attached after, passed to the
+  // spanned connections like the flush policy.
+  void set_socket_profile(const SocketProfile &socket_profile) {
+    socket_profile_ = socket_profile;
+  }
+  const SocketProfile &socket_profile() const {
+    return socket_profile_;
+  }
   virtual ~Connection() {
     CHECK(!IsConnected());
   }
@@ -146,20 +253,18 @@ class Connection : virtual public RpcController,
   }
   virtual void Expired() {
     VLOG(2) << name() << " Expired";
-    status_->mutex().lock_shared();
-    if (status_->closing()) {
+    if (!status_->TryEnter()) {
       VLOG(2) << "Heartbeat " << name() << " but is closing";
-      status_->mutex().unlock_shared();
       return;
     }
     if (impl_.get() == NULL) {
-      status_->mutex().unlock_shared();
+      status_->Leave();
       return;
     }
     impl_->Heartbeat(status_);
   }
   inline bool ScheduleWrite() {
-    RawConnectionStatus::Locker locker(status_->mutex());
+    RawConnectionStatus::Locker locker(status_.get());
     if (status_->closing()) {
       VLOG(2) << "ScheduleWrite " << name() << " but is closing";
       return false;
@@ -167,14 +272,67 @@ class Connection : virtual public RpcController,
     return impl_.get() && impl_->ScheduleWrite(status_);
   }
   template <typename T>
-  // The push will take the ownership of the data
-  inline bool PushData(const T &data) {
-    RawConnectionStatus::Locker locker(status_->mutex());
+  // The push will take the ownership of the data. The writable is set false
+  // when the outbound queue is above the high watermark.
+  inline bool PushData(const T &data, bool *writable = NULL) {
+    RawConnectionStatus::Locker locker(status_.get());
     if (status_->closing()) {
       VLOG(2) << "PushData " << name() << " but is closing";
       return false;
     }
-    return impl_.get() && impl_->PushData(data);
+    return impl_.get() && impl_->PushData(data, writable);
+  }
+  // The outbound queue is below the high watermark of the flush policy.
+  bool writable() {
+    RawConnectionStatus::Locker locker(status_.get());
+    if (status_->closing() || impl_.get() == NULL) {
+      return false;
+    }
+    return impl_->writable();
+  }
+  // Run the callback once the outbound queue drains below the low
+  // watermark, return false if the connection is closed.
+  bool NotifyWritable(const boost::function0<void> &callback) {
+    RawConnectionStatus::Locker locker(status_.get());
+    if (status_->closing() || impl_.get() == NULL) {
+      return false;
+    }
+    impl_->NotifyWritable(callback);
+    return true;
+  }
+  // Move the socket to the io_service after a read completes with no write
+  // in flight, return false if the connection is closed or the boost can't
+  // migrate the socket.
+  bool Migrate(boost::asio::io_service *io_service) {
+    RawConnectionStatus::Locker locker(status_.get());
+    if (status_->closing() || impl_.get() == NULL) {
+      return false;
+    }
+    return impl_->Migrate(io_service);
+  }
+  // The load of the io_service of the socket, NULL if not connected.
+  IOServiceLoad *load() {
+    RawConnectionStatus::Locker locker(status_.get());
+    if (status_->closing() || impl_.get() == NULL) {
+      return NULL;
+    }
+    return impl_->load();
+  }
+  // The place in the ConnectionRegistry, -1 if not registered.
+  int registry_shard() const {
+    return registry_shard_;
+  }
+  int registry_slot() const {
+    return registry_slot_;
+  }
+  void set_registry_slot(int shard, int slot) {
+    registry_shard_ = shard;
+    registry_slot_ = slot;
+  }
+  // Drop the call of the id and tell the peer to cancel it, return false
+  // if the call had completed.
+  virtual bool CancelCall(uint64 /* call_id */) {
+    return false;
   }
   // Create a connection from a socket.
   // The protocol special class should implment it.
@@ -193,14 +351,110 @@ class Connection : virtual public RpcController,
       }
     }
     listeners_.clear();
+    listeners_closed_ = true;
     impl_.reset();
   }
   boost::intrusive_ptr<RawConnectionStatus> status_;
   string name_;
   boost::scoped_ptr<RawConnection> impl_;
+  FlushPolicy flush_policy_;
+  SocketProfile socket_profile_;
   int id_;
   vector<boost::weak_ptr<AsyncCloseListener> > listeners_;
   boost::mutex listener_mutex_;
+  volatile int registry_shard_;
+  volatile int registry_slot_;
+  bool listeners_closed_;
   friend class RawConnection;
 };
+
+// The cancel and the deadline of a call served by the connection. The
+// service methods still get the Connection as the controller, so it's
+// the channel to call the peer back even after the done runs, the
+// ServiceController::Get(done) returns the state of the call itself.
+class ServiceController : public google::protobuf::RpcController {
+ public:
+  // The deadline_us is by MonotonicUs(), 0 is no deadline.
+  ServiceController(const boost::shared_ptr<Connection> &connection,
+                    int64 deadline_us)
+    : connection_(connection), deadline_us_(deadline_us), canceled_(false),
+      finished_(false), cancel_callback_(NULL) {
+  }
+  // Not serving any call until the Start.
+  ServiceController()
+    : deadline_us_(0), canceled_(false), finished_(true),
+      cancel_callback_(NULL) {
+  }
+  ~ServiceController() {
+    Finish();
+  }
+  // Reuse the finished controller for a new call.
+  void Start(const boost::shared_ptr<Connection> &connection,
+             int64 deadline_us) {
+    connection_ = connection;
+    deadline_us_ = deadline_us;
+    failed_.clear();
+    canceled_ = false;
+    finished_ = false;
+    cancel_callback_ = NULL;
+  }
+  // Drop the connection of the finished call.
+  void Clear() {
+    connection_.reset();
+  }
+  // The controller of the call the done closure completes, NULL if the
+  // done isn't passed by a connection. Valid until the done runs.
+  static ServiceController *Get(google::protobuf::Closure *done);
+  Connection *connection() const {
+    return connection_.get();
+  }
+  int64 deadline_us() const {
+    return deadline_us_;
+  }
+  void Reset() {
+    failed_.clear();
+  }
+  bool Failed() const {
+    return !failed_.empty();
+  }
+  string ErrorText() const {
+    return failed_;
+  }
+  void SetFailed(const string &reason) {
+    failed_ = reason;
+  }
+  // Only the client starts the cancel.
+  void StartCancel() {
+  }
+  // Canceled by the client, or the client stopped waiting at the deadline.
+  bool IsCanceled() const {
+    return canceled_ || (deadline_us_ > 0 && MonotonicUs() > deadline_us_);
+  }
+  // Canceled by the client, the response is dropped.
+  bool canceled() const {
+    return canceled_;
+  }
+  // The callback runs once, on the cancel or when the call finishes.
+  void NotifyOnCancel(google::protobuf::Closure *callback);
+  // Called by the connection when the client cancels the call, return the
+  // cancel callback for the caller to run.
+  google::protobuf::Closure *Cancel();
+  // Called by the connection when the call is done.
+  void Finish();
+ private:
+  boost::shared_ptr<Connection> connection_;
+  int64 deadline_us_;
+  string failed_;
+  volatile bool canceled_;
+  bool finished_;
+  google::protobuf::Closure *cancel_callback_;
+  boost::mutex mutex_;
+};
+
+// The done closure of a call served by the connection, it carries the
+// controller of the call.
+class ServiceClosure : public google::protobuf::Closure {
+ public:
+  ServiceController controller;
+};
 #endif // NET2_CONNECTION_HPP_
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#ifndef NET2_CONNECTION_REGISTRY_HPP_
+#define NET2_CONNECTION_REGISTRY_HPP_
+#include "base/base.hpp"
+#include "boost/thread/mutex.hpp"
+#include "server/connection.hpp"
+// The connections in the shards, each shard has its own lock. The slot of
+// a connection is kept in it for the O(1) removal.
+class ConnectionRegistry : public boost::noncopyable {
+ public:
+  explicit ConnectionRegistry(int shards) : size_(0) {
+    for (int i = 0; i < std::max(shards, 1); ++i) {
+      shards_.push_back(boost::shared_ptr<Shard>(new Shard));
+    }
+  }
+  int shards() const {
+    return shards_.size();
+  }
+  int size() const {
+    return size_;
+  }
+  void Insert(int shard, const boost::shared_ptr<Connection> &connection) {
+    Shard *s = shards_[shard % shards_.size()].get();
+    boost::mutex::scoped_lock locker(s->mutex);
+    int slot;
+    if (s->free_slots.empty()) {
+      slot = s->slots.size();
+      s->slots.push_back(connection);
+    } else {
+      slot = s->free_slots.back();
+      s->free_slots.pop_back();
+      s->slots[slot] = connection;
+    }
+    connection->set_registry_slot(shard % shards_.size(), slot);
+    atomic_inc(&size_, 1);
+  }
+  // Return false if the connection isn't in the registry.
+  bool Remove(Connection *connection) {
+    const int shard = connection->registry_shard();
+    if (shard < 0 || shard >= static_cast<int>(shards_.size())) {
+      return false;
+    }
+    Shard *s = shards_[shard].get();
+    boost::shared_ptr<Connection> removed;
+    boost::mutex::scoped_lock locker(s->mutex);
+    const int slot = connection->registry_slot();
+    if (slot < 0 || slot >= static_cast<int>(s->slots.size()) ||
+        s->slots[slot].get() != connection) {
+      return false;
+    }
+    // Released out of the lock.
+    removed.swap(s->slots[slot]);
+    s->free_slots.push_back(slot);
+    connection->set_registry_slot(-1, -1);
+    atomic_dec(&size_, 1);
+    return true;
+  }
+  // Append the connections of all the shards.
+  void Get(vector<boost::shared_ptr<Connection> > *connections) {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      Shard *s = shards_[i].get();
+      boost::mutex::scoped_lock locker(s->mutex);
+      for (size_t j = 0; j < s->slots.size(); ++j) {
+        if (s->slots[j].get()) {
+          connections->push_back(s->slots[j]);
+        }
+      }
+    }
+  }
+  // Move all the connections out, the Remove of them returns false after.
+  void Clear(vector<boost::shared_ptr<Connection> > *connections) {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      Shard *s = shards_[i].get();
+      boost::mutex::scoped_lock locker(s->mutex);
+      for (size_t j = 0; j < s->slots.size(); ++j) {
+        if (s->slots[j].get()) {
+          s->slots[j]->set_registry_slot(-1, -1);
+          connections->push_back(s->slots[j]);
+          atomic_dec(&size_, 1);
+        }
+      }
+      s->slots.clear();
+      s->free_slots.clear();
+    }
+  }
+ private:
+  struct Shard {
+    boost::mutex mutex;
+    vector<boost::shared_ptr<Connection> > slots;
+    vector<int> free_slots;
+  };
+  vector<boost::shared_ptr<Shard> > shards_;
+  volatile int size_;
+};
+#endif  // NET2_CONNECTION_REGISTRY_HPP_
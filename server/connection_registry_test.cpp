@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <boost/thread.hpp>
+#include "server/connection_registry.hpp"
+#include "server/protobuf_connection.hpp"
+
+typedef vector<boost::shared_ptr<Connection> > Connections;
+
+static Connections NewConnections(int n) {
+  Connections connections;
+  for (int i = 0; i < n; ++i) {
+    connections.push_back(boost::shared_ptr<Connection>(
+        new ProtobufConnection("RegistryTest")));
+  }
+  return connections;
+}
+
+TEST(ConnectionRegistryTest, InsertRemove) {
+  ConnectionRegistry registry(4);
+  Connections connections = NewConnections(10);
+  for (int i = 0; i < connections.size(); ++i) {
+    registry.Insert(i, connections[i]);
+    EXPECT_EQ(connections[i]->registry_shard(), i % 4);
+  }
+  EXPECT_EQ(registry.size(), 10);
+  EXPECT_TRUE(registry.Remove(connections[3].get()));
+  EXPECT_FALSE(registry.Remove(connections[3].get()));
+  EXPECT_EQ(connections[3]->registry_slot(), -1);
+  EXPECT_EQ(registry.size(), 9);
+  // The free slot is reused.
+  const int slot = connections[7]->registry_slot();
+  EXPECT_TRUE(registry.Remove(connections[7].get()));
+  registry.Insert(7, connections[3]);
+  EXPECT_EQ(connections[3]->registry_slot(), slot);
+  Connections all;
+  registry.Get(&all);
+  EXPECT_EQ(all.size(), 9);
+  Connections cleared;
+  registry.Clear(&cleared);
+  EXPECT_EQ(cleared.size(), 9);
+  EXPECT_EQ(registry.size(), 0);
+  for (int i = 0; i < connections.size(); ++i) {
+    EXPECT_FALSE(registry.Remove(connections[i].get()));
+  }
+}
+
+static void InsertRemove(ConnectionRegistry *registry, int shard,
+                         Connections *connections) {
+  for (int k = 0; k < 100; ++k) {
+    for (int i = 0; i < connections->size(); ++i) {
+      registry->Insert(shard, (*connections)[i]);
+    }
+    for (int i = 0; i < connections->size(); ++i) {
+      CHECK(registry->Remove((*connections)[i].get()));
+    }
+  }
+}
+
+TEST(ConnectionRegistryTest, Threads) {
+  const int kShards = 4;
+  ConnectionRegistry registry(kShards);
+  vector<Connections> connections(kShards * 2);
+  boost::thread_group threads;
+  for (int i = 0; i < connections.size(); ++i) {
+    connections[i] = NewConnections(100);
+    threads.create_thread(boost::bind(
+        InsertRemove, &registry, i % kShards, &connections[i]));
+  }
+  threads.join_all();
+  EXPECT_EQ(registry.size(), 0);
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -32,8 +32,36 @@
 
 
 #include "server/io_service_pool.hpp"
+#include "base/time.hpp"
 #include <boost/bind.hpp>
 #include <glog/logging.h>
+#include <boost/version.hpp>
+#include <pthread.h>
+#include <sched.h>
+#if defined(BOOST_ASIO_HAS_IO_URING) && BOOST_VERSION < 107800
+#error "The io_uring backend needs boost 1.78 or later"
+#endif
+boost::asio::io_service::id IOServiceLoad::id;
+
+void IOServiceLoad::Sample() {
+  const int64 now = MonotonicUs();
+  if (now - sample_us_ < kSampleUs ||
+      !atomic_compare_and_swap(&sampling_, 0, 1)) {
+    return;
+  }
+  const int64 bytes = bytes_;
+  const int64 handler_us = handler_us_;
+  if (sample_us_ > 0) {
+    const double elapsed = now - sample_us_;
+    bytes_per_second_ = (bytes - sample_bytes_) * 1000000.0 / elapsed;
+    busy_ = (handler_us - sample_handler_us_) / elapsed;
+  }
+  sample_us_ = now;
+  sample_bytes_ = bytes;
+  sample_handler_us_ = handler_us;
+  atomic_and(&sampling_, 0);
+}
+
 IOServicePool::IOServicePool(
     const string &name,
     size_t num_io_services,
@@ -52,24 +80,66 @@ void IOServicePool::Start() {
     LOG(WARNING) << "IOServicePool already running";
     return;
   }
-  CHECK(io_services_.empty());
-  for (size_t i = 0; i < num_io_services_; ++i) {
-    boost::shared_ptr<boost::asio::io_service> io_service(new boost::asio::io_service);
-    io_services_.push_back(io_service);
-  }
+  VLOG(1) << name_ << " start on the " << backend() << " backend";
   // Give all the io_services work to do so that their run() functions will not
   // exit until they are explicitly stopped.
-  work_.clear();
-  work_.reserve(num_threads_);
-  int k = 0;
+  io_services_.resize(num_io_services_);
+  loads_.resize(num_io_services_);
+  work_.resize(num_threads_);
+  if (cpus_.empty()) {
+    for (int k = 0; k < num_io_services_; ++k) {
+      CreateIOService(k);
+    }
+    for (int i = 0; i < num_threads_; ++i) {
+      threadpool_.PushTask(boost::bind(&boost::asio::io_service::run,
+                                       io_services_[i % num_io_services_].get()));
+    }
+    threadpool_.Start();
+    return;
+  }
+  boost::shared_ptr<Notifier> created(
+      new Notifier(name_ + ".Created", num_io_services_));
   for (int i = 0; i < num_threads_; ++i) {
-    boost::shared_ptr<boost::asio::io_service> io_service = io_services_[k];
-    k = (k + 1) % num_io_services_;
-    boost::shared_ptr<boost::asio::io_service::work> worker(new boost::asio::io_service::work(*io_service));
-    work_.push_back(worker);
-    threadpool_.PushTask(boost::bind(&boost::asio::io_service::run, io_service.get()));
+    threadpool_.PushTask(boost::bind(
+        &IOServicePool::RunPinned, this, i, created));
   }
   threadpool_.Start();
+  created->Wait();
+}
+
+void IOServicePool::CreateIOService(int k) {
+  io_services_[k].reset(new boost::asio::io_service);
+  loads_[k] = &boost::asio::use_service<IOServiceLoad>(*io_services_[k]);
+  for (int i = k; i < num_threads_; i += num_io_services_) {
+    work_[i].reset(new boost::asio::io_service::work(*io_services_[k]));
+  }
+}
+
+static void PinThread(int cpu) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  const int ret = pthread_setaffinity_np(
+      pthread_self(), sizeof(cpu_set), &cpu_set);
+  if (ret != 0) {
+    LOG(WARNING) << "Fail to pin on cpu " << cpu << " error: " << strerror(ret);
+  }
+}
+
+void IOServicePool::RunPinned(int i, boost::shared_ptr<Notifier> created) {
+  PinThread(cpu(i));
+  const int k = i % num_io_services_;
+  if (i == k) {
+    // Created on its own pinned thread, the first touch puts the memory of
+    // the io_service on the numa node of the cpu.
+    CreateIOService(k);
+    created->Notify();
+  } else {
+    created->Wait();
+  }
+  VLOG(2) << name_ << " thread " << i << " run io_service " << k
+          << " on cpu " << sched_getcpu();
+  io_services_[k]->run();
 }
 
 void IOServicePool::Stop() {
@@ -78,25 +148,66 @@ void IOServicePool::Stop() {
     LOG(WARNING) << "IOServicePool already stop";
     return;
   }
-  /*
-  for (size_t i = 0; i < work_.size(); ++i) {
-    work_[i].reset();
-  }
-  */
+  // Stop after the handlers queued before it.
   for (size_t i = 0; i < io_services_.size(); ++i) {
-    io_services_[i]->stop();
+    io_services_[i]->post(boost::bind(&boost::asio::io_service::stop,
+                                      io_services_[i].get()));
   }
   threadpool_.Stop();
   work_.clear();
+  // The handlers left are destroyed with the io_services, so the
+  // connections they hold are released now instead of run by the next
+  // Start.
+  loads_.clear();
   io_services_.clear();
 }
 
+// The io_services_ is only changed by the Start and Stop.
 boost::asio::io_service &IOServicePool::get_io_service() {
-  boost::mutex::scoped_lock locker(mutex_);
   // Use a round-robin scheme to choose the next io_service to use.
-  boost::asio::io_service &io_service = *io_services_[next_io_service_];
-  ++next_io_service_;
-  if (next_io_service_ == io_services_.size())
-    next_io_service_ = 0;
-  return io_service;
+  const unsigned int next = atomic_inc(&next_io_service_, 1) - 1;
+  return *io_services_[next % num_io_services_];
+}
+
+boost::asio::io_service &IOServicePool::get_least_loaded_io_service() {
+  // Start from the round-robin one, so the ties are spread.
+  const unsigned int next = atomic_inc(&next_io_service_, 1) - 1;
+  int best = next % num_io_services_;
+  double best_score = load(best).score();
+  for (int i = 1; i < num_io_services_; ++i) {
+    const int k = (next + i) % num_io_services_;
+    const double score = load(k).score();
+    if (score < best_score) {
+      best = k;
+      best_score = score;
+    }
+  }
+  return *io_services_[best];
+}
+
+IOServiceLoad &IOServicePool::load(int index) {
+  CHECK_LT(index, static_cast<int>(loads_.size()));
+  return *loads_[index];
+}
+
+boost::asio::io_service &IOServicePool::get_io_service(int index) {
+  CHECK_LT(index, static_cast<int>(io_services_.size()));
+  return *io_services_[index];
+}
+
+int IOServicePool::index(const boost::asio::io_service &io_service) const {
+  for (int i = 0; i < static_cast<int>(io_services_.size()); ++i) {
+    if (io_services_[i].get() == &io_service) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char *IOServicePool::backend() {
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+  return "io_uring";
+#else
+  return "epoll";
+#endif
 }
@@ -36,7 +36,110 @@
 #include "base/base.hpp"
 #include <boost/thread.hpp>
 #include "thread/threadpool.hpp"
+#include "thread/notifier.hpp"
 #include "server/timer.hpp"
+/// The load of one io_service, counted by the connections on it. Get it by
+/// boost::asio::use_service<IOServiceLoad>(io_service).
+class IOServiceLoad : public boost::asio::io_service::service {
+ public:
+  static boost::asio::io_service::id id;
+  /// The rates are sampled at most once in it.
+  static const int kSampleUs = 100000;
+  /// The idle connections cost like one busy thread.
+  static const int kConnectionsPerThread = 1000;
+  explicit IOServiceLoad(boost::asio::io_service &io_service)
+    : boost::asio::io_service::service(io_service),
+      connections_(0), bytes_(0), handler_us_(0), sampling_(0),
+      sample_us_(0), sample_bytes_(0), sample_handler_us_(0),
+      bytes_per_second_(0), busy_(0) {
+  }
+  void AddConnection(int n) {
+    atomic_inc(&connections_, n);
+  }
+  void AddBytes(int64 n) {
+    atomic_inc(&bytes_, n);
+  }
+  void AddHandlerUs(int64 us) {
+    atomic_inc(&handler_us_, us);
+  }
+  /// The active connections.
+  int connections() const {
+    return connections_;
+  }
+  /// The bytes read and written.
+  int64 bytes() const {
+    return bytes_;
+  }
+  /// The time in the read and write handlers.
+  int64 handler_us() const {
+    return handler_us_;
+  }
+  double bytes_per_second() {
+    Sample();
+    return bytes_per_second_;
+  }
+  /// The handler time per second, 1 for a thread always busy.
+  double busy() {
+    Sample();
+    return busy_;
+  }
+  /// The bytes are paid by the handler time, so the score is the busy
+  /// threads plus the cost of the connections.
+  double score() {
+    return busy() + static_cast<double>(connections_) / kConnectionsPerThread;
+  }
+ private:
+  void shutdown_service() {
+  }
+  void Sample();
+  volatile int connections_;
+  volatile int64 bytes_;
+  volatile int64 handler_us_;
+  // Only one thread samples the rates.
+  volatile int sampling_;
+  int64 sample_us_;
+  int64 sample_bytes_;
+  int64 sample_handler_us_;
+  volatile double bytes_per_second_;
+  volatile double busy_;
+};
+
+/// Decide when to move the load between the io_services, with the
+/// hysteresis to avoid the flapping: start when the gap of the scores
+/// reaches the high, keep going until it's below the low.
+class LoadBalancer {
+ public:
+  LoadBalancer(double high, double low)
+    : high_(high), low_(low), active_(false) {
+  }
+  /// Return true to move the load from the hot to the cold.
+  bool Check(const vector<double> &scores, int *hot, int *cold) {
+    if (scores.size() < 2) {
+      return false;
+    }
+    *hot = 0;
+    *cold = 0;
+    for (size_t i = 1; i < scores.size(); ++i) {
+      if (scores[i] > scores[*hot]) {
+        *hot = i;
+      }
+      if (scores[i] < scores[*cold]) {
+        *cold = i;
+      }
+    }
+    const double gap = scores[*hot] - scores[*cold];
+    active_ = active_ ? gap >= low_ : gap >= high_;
+    return active_;
+  }
+  bool active() const {
+    return active_;
+  }
+ private:
+  double high_;
+  double low_;
+  bool active_;
+};
+
 /// A pool of io_service objects.
 class IOServicePool : private boost::noncopyable {
 public:
@@ -54,26 +157,69 @@ public:
   /// Run all io_service objects in the pool.
   void Start();
 
-  /// Stop all io_service objects in the pool.
+  /// Stop all io_service objects in the pool once the handlers queued
+  /// before run, and destroy them with the handlers left. The sockets and
+  /// timers on them must be gone, the next Start creates new ones.
   void Stop();
 
   bool IsRunning() const {
     return !work_.empty();
   }
 
-  /// Get an io_service to use.
+  /// Pin the thread i to the cpus[i % cpus.size()], set before the Start.
+  /// Run one thread per io_service so each io_service stays on one cpu.
+  void set_cpus(const vector<int> &cpus) {
+    cpus_ = cpus;
+  }
+
+  /// The cpu of the io_service by the index, -1 if not pinned.
+  int cpu(int index) const {
+    return cpus_.empty() ? -1 : cpus_[index % cpus_.size()];
+  }
+
+  /// Get an io_service to use, wait-free.
   boost::asio::io_service &get_io_service();
+
+  /// Get the io_service of the lowest IOServiceLoad::score().
+  boost::asio::io_service &get_least_loaded_io_service();
+
+  /// The load of the io_service by the index, for the monitoring.
+  IOServiceLoad &load(int index);
+
+  /// Get the io_service by the index, less than the size().
+  boost::asio::io_service &get_io_service(int index);
+
+  /// The index of the io_service, -1 if it's not in the pool.
+  int index(const boost::asio::io_service &io_service) const;
+
+  /// The number of the io_services.
+  int size() const {
+    return num_io_services_;
+  }
+
+  /// The reactor under the io_services, "io_uring" if built by
+  /// "scons io_uring=1", otherwise "epoll".
+  static const char *backend();
 private:
+  /// Create the io_service k and the work of its threads.
+  void CreateIOService(int k);
+
+  /// Run the pinned thread i, it creates the io_service i if i < size().
+  void RunPinned(int i, boost::shared_ptr<Notifier> created);
 
   /// The pool of io_services.
   vector<boost::shared_ptr<boost::asio::io_service> > io_services_;
 
+  /// The load of each io_service, the use_service locks the registry.
+  vector<IOServiceLoad *> loads_;
+
   /// The work that keeps the io_services running.
   vector<boost::shared_ptr<boost::asio::io_service::work> > work_;
 
   int num_io_services_;
   int num_threads_;
-  int next_io_service_;
+  volatile unsigned int next_io_service_;
+  vector<int> cpus_;
 
   ThreadPool threadpool_;
   boost::mutex mutex_;
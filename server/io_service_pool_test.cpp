@@ -35,6 +35,8 @@
 #include <gtest/gtest.h>
 #include "server/io_service_pool.hpp"
 #include <sstream>
+DEFINE_int32(pool_handlers, 1000000, "The handlers run by the benchmark");
+DEFINE_int32(pool_chains, 4, "The handler chains per io_service");
 
 class IOServicePoolTest : public testing::Test {
  public:
@@ -47,6 +49,9 @@ class IOServicePoolTest : public testing::Test {
     sleep(rand() % 3 + 1);
     *cnt = 0xbeef;
   }
+  static void GetCpu(int *cpu) {
+    *cpu = sched_getcpu();
+  }
  protected:
   static const int kPoolSize = 100;
   static const int kThreadSize = 200;
@@ -95,6 +100,152 @@ TEST_F(IOServicePoolTest, Test2) {
   }
 }
 
+// Post itself until the io_service stops.
+static void Repost(boost::asio::io_service *io_service,
+                   boost::shared_ptr<int> runs) {
+  ++*runs;
+  io_service->post(boost::bind(&Repost, io_service, runs));
+}
+
+TEST_F(IOServicePoolTest, StopReleasesHandlers) {
+  IOServicePool p("Release", 1, 1);
+  boost::shared_ptr<int> runs(new int(0));
+  for (int k = 0; k < 10; ++k) {
+    p.Start();
+    p.get_io_service().post(boost::bind(&Repost, &p.get_io_service(), runs));
+    usleep(1000);
+    p.Stop();
+    // The handler left is destroyed, not run by the next Start.
+    EXPECT_TRUE(runs.unique());
+    const int n = *runs;
+    p.Start();
+    p.Stop();
+    EXPECT_EQ(*runs, n);
+  }
+}
+
+TEST_F(IOServicePoolTest, Pinned) {
+  const int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  IOServicePool p("Pinned", 4, 4);
+  vector<int> cpu_set;
+  for (int i = 0; i < p.size(); ++i) {
+    cpu_set.push_back(i % cpus);
+  }
+  p.set_cpus(cpu_set);
+  p.Start();
+  vector<int> v(p.size(), -1);
+  for (int i = 0; i < p.size(); ++i) {
+    p.get_io_service(i).post(boost::bind(&IOServicePoolTest::GetCpu, &v[i]));
+  }
+  p.Stop();
+  for (int i = 0; i < p.size(); ++i) {
+    EXPECT_EQ(v[i], p.cpu(i));
+  }
+}
+
+TEST_F(IOServicePoolTest, LeastLoaded) {
+  IOServicePool p("LeastLoaded", 4, 4);
+  p.Start();
+  for (int i = 0; i < p.size(); ++i) {
+    p.load(i).AddConnection(i == 2 ? 0 : 10);
+  }
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(&p.get_least_loaded_io_service(), &p.get_io_service(2));
+  }
+  p.load(2).AddConnection(20);
+  EXPECT_NE(&p.get_least_loaded_io_service(), &p.get_io_service(2));
+  EXPECT_EQ(p.load(2).connections(), 20);
+  p.Stop();
+}
+
+TEST_F(IOServicePoolTest, LoadBalancer) {
+  LoadBalancer balancer(0.5, 0.2);
+  vector<double> scores(3, 0);
+  int hot, cold;
+  scores[1] = 0.4;
+  EXPECT_FALSE(balancer.Check(scores, &hot, &cold));
+  scores[1] = 0.6;
+  EXPECT_TRUE(balancer.Check(scores, &hot, &cold));
+  EXPECT_EQ(hot, 1);
+  EXPECT_EQ(cold, 0);
+  // Keep moving until the gap is below the low.
+  scores[1] = 0.4;
+  scores[0] = 0.1;
+  EXPECT_TRUE(balancer.Check(scores, &hot, &cold));
+  EXPECT_EQ(cold, 2);
+  scores[0] = 0.3;
+  scores[2] = 0.3;
+  EXPECT_FALSE(balancer.Check(scores, &hot, &cold));
+  // Wait for the high again.
+  scores[1] = 0.7;
+  EXPECT_FALSE(balancer.Check(scores, &hot, &cold));
+  scores[1] = 0.8;
+  EXPECT_TRUE(balancer.Check(scores, &hot, &cold));
+}
+
+// Post itself until the count runs out.
+class Chain {
+ public:
+  Chain(boost::asio::io_service *io_service, int count, Notifier *done)
+    : io_service_(io_service), count_(count), done_(done) {
+  }
+  void Run() {
+    if (--count_ <= 0) {
+      done_->Notify();
+      return;
+    }
+    io_service_->post(boost::bind(&Chain::Run, this));
+  }
+ private:
+  boost::asio::io_service *io_service_;
+  int count_;
+  Notifier *done_;
+};
+
+// Return the handlers per second on the io_services pinned one per cpu.
+static double RunChains(int io_services) {
+  IOServicePool p("Benchmark", io_services, io_services);
+  vector<int> cpu_set;
+  for (int i = 0; i < io_services; ++i) {
+    cpu_set.push_back(i);
+  }
+  p.set_cpus(cpu_set);
+  p.Start();
+  const int chains = io_services * FLAGS_pool_chains;
+  Notifier done("Chains", chains);
+  vector<boost::shared_ptr<Chain> > v;
+  for (int i = 0; i < chains; ++i) {
+    v.push_back(boost::shared_ptr<Chain>(new Chain(
+        &p.get_io_service(i % io_services), FLAGS_pool_handlers / chains,
+        &done)));
+  }
+  boost::posix_time::ptime start =
+    boost::posix_time::microsec_clock::universal_time();
+  for (int i = 0; i < chains; ++i) {
+    p.get_io_service(i % io_services).post(
+        boost::bind(&Chain::Run, v[i].get()));
+  }
+  done.Wait();
+  boost::posix_time::time_duration elapsed =
+    boost::posix_time::microsec_clock::universal_time() - start;
+  p.Stop();
+  return FLAGS_pool_handlers * 1000000.0 / elapsed.total_microseconds();
+}
+
+TEST_F(IOServicePoolTest, Benchmark) {
+  const int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  double single = 0;
+  for (int io_services = 1; io_services <= cpus; io_services *= 2) {
+    const double handlers = RunChains(io_services);
+    if (io_services == 1) {
+      single = handlers;
+    }
+    LOG(WARNING) << "Pinned io_services: " << io_services
+                 << " handlers: " << handlers << "/s"
+                 << " scaling: " << handlers / single;
+  }
+}
+
 int main(int argc, char **argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
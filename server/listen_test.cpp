@@ -44,6 +44,9 @@ DEFINE_string(server, "localhost", "The test server");
 DEFINE_string(port, "6789", "The test server");
 DEFINE_int32(num_threads, 4, "The test server thread number");
 DEFINE_int32(num_connections, 4, "The test server thread number");
+DEFINE_string(storm_port, "6790", "The port of the connect storm");
+DEFINE_int32(storm_connections, 1000, "The connections of the connect storm");
+DEFINE_int32(storm_threads, 4, "The threads connect in the storm");
 DECLARE_bool(logtostderr);
 DECLARE_int32(v);
 
@@ -271,6 +274,82 @@ TEST_F(ListenTest, MultiThreadMultConnectionTest1) {
   VLOG(2) << "Close client connection";
 }
 
+// Connect the sockets and keep them open.
+static void StormConnect(
+    boost::asio::io_service *io_service, int connections,
+    vector<boost::shared_ptr<boost::asio::ip::tcp::socket> > *sockets) {
+  boost::asio::ip::tcp::resolver resolver(*io_service);
+  boost::asio::ip::tcp::resolver::query query(FLAGS_server, FLAGS_storm_port);
+  const boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
+  for (int i = 0; i < connections; ++i) {
+    boost::shared_ptr<boost::asio::ip::tcp::socket> socket(
+        new boost::asio::ip::tcp::socket(*io_service));
+    boost::system::error_code e;
+    socket->connect(endpoint, e);
+    CHECK(!e) << e.message();
+    sockets->push_back(socket);
+  }
+}
+
+// Return the accepts per second of a connect storm.
+static double ConnectStorm(int io_services, bool reuse_port,
+                           const AcceptPolicy &policy = AcceptPolicy()) {
+  boost::shared_ptr<ProtobufConnection> connection(
+      new ProtobufConnection("ConnectStorm.Server"));
+  boost::shared_ptr<Server> server(new Server(io_services, io_services));
+  server->set_reuse_port(reuse_port);
+  server->set_accept_policy(policy);
+  server->Listen(FLAGS_server, FLAGS_storm_port, connection.get());
+  const int connections = FLAGS_storm_connections / FLAGS_storm_threads;
+  boost::asio::io_service io_service;
+  vector<vector<boost::shared_ptr<boost::asio::ip::tcp::socket> > > sockets(
+      FLAGS_storm_threads);
+  boost::posix_time::ptime start =
+    boost::posix_time::microsec_clock::universal_time();
+  boost::thread_group threads;
+  for (int i = 0; i < FLAGS_storm_threads; ++i) {
+    threads.create_thread(boost::bind(
+        StormConnect, &io_service, connections, &sockets[i]));
+  }
+  threads.join_all();
+  const int total = connections * FLAGS_storm_threads;
+  while (server->connection_size() < total) {
+    boost::this_thread::yield();
+  }
+  boost::posix_time::time_duration elapsed =
+    boost::posix_time::microsec_clock::universal_time() - start;
+  IOServicePool *pool = server->io_service_pool();
+  for (int i = 0; i < pool->size(); ++i) {
+    VLOG(1) << "IO service " << i << " connections: "
+            << pool->load(i).connections();
+    // Spread by the least loaded placement or the SO_REUSEPORT.
+    EXPECT_GT(pool->load(i).connections(), total / pool->size() / 4);
+  }
+  sockets.clear();
+  server->Stop();
+  return total * 1000000.0 / elapsed.total_microseconds();
+}
+
+TEST(ConnectStormTest, Benchmark) {
+  for (int io_services = 1; io_services <= FLAGS_num_threads;
+       io_services *= 2) {
+    const double single = ConnectStorm(io_services, false);
+    const double sharded = ConnectStorm(io_services, true);
+    LOG(WARNING) << "IO services: " << io_services
+                 << " single acceptor: " << single << " accepts/s"
+                 << " SO_REUSEPORT acceptors: " << sharded << " accepts/s";
+  }
+}
+
+TEST(ConnectStormTest, RateLimit) {
+  AcceptPolicy policy;
+  policy.rate = 2000;
+  policy.burst = 10;
+  const double limited = ConnectStorm(1, false, policy);
+  LOG(WARNING) << "Rate limited: " << limited << " accepts/s";
+  EXPECT_LT(limited, policy.rate * 1.1);
+}
+
 int main(int argc, char **argv) {
   FLAGS_v = 4;
   FLAGS_logtostderr = true;
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#ifndef NET2_METHOD_CACHE_HPP_
+#define NET2_METHOD_CACHE_HPP_
+#include "base/base.hpp"
+#include "base/hash.hpp"
+#include <protobuf/descriptor.h>
+// The fingerprints of the methods, hashed once per MethodDescriptor. The
+// descriptors live as long as the process, so the entries are never
+// removed and the lookup is lock free. The slot of a method is its dense
+// id in the process.
+class MethodCache {
+ public:
+  static const int kMaxMethods = 1024;
+  struct Entry {
+    const google::protobuf::MethodDescriptor *volatile method;
+    volatile uint64 fingerprint;
+    // Set once the fingerprint is written.
+    volatile bool ready;
+  };
+  static uint64 Fingerprint(const google::protobuf::MethodDescriptor *method) {
+    const Entry *entry = Get(method);
+    return entry ? entry->fingerprint : hash8(method->full_name());
+  }
+  // The dense id of the method, less than kMaxMethods.
+  static int Id(const Entry *entry) {
+    return entry - entries();
+  }
+  // NULL if the cache is full, or another thread is adding the method.
+  static const Entry *Get(const google::protobuf::MethodDescriptor *method) {
+    Entry *table = entries();
+    const int start = (reinterpret_cast<uintptr_t>(method) >> 4) %
+      kMaxMethods;
+    for (int i = 0; i < kMaxMethods; ++i) {
+      Entry *entry = &table[(start + i) % kMaxMethods];
+      if (entry->method == NULL) {
+        if (!atomic_compare_and_swap(
+            &entry->method,
+            static_cast<const google::protobuf::MethodDescriptor *>(NULL),
+            method)) {
+          // Lost the slot, look at the winner.
+          --i;
+          continue;
+        }
+        entry->fingerprint = hash8(method->full_name());
+        __sync_synchronize();
+        entry->ready = true;
+        return entry;
+      }
+      if (entry->method == method) {
+        return entry->ready ? entry : NULL;
+      }
+    }
+    return NULL;
+  }
+ private:
+  static Entry *entries() {
+    // Zero initialized before any code runs.
+    static Entry table[kMaxMethods];
+    return table;
+  }
+};
+#endif  // NET2_METHOD_CACHE_HPP_
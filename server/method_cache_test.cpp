@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "server/method_cache.hpp"
+#include "proto/hello.pb.h"
+
+TEST(MethodCacheTest, Fingerprint) {
+  const google::protobuf::ServiceDescriptor *service =
+    Hello::EchoService2::descriptor();
+  const google::protobuf::MethodDescriptor *echo1 = service->method(0);
+  const google::protobuf::MethodDescriptor *echo2 = service->method(1);
+  EXPECT_EQ(MethodCache::Fingerprint(echo1), hash8(echo1->full_name()));
+  EXPECT_EQ(MethodCache::Fingerprint(echo2), hash8(echo2->full_name()));
+  const MethodCache::Entry *entry1 = MethodCache::Get(echo1);
+  const MethodCache::Entry *entry2 = MethodCache::Get(echo2);
+  ASSERT_TRUE(entry1 != NULL);
+  ASSERT_TRUE(entry2 != NULL);
+  EXPECT_EQ(entry1->method, echo1);
+  EXPECT_EQ(MethodCache::Get(echo1), entry1);
+  EXPECT_NE(MethodCache::Id(entry1), MethodCache::Id(entry2));
+  const int max_methods = MethodCache::kMaxMethods;
+  EXPECT_LT(MethodCache::Id(entry1), max_methods);
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
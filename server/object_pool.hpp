@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#ifndef NET2_OBJECT_POOL_HPP_
+#define NET2_OBJECT_POOL_HPP_
+#include "base/base.hpp"
+#include <boost/thread/mutex.hpp>
+// A bounded free list of the objects to reuse, thread safe. The object put
+// back into a full pool is deleted.
+template <class T>
+class ObjectPool : public boost::noncopyable {
+ public:
+  explicit ObjectPool(int capacity) : capacity_(capacity) {
+    free_.reserve(capacity);
+  }
+  ~ObjectPool() {
+    for (size_t i = 0; i < free_.size(); ++i) {
+      delete free_[i];
+    }
+  }
+  // NULL if the pool is empty.
+  T *Get() {
+    boost::mutex::scoped_lock locker(mutex_);
+    if (free_.empty()) {
+      return NULL;
+    }
+    T *t = free_.back();
+    free_.pop_back();
+    return t;
+  }
+  void Put(T *t) {
+    {
+      boost::mutex::scoped_lock locker(mutex_);
+      if (static_cast<int>(free_.size()) < capacity_) {
+        free_.push_back(t);
+        return;
+      }
+    }
+    delete t;
+  }
+  int size() const {
+    boost::mutex::scoped_lock locker(mutex_);
+    return free_.size();
+  }
+  int capacity() const {
+    return capacity_;
+  }
+ private:
+  vector<T*> free_;
+  int capacity_;
+  mutable boost::mutex mutex_;
+};
+#endif  // NET2_OBJECT_POOL_HPP_
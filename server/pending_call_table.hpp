@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#ifndef NET2_PENDING_CALL_TABLE_HPP_
+#define NET2_PENDING_CALL_TABLE_HPP_
+#include "base/base.hpp"
+#include <boost/thread/mutex.hpp>
+#include <protobuf/message.h>
+#include <protobuf/service.h>
+// The calls waiting for the responses in an open addressing table keyed by
+// the call id. The ids are sequential, so the id is its own hash. The
+// table grows by doubling and never shrinks, a call doesn't allocate once
+// it holds the outstanding calls.
+class PendingCallTable : public boost::noncopyable {
+ public:
+  // The completion record of a call, the id is 0 in a free slot.
+  struct Call {
+    Call() : id(0), method_id(-1), controller(NULL), response(NULL),
+      done(NULL) {
+    }
+    uint64 id;
+    // The MethodCache id of the method, -1 if unknown.
+    int method_id;
+    google::protobuf::RpcController *controller;
+    google::protobuf::Message *response;
+    google::protobuf::Closure *done;
+  };
+  static const int kMinCapacity = 16;
+  explicit PendingCallTable(int capacity = kMinCapacity)
+    : next_id_(0), size_(0) {
+    int n = kMinCapacity;
+    while (n < capacity) {
+      n <<= 1;
+    }
+    slots_.resize(n);
+  }
+  // Thread safe, never 0.
+  uint64 NextId() {
+    return atomic_inc(&next_id_, 1);
+  }
+  void Insert(const Call &call) {
+    CHECK_NE(call.id, 0);
+    boost::mutex::scoped_lock locker(mutex_);
+    // Keep the load factor under 1/2 so the probes stay short.
+    if ((size_ + 1) * 2 > static_cast<int>(slots_.size())) {
+      Grow();
+    }
+    Place(call);
+    ++size_;
+  }
+  // Take the call out, return false if it's not in the table.
+  bool Remove(uint64 id, Call *call) {
+    boost::mutex::scoped_lock locker(mutex_);
+    const int mask = slots_.size() - 1;
+    for (int i = id & mask; slots_[i].id != 0; i = (i + 1) & mask) {
+      if (slots_[i].id == id) {
+        *call = slots_[i];
+        Erase(i);
+        --size_;
+        return true;
+      }
+    }
+    return false;
+  }
+  // Take all the calls out.
+  void Clear(vector<Call> *calls) {
+    boost::mutex::scoped_lock locker(mutex_);
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      if (slots_[i].id != 0) {
+        calls->push_back(slots_[i]);
+        slots_[i] = Call();
+      }
+    }
+    size_ = 0;
+  }
+  int size() const {
+    return size_;
+  }
+  int capacity() const {
+    return slots_.size();
+  }
+ private:
+  void Place(const Call &call) {
+    const int mask = slots_.size() - 1;
+    int i = call.id & mask;
+    while (slots_[i].id != 0) {
+      i = (i + 1) & mask;
+    }
+    slots_[i] = call;
+  }
+  void Grow() {
+    vector<Call> slots(slots_.size() * 2);
+    slots_.swap(slots);
+    for (size_t i = 0; i < slots.size(); ++i) {
+      if (slots[i].id != 0) {
+        Place(slots[i]);
+      }
+    }
+  }
+  // Shift the following calls back into the hole, so the probes don't
+  // need the tombstones.
+  void Erase(int hole) {
+    const int mask = slots_.size() - 1;
+    for (int i = (hole + 1) & mask; slots_[i].id != 0; i = (i + 1) & mask) {
+      const int home = slots_[i].id & mask;
+      // The call stays if its home is cyclically in (hole, i].
+      const bool stay = hole < i ? (home > hole && home <= i) :
+        (home > hole || home <= i);
+      if (!stay) {
+        slots_[hole] = slots_[i];
+        hole = i;
+      }
+    }
+    slots_[hole] = Call();
+  }
+  volatile uint64 next_id_;
+  int size_;
+  vector<Call> slots_;
+  boost::mutex mutex_;
+};
+#endif  // NET2_PENDING_CALL_TABLE_HPP_
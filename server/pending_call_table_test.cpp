@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "server/pending_call_table.hpp"
+
+static PendingCallTable::Call NewCall(PendingCallTable *table) {
+  PendingCallTable::Call call;
+  call.id = table->NextId();
+  return call;
+}
+
+TEST(PendingCallTableTest, InsertRemove) {
+  PendingCallTable table;
+  vector<uint64> ids;
+  for (int i = 0; i < 100; ++i) {
+    PendingCallTable::Call call = NewCall(&table);
+    EXPECT_EQ(call.id, i + 1);
+    table.Insert(call);
+    ids.push_back(call.id);
+  }
+  EXPECT_EQ(table.size(), 100);
+  EXPECT_GE(table.capacity(), 200);
+  PendingCallTable::Call call;
+  // Out of the order, the shifted calls are still found.
+  for (int i = 0; i < ids.size(); i += 2) {
+    EXPECT_TRUE(table.Remove(ids[i], &call));
+    EXPECT_EQ(call.id, ids[i]);
+    EXPECT_FALSE(table.Remove(ids[i], &call));
+  }
+  for (int i = 1; i < ids.size(); i += 2) {
+    EXPECT_TRUE(table.Remove(ids[i], &call));
+  }
+  EXPECT_EQ(table.size(), 0);
+}
+
+TEST(PendingCallTableTest, Collide) {
+  PendingCallTable table;
+  const int capacity = table.capacity();
+  // The ids of the same home slot, and the last ones wrap around the end.
+  const uint64 ids[] = { 1, capacity + 1, 2 * capacity + 1, capacity - 1,
+    2 * capacity - 1, 3 * capacity - 1 };
+  const int n = sizeof(ids) / sizeof(ids[0]);
+  for (int i = 0; i < n; ++i) {
+    PendingCallTable::Call call;
+    call.id = ids[i];
+    table.Insert(call);
+  }
+  EXPECT_EQ(table.capacity(), capacity);
+  const uint64 removes[] = { capacity - 1, 1, 3 * capacity - 1,
+    2 * capacity + 1, 2 * capacity - 1, capacity + 1 };
+  for (int i = 0; i < n; ++i) {
+    PendingCallTable::Call call;
+    EXPECT_TRUE(table.Remove(removes[i], &call)) << removes[i];
+    EXPECT_EQ(call.id, removes[i]);
+  }
+  EXPECT_EQ(table.size(), 0);
+}
+
+TEST(PendingCallTableTest, Clear) {
+  PendingCallTable table;
+  for (int i = 0; i < 10; ++i) {
+    table.Insert(NewCall(&table));
+  }
+  vector<PendingCallTable::Call> calls;
+  table.Clear(&calls);
+  EXPECT_EQ(calls.size(), 10);
+  EXPECT_EQ(table.size(), 0);
+  PendingCallTable::Call call;
+  EXPECT_FALSE(table.Remove(calls[0].id, &call));
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -33,81 +33,242 @@
 
 #include "server/protobuf_connection.hpp"
 #include "server/raw_protobuf_connection.hpp"
-static void CallServiceMethodDone(
-    boost::shared_ptr<Connection> connection,
-    const ProtobufDecoder *decoder,
-    boost::shared_ptr<google::protobuf::Message> resource,
-    boost::shared_ptr<google::protobuf::Message> response) {
+#include "server/method_cache.hpp"
+void ProtobufConnection::ServiceContext::Run() {
+  CallServiceMethodDone(this);
+  // The connection may hold the last reference of the pool.
+  boost::shared_ptr<ServiceContextPool> context_pool;
+  context_pool.swap(pool);
+  controller.Clear();
+  if (bytes < 0 || bytes > max_bytes) {
+    delete this;
+    return;
+  }
+  response->Clear();
+  context_pool->Put(this);
+}
+
+void ProtobufConnection::CallServiceMethodDone(ServiceContext *context) {
+  Connection *connection = context->controller.connection();
   VLOG(2) << connection->name() << " : " << "HandleService->CallServiceMethodDone()";
-  CHECK(decoder != NULL);
-  const ProtobufLineFormat::MetaData &request_meta = decoder->meta();
+  static_cast<ProtobufConnection *>(connection)->FinishServing(context);
+  // The client had dropped the call.
+  if (context->controller.canceled()) {
+    VLOG(2) << connection->name() << " : " << "Drop the canceled response";
+    context->bytes = -1;
+    return;
+  }
   ProtobufLineFormat::MetaData response_meta;
   response_meta.set_type(ProtobufLineFormat::MetaData::RESPONSE);
-  response_meta.set_identify(request_meta.response_identify());
-  CHECK(response->AppendToString(response_meta.mutable_content()))
+  response_meta.set_identify(context->call_id);
+  if (context->method_index >= 0) {
+    response_meta.set_method_index(context->method_index);
+  }
+  CHECK(context->response->IsInitialized())
     << "Fail to serialize response for requst: ";
-  EncodeData data = EncodeMessage(&response_meta);
+  EncodeData data = EncodeMessage(&response_meta, context->response.get(),
+                                  context->binary);
+  // Sized by the encoding.
+  context->bytes += context->response->GetCachedSize();
   if (!connection->PushData(data)) {
-    delete data.first;
-    delete data.second;
-  }
-  if (!connection->ScheduleWrite()) {
-    delete data.first;
-    delete data.second;
+    delete data.data;
+    delete data.payload;
+    return;
   }
+  connection->ScheduleWrite();
 }
 
-static void HandleService(
-    google::protobuf::Service *service,
-    const google::protobuf::MethodDescriptor *method,
-    const google::protobuf::Message *request_prototype,
-    const google::protobuf::Message *response_prototype,
-    const ProtobufDecoder *decoder,
+void ProtobufConnection::HandleService(
+    const ServiceCall &call, const char *content, int content_size,
     boost::shared_ptr<Connection> connection) {
-  VLOG(2) << connection->name() << " : " <<  "HandleService: " << method->full_name();
-  const ProtobufLineFormat::MetaData &meta = decoder->meta();
-  boost::shared_ptr<google::protobuf::Message> request(request_prototype->New());
-  const string &content = decoder->meta().content();
-  VLOG(2) << connection->name() << " : " << "content size: " << content.size();
-  if (!request->ParseFromArray(
-      content.c_str(),
-      content.size())) {
+  const MethodHandler &handler = *call.handler;
+  VLOG(2) << connection->name() << " : " <<  "HandleService: " << handler.method->full_name();
+  // The client stopped waiting, tell it the call is dropped.
+  if (call.deadline_us > 0 && MonotonicUs() > call.deadline_us) {
+    VLOG(1) << connection->name() << " : " << "Drop the request past the deadline: "
+            << handler.method->full_name();
+    EncodeData data = EncodeControl(CONTROL_DROP, call.call_id);
+    if (!connection->PushData(data)) {
+      delete data.data;
+      return;
+    }
+    connection->ScheduleWrite();
+    return;
+  }
+  ServiceContext *context = handler.context_pool->Get();
+  if (context == NULL) {
+    context = new ServiceContext(handler);
+  }
+  VLOG(2) << connection->name() << " : " << "content size: " << content_size;
+  if (!context->request->ParseFromArray(content, content_size)) {
     LOG(WARNING) << connection->name() << " : " << "HandleService but invalid format";
+    delete context;
     return;
   }
-  boost::shared_ptr<google::protobuf::Message> response(response_prototype->New());
-  google::protobuf::Closure *done = NewClosure(
-      boost::bind(CallServiceMethodDone,
-                  connection,
-                  decoder,
-                  request,
-                  response));
-  service->CallMethod(method, connection.get(), request.get(), response.get(), done);
+  context->pool = handler.context_pool;
+  context->call_id = call.call_id;
+  context->binary = call.binary;
+  context->method_index = call.method_index;
+  context->bytes = content_size;
+  context->max_bytes = handler.context_max_bytes;
+  context->controller.Start(connection, call.deadline_us);
+  static_cast<ProtobufConnection *>(connection.get())->StartServing(context);
+  // The connection is the controller, the context is the done closure.
+  handler.service->CallMethod(handler.method, connection.get(),
+                              context->request.get(),
+                              context->response.get(), context);
 }
 
-bool ProtobufConnection::RegisterService(google::protobuf::Service *service) {
-  if (handler_table_.get() == NULL) {
-    handler_table_.reset(new HandlerTable);
+void ProtobufConnection::QueueService(
+    ServiceCall *call, boost::shared_ptr<Connection> connection) {
+  {
+    boost::mutex::scoped_lock locker(service_queue_mutex_);
+    service_queue_.push_back(call);
+    if (service_queue_running_) {
+      return;
+    }
+    service_queue_running_ = true;
   }
+  call->handler->executor->Run(boost::bind(
+      &ProtobufConnection::RunServiceQueue, this, connection,
+      call->handler->executor));
+}
+
+void ProtobufConnection::RunServiceQueue(
+    boost::shared_ptr<Connection> connection, Executor *executor) {
+  while (true) {
+    ServiceCall *call;
+    {
+      boost::mutex::scoped_lock locker(service_queue_mutex_);
+      if (service_queue_.empty()) {
+        service_queue_running_ = false;
+        return;
+      }
+      call = service_queue_.front();
+      // Go on in the executor of the next call.
+      Executor *next = call->handler->executor;
+      if (next != executor) {
+        locker.unlock();
+        next->Run(boost::bind(&ProtobufConnection::RunServiceQueue, this,
+                              connection, next));
+        return;
+      }
+      service_queue_.pop_front();
+    }
+    HandleService(*call, call->content.data(), call->content.size(),
+                  connection);
+    delete call;
+  }
+}
+
+void ProtobufConnection::StartServing(ServiceContext *context) {
+  boost::mutex::scoped_lock locker(serving_mutex_);
+  context->prev = NULL;
+  context->next = serving_;
+  if (serving_ != NULL) {
+    serving_->prev = context;
+  }
+  serving_ = context;
+}
+
+void ProtobufConnection::FinishServing(ServiceContext *context) {
+  {
+    boost::mutex::scoped_lock locker(serving_mutex_);
+    if (context->prev != NULL) {
+      context->prev->next = context->next;
+    } else {
+      serving_ = context->next;
+    }
+    if (context->next != NULL) {
+      context->next->prev = context->prev;
+    }
+    context->prev = context->next = NULL;
+  }
+  context->controller.Finish();
+}
+
+void ProtobufConnection::CancelServing(uint64 call_id) {
+  {
+    // The queued call is dropped before it starts, the client isn't
+    // waiting for the response.
+    boost::mutex::scoped_lock locker(service_queue_mutex_);
+    for (std::deque<ServiceCall *>::iterator it = service_queue_.begin();
+         it != service_queue_.end(); ++it) {
+      if ((*it)->call_id == call_id) {
+        VLOG(2) << name() << " : " << "Drop the queued call: " << call_id;
+        delete *it;
+        service_queue_.erase(it);
+        return;
+      }
+    }
+  }
+  google::protobuf::Closure *callback = NULL;
+  {
+    // The context is recycled only after it leaves the list.
+    boost::mutex::scoped_lock locker(serving_mutex_);
+    ServiceContext *context = serving_;
+    while (context != NULL && context->call_id != call_id) {
+      context = context->next;
+    }
+    if (context == NULL) {
+      VLOG(2) << name() << " : " << "Cancel unknown call: " << call_id;
+      return;
+    }
+    callback = context->controller.Cancel();
+  }
+  if (callback != NULL) {
+    callback->Run();
+  }
+}
+
+bool ProtobufConnection::CancelCall(uint64 call_id) {
+  RawConnectionStatus::Locker locker(status_.get());
+  if (status_->closing() || impl_.get() == NULL) {
+    return false;
+  }
+  RawProtobufConnection *impl = static_cast<RawProtobufConnection*>(impl_.get());
+  return impl->CancelCall(status_, call_id);
+}
+
+bool ProtobufConnection::RegisterService(google::protobuf::Service *service,
+                                         Executor *executor) {
   const google::protobuf::ServiceDescriptor *service_descriptor =
     service->GetDescriptor();
   for (int i = 0; i < service_descriptor->method_count(); ++i) {
     const google::protobuf::MethodDescriptor *method = service_descriptor->method(i);
-    const google::protobuf::Message *request = &service->GetRequestPrototype(method);
-    const google::protobuf::Message *response = &service->GetResponsePrototype(method);
     const string &method_name = method->full_name();
-    const uint64 method_fingerprint = hash8(method_name);
-    HandlerTable::const_iterator it = handler_table_->find(method_fingerprint);
-    CHECK(it == handler_table_->end())
+    const uint64 method_fingerprint = MethodCache::Fingerprint(method);
+    MethodIndexTable::const_iterator it = method_index_table_.find(
+        method_fingerprint);
+    CHECK(it == method_index_table_.end())
       << " unfortunately, the method name: " << method_name
       << " is conflict with another name after hash("
       << method_fingerprint << ") please change.";
-    handler_table_->insert(make_pair(
-        method_fingerprint,
-        boost::bind(
-        HandleService, service, method, request, response,
-        _1, _2)));
+    MethodHandler handler;
+    handler.fingerprint = method_fingerprint;
+    handler.service = service;
+    handler.method = method;
+    handler.request_prototype = &service->GetRequestPrototype(method);
+    handler.response_prototype = &service->GetResponsePrototype(method);
+    handler.executor = executor;
+    handler.context_pool.reset(new ServiceContextPool(context_pool_size_));
+    handler.context_max_bytes = context_max_bytes_;
+    method_index_table_.insert(make_pair(method_fingerprint,
+                                         method_table_.size()));
+    method_table_.push_back(handler);
   }
+  return true;
+}
+
+bool ProtobufConnection::SetExecutor(
+    const google::protobuf::MethodDescriptor *method, Executor *executor) {
+  MethodIndexTable::const_iterator it = method_index_table_.find(
+      MethodCache::Fingerprint(method));
+  if (it == method_index_table_.end()) {
+    return false;
+  }
+  method_table_[it->second].executor = executor;
+  return true;
 }
 
 void ProtobufConnection::CallMethod(const google::protobuf::MethodDescriptor *method,
@@ -115,7 +276,7 @@ void ProtobufConnection::CallMethod(const google::protobuf::MethodDescriptor *me
                                     const google::protobuf::Message *request,
                                     google::protobuf::Message *response,
                                     google::protobuf::Closure *done) {
-  RawConnectionStatus::Locker locker(status_->mutex());
+  RawConnectionStatus::Locker locker(status_.get());
   if (status_->closing() || impl_.get() == NULL) {
     VLOG(2) << "CallMethod " << name() << " but is closing";
     RpcController *rpc_controller = dynamic_cast<RpcController*>(
@@ -136,18 +297,48 @@ void ProtobufConnection::CallMethod(const google::protobuf::MethodDescriptor *me
 bool ProtobufConnection::Handle(
     boost::shared_ptr<Connection> connection,
     const ProtobufDecoder *decoder) const {
-  if (handler_table_.get() == NULL) {
+  if (method_table_.empty()) {
     return false;
   }
   VLOG(2) << connection->name() << ".ProtobufConnection.Handle";
   const ProtobufLineFormat::MetaData &meta = decoder->meta();
-  HandlerTable::value_type::second_type handler;
-  HandlerTable::const_iterator it = handler_table_->find(meta.identify());
-  if (it != handler_table_->end()) {
-    it->second(decoder, connection);
+  const int64 deadline_us = meta.has_timeout_ms() ?
+    MonotonicUs() + meta.timeout_ms() * 1000LL : 0;
+  // The index comes from the peer, compare it unsigned so no value can
+  // pass the bound. The fingerprint guards against a stale index.
+  int index;
+  if (meta.has_method_index() && meta.method_index() < method_table_.size() &&
+      method_table_[meta.method_index()].fingerprint == meta.identify()) {
+    index = meta.method_index();
+  } else {
+    MethodIndexTable::const_iterator it = method_index_table_.find(
+        meta.identify());
+    if (it == method_index_table_.end()) {
+      return false;
+    }
+    index = it->second;
+  }
+  ServiceCall call;
+  call.handler = &method_table_[index];
+  // Tell the peer the index unless it already sent it.
+  call.method_index = meta.has_method_index() &&
+    meta.method_index() == static_cast<uint32>(index) ? -1 : index;
+  call.deadline_us = deadline_us;
+  call.call_id = meta.response_identify();
+  // Answer in the binary frame if the client can decode it.
+  call.binary = decoder->binary() || meta.binary_frame();
+  // The decoder is reused once the Handle returns, so the queued call
+  // keeps a copy of the content.
+  if (call.handler->executor != NULL) {
+    ServiceCall *queued = new ServiceCall(call);
+    queued->content.assign(decoder->payload(), decoder->payload_size());
+    static_cast<ProtobufConnection *>(connection.get())->QueueService(
+        queued, connection);
     return true;
   }
-  return false;
+  HandleService(call, decoder->payload(), decoder->payload_size(),
+                connection);
+  return true;
 }
 
 boost::shared_ptr<Connection> ProtobufConnection::Span(
@@ -174,7 +365,15 @@ bool ProtobufConnection::Attach(
     return false;
   }
 
+  {
+    boost::mutex::scoped_lock locker(listener_mutex_);
+    listeners_closed_ = false;
+  }
   impl_.reset(raw_connection);
+  flush_policy_ = service_connection->flush_policy();
+  impl_->set_flush_policy(flush_policy_);
+  socket_profile_ = service_connection->socket_profile();
+  impl_->set_socket_profile(socket_profile_);
   impl_->InitSocket(status_, socket);
   return true;
 }
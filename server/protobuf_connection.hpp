@@ -40,20 +40,44 @@
 #include <boost/thread/condition.hpp>
 #include <boost/thread/mutex.hpp>
 #include <glog/logging.h>
+#include <protobuf/service.h>
+#include <deque>
+#include "base/executor.hpp"
+#include "server/object_pool.hpp"
 class ProtobufDecoder;
 class ProtobufConnection : public Connection {
  private:
-  typedef boost::function2<void,
-          const ProtobufDecoder*,
-          boost::shared_ptr<Connection> > HandlerFunctor;
-  typedef hash_map<uint64, HandlerFunctor> HandlerTable;
+  class ServiceContext;
+  typedef ObjectPool<ServiceContext> ServiceContextPool;
+ public:
+  // A registered method, dispatched by its index in the method table.
+  struct MethodHandler {
+    uint64 fingerprint;
+    google::protobuf::Service *service;
+    const google::protobuf::MethodDescriptor *method;
+    const google::protobuf::Message *request_prototype;
+    const google::protobuf::Message *response_prototype;
+    // Run the method in the executor, NULL to run in the io_service.
+    Executor *executor;
+    // The contexts of the finished calls, shared by the spanned connections.
+    boost::shared_ptr<ServiceContextPool> context_pool;
+    // The context of a larger request or response isn't pooled.
+    int context_max_bytes;
+  };
+ private:
+  typedef hash_map<uint64, int> MethodIndexTable;
  public:
   explicit ProtobufConnection(const string &name)
-    : Connection(name) {
+    : Connection(name), context_pool_size_(kContextPoolSize),
+      context_max_bytes_(kContextMaxBytes), serving_(NULL),
+      service_queue_running_(false) {
     VLOG(2) << "New protobuf connection: " << name;
   }
 
   ~ProtobufConnection() {
+    for (size_t i = 0; i < service_queue_.size(); ++i) {
+      delete service_queue_[i];
+    }
   }
   virtual boost::shared_ptr<Connection> Span(
       boost::asio::ip::tcp::socket *socket);
@@ -61,18 +85,102 @@ class ProtobufConnection : public Connection {
       ProtobufConnection *service_connection,
       boost::asio::ip::tcp::socket *socket);
 
-  // Non thread safe.
-  bool RegisterService(google::protobuf::Service *service);
+  // Non thread safe. The methods of the service run in the executor, or in
+  // the io_service thread reading the request if it's NULL. The calls of
+  // one connection to the methods in the executors start in the order
+  // they're read, the other calls don't wait for them.
+  bool RegisterService(google::protobuf::Service *service,
+                       Executor *executor = NULL);
+  // Non thread safe. Run the registered method in the executor, return
+  // false if the method isn't registered.
+  bool SetExecutor(const google::protobuf::MethodDescriptor *method,
+                   Executor *executor);
+  // Non thread safe, only applies to the services registered later. Each
+  // method keeps the contexts of at most size finished calls, the pooled
+  // messages keep their capacity, so the context of a request or response
+  // larger than the max_bytes is deleted instead.
+  void set_context_pool(int size, int max_bytes) {
+    context_pool_size_ = size;
+    context_max_bytes_ = max_bytes;
+  }
   // Thread safe.
   void CallMethod(const google::protobuf::MethodDescriptor *method,
                   google::protobuf::RpcController *controller,
                   const google::protobuf::Message *request,
                   google::protobuf::Message *response,
                   google::protobuf::Closure *done);
+  // Thread safe.
+  bool CancelCall(uint64 call_id);
  private:
+  static const int kContextPoolSize = 8;
+  static const int kContextMaxBytes = 64 * 1024;
+  // The request, the response, the controller and the done closure of a
+  // served call in one block, reused by the calls of the method.
+  class ServiceContext : public ServiceClosure {
+   public:
+    explicit ServiceContext(const MethodHandler &handler)
+      : request(handler.request_prototype->New()),
+        response(handler.response_prototype->New()),
+        call_id(0), binary(false), method_index(-1), bytes(0), max_bytes(0),
+        prev(NULL), next(NULL) {
+    }
+    // Send the response and put the context back into the pool.
+    void Run();
+    boost::scoped_ptr<google::protobuf::Message> request;
+    boost::scoped_ptr<google::protobuf::Message> response;
+    // Only held while the call is served.
+    boost::shared_ptr<ServiceContextPool> pool;
+    uint64 call_id;
+    bool binary;
+    // Sent back if it's not -1.
+    int method_index;
+    // The size of the request and the response, -1 if unknown.
+    int bytes;
+    int max_bytes;
+    // In the serving list of the connection.
+    ServiceContext *prev, *next;
+  };
   virtual bool Handle(boost::shared_ptr<Connection> connection,
                       const ProtobufDecoder *decoder) const;
-  scoped_ptr<HandlerTable> handler_table_;
+  // A decoded request to dispatch.
+  struct ServiceCall {
+    // In the method table of the service connection, which is only changed
+    // by the RegisterService and the SetExecutor before the calls.
+    const MethodHandler *handler;
+    int method_index;
+    int64 deadline_us;
+    uint64 call_id;
+    bool binary;
+    // Only set when the call is queued.
+    string content;
+  };
+  static void HandleService(const ServiceCall &call,
+                            const char *content, int content_size,
+                            boost::shared_ptr<Connection> connection);
+  static void CallServiceMethodDone(ServiceContext *context);
+  // Run the queued calls in order, each in the executor of its method,
+  // the method of the call has an executor.
+  void QueueService(ServiceCall *call,
+                    boost::shared_ptr<Connection> connection);
+  void RunServiceQueue(boost::shared_ptr<Connection> connection,
+                       Executor *executor);
+  // The calls served by the connection, the cancel looks up the response
+  // identify in the list. A call still in the service queue is dropped.
+  void StartServing(ServiceContext *context);
+  void FinishServing(ServiceContext *context);
+  void CancelServing(uint64 call_id);
+  // Indexed by the MetaData.method_index, the index table is for the peers
+  // that don't know the index yet.
+  vector<MethodHandler> method_table_;
+  int context_pool_size_;
+  int context_max_bytes_;
+  MethodIndexTable method_index_table_;
+  ServiceContext *serving_;
+  boost::mutex serving_mutex_;
+  // The calls of the methods in the executors, run in order.
+  std::deque<ServiceCall *> service_queue_;
+  bool service_queue_running_;
+  boost::mutex service_queue_mutex_;
   friend class RawProtobufConnection;
 };
 #endif  // NET2_PROTOBUF_CONNECTION_HPP_
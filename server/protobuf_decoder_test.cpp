@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "boost/date_time/posix_time/posix_time.hpp"
+#include "server/protobuf_connection.hpp"
+#include "server/raw_protobuf_connection.hpp"
+DEFINE_int32(benchmark_mb, 32, "The data size in MB for each benchmark");
+
+// The per byte decoder before the chunk decoder, as the benchmark baseline.
+class ByteProtobufDecoder {
+ public:
+  ByteProtobufDecoder() : state_(Start), length_(0) {
+  }
+  boost::tuple<boost::tribool, const char *> Decode(
+      const char *begin, const char *end) {
+    while (begin != end) {
+      boost::tribool result = Consume(*begin++);
+      if (result || !result) {
+        return boost::make_tuple(result, begin);
+      }
+    }
+    boost::tribool result = boost::indeterminate;
+    return boost::make_tuple(result, begin);
+  }
+  void reset() {
+    state_ = Start;
+    length_store_.clear();
+    length_ = 0;
+    content_.clear();
+  }
+ private:
+  boost::tribool Consume(char input) {
+    switch (state_) {
+      case Start:
+        state_ = Length;
+        length_store_.clear();
+        length_store_.push_back(input);
+        return boost::indeterminate;
+      case Length:
+        if (input == ':') {
+          state_ = Content;
+          length_ = boost::lexical_cast<int>(length_store_);
+          content_.reserve(length_);
+        } else {
+          length_store_.push_back(input);
+        }
+        return boost::indeterminate;
+      case Content:
+        content_.push_back(input);
+        if (content_.full()) {
+          return meta_.ParseFromArray(content_.content(), content_.capacity());
+        }
+        return boost::indeterminate;
+    }
+    return false;
+  }
+  enum State {
+    Start,
+    Length,
+    Content,
+  } state_;
+  string length_store_;
+  int length_;
+  Buffer<char> content_;
+  ProtobufLineFormat::MetaData meta_;
+};
+
+static string Payload(const ProtobufDecoder &decoder) {
+  return string(decoder.payload(), decoder.payload_size());
+}
+
+class ProtobufDecoderTest : public testing::Test {
+ protected:
+  static const int kReadSize = 64 * 1024;
+  // Return the encoded frame with content_size bytes content.
+  string Frame(int content_size, bool binary = false, uint8 flags = 0) {
+    ProtobufLineFormat::MetaData meta;
+    meta.set_type(ProtobufLineFormat::MetaData::RESPONSE);
+    meta.set_identify(content_size);
+    meta.mutable_content()->assign(content_size, 'x');
+    EncodeData data = EncodeMessage(&meta, NULL, binary, flags);
+    string ret = data.data->substr(data.offset);
+    delete data.data;
+    return ret;
+  }
+  // Decode the stream in kReadSize reads, return the number of messages.
+  template <typename Decoder>
+  int Run(const string &stream) {
+    Decoder decoder;
+    int messages = 0;
+    for (int i = 0; i < stream.size(); i += kReadSize) {
+      const char *p = stream.data() + i;
+      const char *end = p + min(kReadSize, static_cast<int>(stream.size() - i));
+      while (p < end) {
+        boost::tribool result;
+        boost::tie(result, p) = decoder.Decode(p, end);
+        if (result) {
+          ++messages;
+          decoder.reset();
+        } else if (!result) {
+          return -1;
+        }
+      }
+    }
+    return messages;
+  }
+  template <typename Decoder>
+  double Benchmark(const string &stream, int expected) {
+    boost::posix_time::ptime start =
+      boost::posix_time::microsec_clock::universal_time();
+    EXPECT_EQ(Run<Decoder>(stream), expected);
+    boost::posix_time::time_duration elapsed =
+      boost::posix_time::microsec_clock::universal_time() - start;
+    return stream.size() / 1024.0 / 1024.0 /
+      (elapsed.total_microseconds() / 1000000.0);
+  }
+};
+
+const int ProtobufDecoderTest::kReadSize;
+
+TEST_F(ProtobufDecoderTest, MultiFrame) {
+  const string stream = Frame(100) + Frame(4096) + Frame(1);
+  ProtobufDecoder decoder;
+  const char *p = stream.data();
+  const char *end = p + stream.size();
+  const int sizes[] = {100, 4096, 1};
+  for (int i = 0; i < arraysize(sizes); ++i) {
+    boost::tribool result;
+    boost::tie(result, p) = decoder.Decode(p, end);
+    ASSERT_TRUE(result);
+    EXPECT_EQ(decoder.meta().identify(), sizes[i]);
+    EXPECT_EQ(Payload(decoder), string(sizes[i], 'x'));
+    decoder.reset();
+  }
+  EXPECT_TRUE(p == end);
+}
+
+TEST_F(ProtobufDecoderTest, Split) {
+  const string stream = Frame(100);
+  for (int i = 0; i < stream.size(); ++i) {
+    ProtobufDecoder decoder;
+    boost::tribool result;
+    const char *p;
+    boost::tie(result, p) = decoder.Decode(stream.data(), stream.data() + i);
+    EXPECT_TRUE(boost::indeterminate(result)) << i;
+    EXPECT_TRUE(p == stream.data() + i);
+    boost::tie(result, p) = decoder.Decode(p, stream.data() + stream.size());
+    ASSERT_TRUE(result) << i;
+    EXPECT_EQ(Payload(decoder), string(100, 'x'));
+  }
+}
+
+TEST_F(ProtobufDecoderTest, DirectBuffer) {
+  const string stream = Frame(4096);
+  ProtobufDecoder decoder;
+  boost::tribool result;
+  const char *p;
+  boost::tie(result, p) = decoder.Decode(stream.data(), stream.data() + 100);
+  EXPECT_TRUE(boost::indeterminate(result));
+  boost::asio::mutable_buffer direct = decoder.direct_buffer();
+  const int rest = stream.data() + stream.size() - p;
+  ASSERT_EQ(boost::asio::buffer_size(direct), rest);
+  memcpy(boost::asio::buffer_cast<char *>(direct), p, rest);
+  EXPECT_TRUE(decoder.Commit(rest));
+  EXPECT_EQ(Payload(decoder), string(4096, 'x'));
+}
+
+TEST_F(ProtobufDecoderTest, BinaryFrame) {
+  const string stream = Frame(100, true) + Frame(200) + Frame(70000, true, 0x2);
+  ProtobufDecoder decoder;
+  const char *p = stream.data();
+  const char *end = p + stream.size();
+  const int sizes[] = {100, 200, 70000};
+  const bool binary[] = {true, false, true};
+  const uint8 flags[] = {0, 0, 0x2};
+  for (int i = 0; i < arraysize(sizes); ++i) {
+    boost::tribool result;
+    boost::tie(result, p) = decoder.Decode(p, end);
+    ASSERT_TRUE(result);
+    EXPECT_EQ(decoder.binary(), binary[i]);
+    EXPECT_EQ(decoder.flags(), flags[i]);
+    EXPECT_EQ(Payload(decoder), string(sizes[i], 'x'));
+    decoder.reset();
+  }
+  EXPECT_TRUE(p == end);
+  const string frame = Frame(300, true);
+  for (int i = 0; i < frame.size(); ++i) {
+    ProtobufDecoder decoder;
+    boost::tribool result;
+    boost::tie(result, p) = decoder.Decode(frame.data(), frame.data() + i);
+    EXPECT_TRUE(boost::indeterminate(result)) << i;
+    boost::tie(result, p) = decoder.Decode(p, frame.data() + frame.size());
+    ASSERT_TRUE(result) << i;
+    EXPECT_EQ(Payload(decoder), string(300, 'x'));
+  }
+}
+
+TEST_F(ProtobufDecoderTest, Control) {
+  EncodeData ping = EncodeControl(CONTROL_PING, 1ULL << 40);
+  EncodeData pong = EncodeControl(CONTROL_PONG);
+  const string stream = ping.data->substr(ping.offset) + Frame(10) +
+    pong.data->substr(pong.offset);
+  delete ping.data;
+  delete pong.data;
+  ProtobufDecoder decoder;
+  const char *p = stream.data();
+  const char *end = p + stream.size();
+  boost::tribool result;
+  boost::tie(result, p) = decoder.Decode(p, end);
+  ASSERT_TRUE(result);
+  EXPECT_TRUE(decoder.control());
+  EXPECT_EQ(decoder.control_type(), CONTROL_PING);
+  EXPECT_EQ(decoder.control_argument(), 1ULL << 40);
+  decoder.reset();
+  boost::tie(result, p) = decoder.Decode(p, end);
+  ASSERT_TRUE(result);
+  EXPECT_FALSE(decoder.control());
+  EXPECT_EQ(Payload(decoder), string(10, 'x'));
+  decoder.reset();
+  boost::tie(result, p) = decoder.Decode(p, end);
+  ASSERT_TRUE(result);
+  EXPECT_TRUE(decoder.control());
+  EXPECT_EQ(decoder.control_type(), CONTROL_PONG);
+  EXPECT_EQ(decoder.control_argument(), 0);
+  EXPECT_TRUE(p == end);
+}
+
+TEST_F(ProtobufDecoderTest, BadHeader) {
+  const string streams[] = {
+    string("x"),
+    string("99999999999:"),
+    // Compressed frame.
+    string("\xb5\x01\x01", 3),
+    // The varint length overflow.
+    string("\xb5\x00\xff\xff\xff\xff\x7f", 7),
+  };
+  for (int i = 0; i < arraysize(streams); ++i) {
+    ProtobufDecoder decoder;
+    boost::tribool result;
+    const char *p;
+    boost::tie(result, p) = decoder.Decode(
+        streams[i].data(), streams[i].data() + streams[i].size());
+    EXPECT_FALSE(result) << i;
+  }
+}
+
+TEST_F(ProtobufDecoderTest, Payload) {
+  ProtobufLineFormat::MetaData payload;
+  payload.set_type(ProtobufLineFormat::MetaData::REQUEST);
+  payload.set_identify(1);
+  payload.mutable_content()->assign(1000, 'y');
+  ProtobufLineFormat::MetaData meta;
+  meta.set_type(ProtobufLineFormat::MetaData::REQUEST);
+  meta.set_identify(2);
+  meta.set_response_identify(3);
+  for (int binary = 0; binary < 2; ++binary) {
+    EncodeData data = EncodeMessage(&meta, &payload, binary);
+    ASSERT_TRUE(data.payload != NULL);
+    EXPECT_EQ(*data.payload, payload.SerializeAsString());
+    const string stream = data.data->substr(data.offset) + *data.payload;
+    delete data.data;
+    delete data.payload;
+    ProtobufDecoder decoder;
+    boost::tribool result;
+    const char *p;
+    boost::tie(result, p) = decoder.Decode(
+        stream.data(), stream.data() + stream.size());
+    ASSERT_TRUE(result);
+    EXPECT_TRUE(p == stream.data() + stream.size());
+    EXPECT_EQ(decoder.meta().response_identify(), 3);
+    EXPECT_EQ(Payload(decoder), payload.SerializeAsString());
+  }
+}
+
+TEST_F(ProtobufDecoderTest, PayloadInPlace) {
+  // The content field between the others, as the old peers serialize it,
+  // and twice, the last one wins.
+  ProtobufLineFormat::MetaData meta;
+  meta.set_type(ProtobufLineFormat::MetaData::REQUEST);
+  meta.set_identify(2);
+  meta.set_response_identify(3);
+  meta.set_content("old");
+  meta.set_binary_frame(true);
+  meta.set_method_index(7);
+  string content = meta.SerializeAsString();
+  meta.Clear();
+  meta.set_content(string(100, 'x'));
+  meta.set_timeout_ms(5);
+  content += meta.SerializePartialAsString();
+  const string stream =
+    boost::lexical_cast<string>(content.size()) + ":" + content;
+  ProtobufDecoder decoder;
+  boost::tribool result;
+  const char *p;
+  boost::tie(result, p) = decoder.Decode(
+      stream.data(), stream.data() + stream.size());
+  ASSERT_TRUE(result);
+  EXPECT_TRUE(p == stream.data() + stream.size());
+  EXPECT_EQ(Payload(decoder), string(100, 'x'));
+  // Points into the input.
+  EXPECT_TRUE(decoder.payload() > stream.data() &&
+              decoder.payload() < stream.data() + stream.size());
+  EXPECT_FALSE(decoder.meta().has_content());
+  EXPECT_EQ(decoder.meta().identify(), 2);
+  EXPECT_EQ(decoder.meta().response_identify(), 3);
+  EXPECT_TRUE(decoder.meta().binary_frame());
+  EXPECT_EQ(decoder.meta().method_index(), 7);
+  EXPECT_EQ(decoder.meta().timeout_ms(), 5);
+  // Without the content, or truncated in the content.
+  meta.Clear();
+  meta.set_type(ProtobufLineFormat::MetaData::RESPONSE);
+  meta.set_identify(1);
+  const string bad[] = {
+    meta.SerializePartialAsString(),
+    content.substr(0, content.size() - 1),
+  };
+  for (int i = 0; i < arraysize(bad); ++i) {
+    const string stream =
+      boost::lexical_cast<string>(bad[i].size()) + ":" + bad[i];
+    ProtobufDecoder decoder;
+    boost::tie(result, p) = decoder.Decode(
+        stream.data(), stream.data() + stream.size());
+    EXPECT_FALSE(result) << i;
+  }
+}
+
+TEST_F(ProtobufDecoderTest, EncodeBenchmark) {
+  const int sizes[] = {100, 4096, 640 * 1024};
+  for (int i = 0; i < arraysize(sizes); ++i) {
+    ProtobufLineFormat::MetaData payload;
+    payload.set_type(ProtobufLineFormat::MetaData::RESPONSE);
+    payload.set_identify(1);
+    payload.mutable_content()->assign(sizes[i], 'x');
+    const int count = max(1, FLAGS_benchmark_mb * 1024 * 1024 / sizes[i]);
+    double mbs[2];
+    for (int k = 0; k < 2; ++k) {
+      boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::universal_time();
+      for (int j = 0; j < count; ++j) {
+        ProtobufLineFormat::MetaData meta;
+        meta.set_type(ProtobufLineFormat::MetaData::REQUEST);
+        meta.set_identify(j);
+        meta.set_response_identify(j);
+        EncodeData data;
+        if (k == 0) {
+          // Serialize the payload into the meta, then the meta again.
+          payload.AppendToString(meta.mutable_content());
+          data = EncodeMessage(&meta, NULL);
+        } else {
+          data = EncodeMessage(&meta, &payload);
+        }
+        delete data.data;
+        delete data.payload;
+      }
+      boost::posix_time::time_duration elapsed =
+        boost::posix_time::microsec_clock::universal_time() - start;
+      mbs[k] = static_cast<double>(sizes[i]) * count / 1024.0 / 1024.0 /
+        (elapsed.total_microseconds() / 1000000.0);
+    }
+    LOG(INFO) << "Payload: " << sizes[i]
+              << " nested encode: " << mbs[0] << " MB/s"
+              << " scatter gather encode: " << mbs[1] << " MB/s";
+  }
+}
+
+TEST_F(ProtobufDecoderTest, Benchmark) {
+  const int sizes[] = {100, 4096, 640 * 1024};
+  for (int i = 0; i < arraysize(sizes); ++i) {
+    const string frame = Frame(sizes[i]);
+    const int count = max(1, FLAGS_benchmark_mb * 1024 * 1024 /
+                          static_cast<int>(frame.size()));
+    string stream;
+    stream.reserve(frame.size() * count);
+    for (int j = 0; j < count; ++j) {
+      stream.append(frame);
+    }
+    const double byte_mbs = Benchmark<ByteProtobufDecoder>(stream, count);
+    const double chunk_mbs = Benchmark<ProtobufDecoder>(stream, count);
+    LOG(INFO) << "Frame content: " << sizes[i]
+              << " per byte decoder: " << byte_mbs << " MB/s"
+              << " chunk decoder: " << chunk_mbs << " MB/s";
+  }
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -37,12 +37,19 @@
 #include "server/raw_connection.hpp"
 #include "base/base.hpp"
 #include "base/executor.hpp"
+#include "base/time.hpp"
 #include "glog/logging.h"
 #include "server/meta.pb.h"
 #include "protobuf/service.h"
 #include "boost/thread.hpp"
 #include "server/shared_const_buffers.hpp"
+#include "server/io_service_pool.hpp"
 #include "boost/signals2/signal.hpp"
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+typedef boost::asio::detail::socket_option::boolean<
+  IPPROTO_TCP, TCP_CORK> TcpCork;
+
 class ExecuteHandler {
  public:
   ExecuteHandler(const RawConnection::StatusPtr &status,
@@ -51,9 +58,7 @@ class ExecuteHandler {
     : status_(status), connection_(connection), member_(member) {
   }
   void operator()() {
-    status_->mutex().lock_shared();
-    if (status_->closing()) {
-      status_->mutex().unlock_shared();
+    if (!status_->TryEnter()) {
       return;
     }
     (connection_->*member_)(status_);
@@ -64,6 +69,21 @@ class ExecuteHandler {
   void (RawConnection::*member_)(RawConnection::StatusPtr);
 };
 
+// Count the time of the handler in the load of the io_service, it outlives
+// the connection closed by the handler.
+class LoadTimer {
+ public:
+  explicit LoadTimer(IOServiceLoad *load)
+    : load_(load), start_us_(MonotonicUs()) {
+  }
+  ~LoadTimer() {
+    load_->AddHandlerUs(MonotonicUs() - start_us_);
+  }
+ private:
+  IOServiceLoad *load_;
+  int64 start_us_;
+};
+
 class ReadHandler {
  public:
   ReadHandler(const RawConnection::StatusPtr &status,
@@ -74,11 +94,10 @@ class ReadHandler {
     : status_(status), connection_(connection), member_(member) {
   }
   void operator()(const boost::system::error_code &e, size_t n) {
-    status_->mutex().lock_shared();
-    if (status_->closing()) {
-      status_->mutex().unlock_shared();
+    if (!status_->TryEnter()) {
       return;
     }
+    LoadTimer timer(connection_->load());
     (connection_->*member_)(status_, e, n);
   }
  private:
@@ -89,55 +108,109 @@ class ReadHandler {
 };
 typedef ReadHandler WriteHandler;
 
+class TimerHandler {
+ public:
+  TimerHandler(const RawConnection::StatusPtr &status,
+               RawConnection *connection,
+               void (RawConnection::*member)(
+                   RawConnection::StatusPtr status,
+                   const boost::system::error_code &))
+    : status_(status), connection_(connection), member_(member) {
+  }
+  void operator()(const boost::system::error_code &e) {
+    if (!status_->TryEnter()) {
+      return;
+    }
+    (connection_->*member_)(status_, e);
+  }
+ private:
+  RawConnection::StatusPtr status_;
+  RawConnection *connection_;
+  void (RawConnection::*member_)(
+      RawConnection::StatusPtr status, const boost::system::error_code&);
+};
+
 RawConnection::RawConnection(const string &name,
                              boost::shared_ptr<Connection> connection)
   : name_(name),
-    incoming_index_(0),
+    last_receive_ms_(0),
+    direct_read_(false),
+    receive_reads_(0),
+    receive_direct_reads_(0),
+    receive_bytes_(0),
+    receive_messages_(0),
+    outbound_bytes_(0),
+    queued_bytes_(0),
+    blocked_(0),
+    batching_(0),
+    flush_timer_armed_(0),
+    corked_(false),
+    send_writes_(0),
+    send_frames_(0),
+    send_bytes_(0),
+    tune_bytes_(0),
+    load_(NULL),
+    migrate_to_(NULL),
     connection_(connection) {
 }
 
 void RawConnection::InitSocket(
     StatusPtr status,
     boost::asio::ip::tcp::socket *socket) {
-  RawConnectionStatus::Locker locker(status->mutex());
+  RawConnectionStatus::Locker locker(status.get());
   CHECK(!status->closing());
   RawConnTrace;
   socket_.reset(socket);
-  boost::asio::socket_base::keep_alive keep_alive(true);
-  socket_->set_option(keep_alive);
-  boost::asio::socket_base::linger linger(false, 0);
-  socket_->set_option(linger);
+  load_ = &boost::asio::use_service<IOServiceLoad>(socket_->get_io_service());
+  load_->AddConnection(1);
+  // The frames are coalesced by the flush policy, the profile shouldn't
+  // wait on Nagle unless asked to.
+  socket_profile_.Apply(socket_.get());
+  flush_timer_.reset(new boost::asio::deadline_timer(
+      socket_->get_io_service()));
   // Put the socket into non-blocking mode.
   boost::asio::ip::tcp::socket::non_blocking_io non_blocking_io(true);
   socket_->io_control(non_blocking_io);
-  send_package_ = 0;
-  recv_package_ = 0;
+  last_receive_ms_ = MonotonicMs();
   StartOOBRecv(status);
   status->set_reading();
+  StartRead(status);
+}
+
+void RawConnection::StartRead(StatusPtr status) {
   ReadHandler h(status, this, &RawConnection::HandleRead);
-  socket_->async_read_some(boost::asio::buffer(buffer_), h);
+  boost::asio::mutable_buffer direct = DirectBuffer();
+  // The rest of a large message is read into the decoder's storage
+  // directly, skip the copy from the read window.
+  direct_read_ = boost::asio::buffer_size(direct) >=
+      static_cast<size_t>(buffer_.window());
+  if (direct_read_) {
+    socket_->async_read_some(boost::asio::mutable_buffers_1(direct), h);
+  } else {
+    socket_->async_read_some(buffer_.buffer(), h);
+  }
 }
 
 void RawConnection::Disconnect(StatusPtr status, bool async) {
-  boost::shared_mutex *mut = &status->mutex();
-  if (status->closing()) {
+  if (!status->Close()) {
     VLOG(2) << "Already closing";
-    mut->unlock_shared();
-    return;
-  }
-  mut->unlock_shared();
-  mut->lock_upgrade();
-  mut->unlock_upgrade_and_lock();
-  if (status->closing()) {
-    VLOG(2) << "Already already closing";
-    mut->unlock();
+    status->Leave();
     return;
   }
-  status->set_closing();
-  mut->unlock();
+  status->Leave();
+  // The handlers entered before Close() may still use the connection.
+  status->WaitIdle();
   if (socket_.get()) {
     socket_->close();
     socket_.reset();
+    load_->AddConnection(-1);
+  }
+  // The io_service may be gone before the connection is deleted.
+  flush_timer_.reset();
+  {
+    // The callbacks would never run, and may hold the connection.
+    boost::mutex::scoped_lock locker(writable_callbacks_mutex_);
+    writable_callbacks_.clear();
   }
   boost::shared_ptr<Connection> conn = connection_;
   connection_.reset();
@@ -148,10 +221,33 @@ void RawConnection::Disconnect(StatusPtr status, bool async) {
 
 RawConnection::~RawConnection() {
   VLOG(2) << name() << "~RawConnection";
+  // Release the frames never written.
+  PopOutbound();
+}
+
+int64 RawConnection::IdleMs() const {
+  return MonotonicMs() - last_receive_ms_;
 }
 
 void RawConnection::Heartbeat(StatusPtr status) {
-  RawConnTrace << "Heartbeat send_package: " << send_package_ << " recv_package: " << recv_package_;
+  const int64 idle = IdleMs();
+  RawConnTrace << "Heartbeat idle: " << idle;
+  if (idle > kDeadTimeoutMs) {
+    RawConnTrace << "Nothing received in " << idle << " ms, disconnect";
+    Disconnect(status, true);
+    return;
+  }
+  if (CanPing()) {
+    // Only a quiet peer needs the ping, a peer hearing nothing from us
+    // pings us itself and gets the pong.
+    if (idle >= kIdleTimeoutMs) {
+      SendPing(status);
+    }
+    status->Leave();
+    return;
+  }
+  // The old peers count the OOB heartbeats, send one per period even if
+  // the data flows.
   char heartbeat = kHeartBeat;
   boost::system::error_code ec;
   int n= socket_->send(boost::asio::buffer(&heartbeat, sizeof(heartbeat)),
@@ -161,13 +257,7 @@ void RawConnection::Heartbeat(StatusPtr status) {
     Disconnect(status, true);
     return;
   }
-  ++send_package_;
-  if (abs(send_package_ - recv_package_) > kHeartbeatUnsyncWindow) {
-    RawConnTrace << "send_package_: " << send_package_ << " recv_package_: " << recv_package_  << " not synced, disconnect";
-    Disconnect(status, true);
-    return;
-  }
-  status->mutex().unlock_shared();
+  status->Leave();
 }
 
 void RawConnection::StartOOBRecv(StatusPtr status) {
@@ -179,15 +269,20 @@ void RawConnection::StartOOBRecv(StatusPtr status) {
 
 void RawConnection::OOBRecv(
     StatusPtr status,
-    const boost::system::error_code &e, size_t n) {
-  RawConnTrace << "OOBRecv send_package: " << send_package_ << " recv_package: " << recv_package_ << " e: " << e.message();
+    const boost::system::error_code &e, size_t /* n */) {
+  RawConnTrace << "OOBRecv e: " << e.message();
+  if (e == boost::asio::error::operation_aborted && !status->closing()) {
+    // The socket is migrated, the new one receives the OOB.
+    status->Leave();
+    return;
+  }
   if (e) {
     Disconnect(status, true);
     return;
   }
-  ++recv_package_;
+  last_receive_ms_ = MonotonicMs();
   StartOOBRecv(status);
-  status->mutex().unlock_shared();
+  status->Leave();
 }
 
 void RawConnection::HandleRead(StatusPtr status,
@@ -200,42 +295,282 @@ void RawConnection::HandleRead(StatusPtr status,
     Disconnect(status, true);
     return;
   }
-  if (!Decode(bytes_transferred)) {
+  atomic_inc(&receive_reads_, 1);
+  atomic_inc(&receive_bytes_, bytes_transferred);
+  load_->AddBytes(bytes_transferred);
+  last_receive_ms_ = MonotonicMs();
+  if (socket_profile_.quick_ack) {
+    // The kernel may fall back to the delayed ack, set it again.
+    boost::system::error_code ec;
+    socket_->set_option(SocketProfile::QuickAck(true), ec);
+  }
+  MaybeAutoTune(bytes_transferred);
+  if (direct_read_) {
+    atomic_inc(&receive_direct_reads_, 1);
+  }
+  batching_ = 1;
+  const bool decoded = Decode(bytes_transferred);
+  atomic_and(&batching_, 0);
+  if (!decoded) {
     RawConnTrace << "Decoder error";
     status->clear_reading();
     Disconnect(status, true);
     return;
   }
-  ReadHandler h(status, this, &RawConnection::HandleRead);
-  socket_->async_read_some(
-      boost::asio::buffer(buffer_),
-      h);
-  status->mutex().unlock_shared();
+  // The responses of the batch go out together.
+  if (!outbound_.empty()) {
+    Flush(status);
+  }
+  if (migrate_to_ != NULL && !MigrateSocket(status)) {
+    status->clear_reading();
+    Disconnect(status, true);
+    return;
+  }
+  StartRead(status);
+  status->Leave();
+}
+
+bool RawConnection::MigrateSocket(StatusPtr status) {
+  boost::asio::io_service *io_service = migrate_to_;
+  if (&socket_->get_io_service() == io_service) {
+    migrate_to_ = NULL;
+    return true;
+  }
+  // No write in flight, and none starts until the writting bit is back.
+  if (!status->try_set_writting()) {
+    RawConnTrace << "Migrate after the write";
+    return true;
+  }
+  if (!atomic_compare_and_swap(&flush_timer_armed_, 0, 1)) {
+    RawConnTrace << "Migrate after the flush timer";
+    status->clear_writting();
+    if (!outbound_.empty()) {
+      Flush(status);
+    }
+    return true;
+  }
+  // The heartbeat and the producers may touch the socket, hold them off.
+  if (!status->Pause(kMigratePauseMs)) {
+    RawConnTrace << "Migrate after the handlers in flight leave";
+    atomic_and(&flush_timer_armed_, 0);
+    status->clear_writting();
+    if (!outbound_.empty()) {
+      Flush(status);
+    }
+    return true;
+  }
+  migrate_to_ = NULL;
+  bool migrated = false;
+  boost::system::error_code ec;
+  const boost::asio::ip::tcp::endpoint endpoint = socket_->local_endpoint(ec);
+  int fd = -1;
+#if BOOST_VERSION >= 106900
+  if (!ec) {
+    // The release removes the descriptor from the epoll set of the old
+    // reactor and aborts the OOB receive. A dup would keep the open file
+    // alive, and its stale registration in the old reactor with it.
+    fd = socket_->release(ec);
+  }
+#endif
+  if (fd >= 0) {
+    scoped_ptr<boost::asio::ip::tcp::socket> socket(
+        new boost::asio::ip::tcp::socket(*io_service));
+    socket->assign(endpoint.protocol(), fd, ec);
+    if (ec) {
+      ::close(fd);
+    } else {
+      socket_.swap(socket);
+      migrated = true;
+    }
+  }
+  if (!migrated) {
+    LOG(WARNING) << name() << " : " << "Fail to migrate the socket, error: "
+                 << ec.message();
+  } else {
+    boost::asio::ip::tcp::socket::non_blocking_io non_blocking_io(true);
+    socket_->io_control(non_blocking_io);
+    flush_timer_.reset(new boost::asio::deadline_timer(*io_service));
+    load_->AddConnection(-1);
+    load_ = &boost::asio::use_service<IOServiceLoad>(*io_service);
+    load_->AddConnection(1);
+    VLOG(1) << name() << " : " << "Migrated the socket";
+  }
+  status->Resume();
+  atomic_and(&flush_timer_armed_, 0);
+  status->clear_writting();
+  // The released descriptor is gone with the failed assign.
+  if (fd >= 0 && !migrated) {
+    return false;
+  }
+  if (migrated) {
+    StartOOBRecv(status);
+  }
+  if (!outbound_.empty()) {
+    Flush(status);
+  }
+  return true;
 }
 
 bool RawConnection::ScheduleWrite(StatusPtr status) {
   RawConnTrace;
-  boost::mutex::scoped_lock incoming_locker(incoming_mutex_);
-  if (status->writting()) {
-    RawConnTrace << " : " << "ScheduleWrite but already writting";
+  const bool small = outbound_bytes_ < flush_policy_.max_bytes;
+  if (batching_ && small) {
+    RawConnTrace << "Flush after the read batch";
     return true;
   }
-  status->set_writting();
-  RawConnTrace << "duplex_[0] : " << duplex_[0].empty();
-  RawConnTrace << "duplex_[1] : " << duplex_[1].empty();
-  RawConnTrace << "incoming: " << incoming_index_;
-  SwitchIO();
-  if (outcoming()->empty()) {
+  if (flush_policy_.max_delay_us > 0 && small) {
+    if (atomic_compare_and_swap(&flush_timer_armed_, 0, 1)) {
+      flush_timer_->expires_from_now(
+          boost::posix_time::microseconds(flush_policy_.max_delay_us));
+      flush_timer_->async_wait(TimerHandler(
+          status, this, &RawConnection::HandleFlushTimer));
+    }
+    return true;
+  }
+  Flush(status);
+  return true;
+}
+
+void RawConnection::Flush(StatusPtr status) {
+  if (!status->try_set_writting()) {
+    RawConnTrace << " : " << "Flush but already writting";
+    return;
+  }
+  WriteNext(status);
+}
+
+void RawConnection::HandleFlushTimer(
+    StatusPtr status, const boost::system::error_code &e) {
+  RawConnTrace << "e: " << e.message();
+  atomic_and(&flush_timer_armed_, 0);
+  Flush(status);
+  status->Leave();
+}
+
+void RawConnection::SetCork(bool cork) {
+  boost::system::error_code ec;
+  socket_->set_option(TcpCork(cork), ec);
+  if (ec) {
+    VLOG(2) << name() << " : " << "Set TCP_CORK error: " << ec.message();
+  }
+  corked_ = cork;
+}
+
+void RawConnection::NotifyWritable(const boost::function0<void> &callback) {
+  {
+    boost::mutex::scoped_lock locker(writable_callbacks_mutex_);
+    writable_callbacks_.push_back(callback);
+  }
+  // The queue may have drained before the callback is pushed.
+  if (!blocked_) {
+    RunWritableCallbacks();
+  }
+}
+
+void RawConnection::CheckWritable() {
+  if (queued_bytes_ > flush_policy_.low_watermark ||
+      !atomic_compare_and_swap(&blocked_, 1, 0)) {
+    return;
+  }
+  VLOG(1) << name() << " : " << "Queued bytes " << queued_bytes_
+          << " below the low watermark";
+  RunWritableCallbacks();
+}
+
+void RawConnection::RunWritableCallbacks() {
+  vector<boost::function0<void> > callbacks;
+  {
+    boost::mutex::scoped_lock locker(writable_callbacks_mutex_);
+    callbacks.swap(writable_callbacks_);
+  }
+  for (size_t i = 0; i < callbacks.size(); ++i) {
+    callbacks[i]();
+  }
+}
+
+void RawConnection::MaybeAutoTune(int bytes) {
+  if (!socket_profile_.auto_tune ||
+      atomic_inc(&tune_bytes_, bytes) < SocketProfile::kAutoTuneBytes) {
+    return;
+  }
+  atomic_and(&tune_bytes_, 0);
+  socket_profile_.AutoTune(socket_.get());
+}
+
+void RawConnection::PopOutbound() {
+  popped_.clear();
+  outbound_.PopAll(&popped_);
+  for (size_t i = 0; i < popped_.size(); ++i) {
+    atomic_dec(&outbound_bytes_, popped_[i].bytes());
+    outcoming_.push(popped_[i]);
+  }
+  atomic_inc(&send_frames_, popped_.size());
+}
+
+void RawConnection::WriteNext(StatusPtr status) {
+  while (true) {
+    if (outcoming_.empty()) {
+      outcoming_.clear();
+      PopOutbound();
+    }
+    if (!outcoming_.empty() && outcoming_.file() != NULL) {
+      // The sendfile runs in the handler, completes like a write.
+      socket_->get_io_service().post(boost::bind<void>(
+          WriteHandler(status, this, &RawConnection::HandleSendFile),
+          boost::system::error_code(), 0));
+      return;
+    }
+    if (!outcoming_.empty()) {
+      WriteHandler h(status, this, &RawConnection::HandleWrite);
+      socket_->async_write_some(outcoming_.batch(), h);
+      return;
+    }
+    if (corked_) {
+      SetCork(false);
+    }
     status->clear_writting();
     RawConnTrace << "No outcoming";
-    return true;
+    // A producer may push after PopOutbound and see the writting bit set,
+    // take the bit back to write its frame.
+    if (outbound_.empty() || !status->try_set_writting()) {
+      return;
+    }
   }
+}
 
-  WriteHandler h(status, this, &RawConnection::HandleWrite);
-  socket_->async_write_some(
-      *outcoming(),
-      h);
-  return true;
+void RawConnection::HandleSendFile(
+    StatusPtr status,
+    const boost::system::error_code& e, size_t) {
+  CHECK(status->writting());
+  if (e) {
+    HandleWrite(status, e, 0);
+    return;
+  }
+  const FileRegion *region = outcoming_.file();
+  CHECK(region != NULL);
+  off_t offset = region->offset;
+  ssize_t n;
+  do {
+    n = ::sendfile(socket_->native(), region->file->fd(), &offset,
+                   region->length);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    RawConnTrace << "Wait the socket writable";
+    socket_->async_write_some(
+        boost::asio::null_buffers(),
+        WriteHandler(status, this, &RawConnection::HandleSendFile));
+    status->Leave();
+    return;
+  }
+  boost::system::error_code ec;
+  if (n < 0) {
+    ec = boost::system::error_code(
+        errno, boost::asio::error::get_system_category());
+  } else if (n == 0) {
+    // The file is truncated.
+    ec = boost::asio::error::eof;
+  }
+  HandleWrite(status, ec, n > 0 ? n : 0);
 }
 
 void RawConnection::HandleWrite(
@@ -248,26 +583,21 @@ void RawConnection::HandleWrite(
     Disconnect(status, true);
     return;
   }
-  boost::mutex::scoped_lock locker(incoming_mutex_);
-  outcoming()->consume(byte_transferred);
-  if (!outcoming()->empty()) {
-    WriteHandler h(status, this, &RawConnection::HandleWrite);
-    socket_->async_write_some(
-        *outcoming(),
-        h);
-  } else {
-    RawConnTrace << "outcoming is empty";
-    SwitchIO();
-    if (!outcoming()->empty()) {
-      RawConnTrace << " : " << "outcoming is not empty after SwitchIO, size :" << outcoming()->size();
-      WriteHandler h(status, this, &RawConnection::HandleWrite);
-      socket_->async_write_some(
-          *outcoming(),
-          h);
-    } else {
-      status->clear_writting();
-    }
+  atomic_inc(&send_writes_, 1);
+  atomic_inc(&send_bytes_, byte_transferred);
+  load_->AddBytes(byte_transferred);
+  MaybeAutoTune(byte_transferred);
+  outcoming_.consume(byte_transferred);
+  atomic_dec(&queued_bytes_, static_cast<int>(byte_transferred));
+  if (blocked_) {
+    CheckWritable();
+  }
+  if (!outcoming_.empty() && flush_policy_.cork && !corked_) {
+    // The batch needs more writes, hold the partial segments until the
+    // batch is done.
+    SetCork(true);
   }
-  status->mutex().unlock_shared();
+  WriteNext(status);
+  status->Leave();
 }
 #undef RawConnTrace
@@ -35,14 +35,32 @@
 #define RAW_CONNECTION_HPP_
 #include "base/base.hpp"
 #include "server/shared_const_buffers.hpp"
+#include "server/receive_buffer.hpp"
+#include "server/socket_profile.hpp"
+#include "thread/mpsc_queue.hpp"
 #include "boost/signals2/signal.hpp"
-#include "boost/thread/shared_mutex.hpp"
+#include "boost/thread/thread.hpp"
 #include "boost/function.hpp"
 #include "boost/smart_ptr.hpp"
+#include "boost/version.hpp"
+// The status of a connection, and the guard of its lifetime. A handler
+// enters the status before touching the connection, the connection is
+// only destroyed after Close() and when no handler is in flight.
 class RawConnectionStatus {
  public:
-  typedef boost::shared_lock<boost::shared_mutex> Locker;
-  RawConnectionStatus() : status_(0), intrusive_count_(0) {
+  // Enter the status in the scope, check closing() after it.
+  class Locker {
+   public:
+    explicit Locker(RawConnectionStatus *status) : status_(status) {
+      status_->Enter();
+    }
+    ~Locker() {
+      status_->Leave();
+    }
+   private:
+    RawConnectionStatus *status_;
+  };
+  RawConnectionStatus() : status_(0), in_flight_(0), intrusive_count_(0) {
   }
   ~RawConnectionStatus() {
     CHECK_EQ(intrusive_count_, 0);
@@ -63,6 +81,11 @@ class RawConnectionStatus {
     atomic_or(&status_, WRITTING);
   }
 
+  // Set the writting bit, return false if it's already set.
+  bool try_set_writting() {
+    return !(atomic_fetch_or(&status_, WRITTING) & WRITTING);
+  }
+
   void clear_reading() {
     atomic_and(&status_, ~READING);
   }
@@ -71,8 +94,64 @@ class RawConnectionStatus {
     atomic_and(&status_, ~WRITTING);
   }
 
-  void set_closing() {
-    atomic_or(&status_, CLOSING);
+  // Wait while the status is paused.
+  void Enter() {
+    atomic_inc(&in_flight_, 1);
+    while (status_ & PAUSED) {
+      atomic_dec(&in_flight_, 1);
+      while (status_ & PAUSED) {
+        boost::this_thread::yield();
+      }
+      atomic_inc(&in_flight_, 1);
+    }
+  }
+  void Leave() {
+    atomic_dec(&in_flight_, 1);
+  }
+  // Enter the status, return false and leave if it's closing.
+  bool TryEnter() {
+    Enter();
+    if (closing()) {
+      Leave();
+      return false;
+    }
+    return true;
+  }
+  // Set the closing bit, return false if it's already closing. The
+  // handlers enter after it see closing().
+  bool Close() {
+    return !(atomic_fetch_or(&status_, CLOSING) & CLOSING);
+  }
+  // Hold the others off until Resume(), the caller has entered once. Wait
+  // up to the timeout for the handlers in flight to leave, a handler may
+  // block while entered, e.g. a producer waiting for the backpressure.
+  // Return false and resume on the timeout.
+  bool Pause(int timeout_ms) {
+    atomic_or(&status_, PAUSED);
+    for (int i = 0; in_flight_ > 1; ++i) {
+      if (i < kSpinCount) {
+        boost::this_thread::yield();
+      } else if (i - kSpinCount < timeout_ms) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+      } else {
+        Resume();
+        return false;
+      }
+    }
+    return true;
+  }
+  void Resume() {
+    atomic_and(&status_, ~PAUSED);
+  }
+  // Wait until no handler is in flight, the caller must have left.
+  void WaitIdle() {
+    for (int i = 0; in_flight_ != 0; ++i) {
+      if (i < kSpinCount) {
+        boost::this_thread::yield();
+      } else {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+      }
+    }
   }
 
   bool closing() const {
@@ -86,24 +165,59 @@ class RawConnectionStatus {
   int status() const {
     return status_;
   }
-  boost::shared_mutex &mutex() {
-    return mutex_;
-  }
  private:
+  static const int kSpinCount = 100;
   enum InternalRawConnectionStatus {
     IDLE = 0x0,
     READING = 0x01,
     WRITTING = 0x01 << 1,
     CLOSING = 0x01 << 2,
+    PAUSED = 0x01 << 3,
   };
   volatile int status_;
+  // The handlers entered.
+  volatile int in_flight_;
   volatile int intrusive_count_;
   template <class T> friend void intrusive_ptr_add_ref(T *t);
   template <class T> friend void intrusive_ptr_release(T *t);
-  boost::shared_mutex mutex_;
+};
+
+// When the pushed frames are written to the socket, and how many bytes
+// may wait for it.
+// The frames pushed while a read is being decoded always go out together
+// after the read.
+struct FlushPolicy {
+  FlushPolicy() : max_bytes(64 * 1024), max_delay_us(0), cork(true),
+    high_watermark(4 * 1024 * 1024), low_watermark(1024 * 1024) {
+  }
+  // Flush at once when the pending bytes reach it.
+  int max_bytes;
+  // Hold the small frames up to the delay to coalesce them, 0 to flush at
+  // once.
+  int max_delay_us;
+  // Set TCP_CORK while a batch needs more than one write.
+  bool cork;
+  // The connection is not writable once the queued bytes reach the high
+  // watermark, until they drain below the low watermark. 0 for no limit.
+  int high_watermark;
+  int low_watermark;
+};
+
+// The write statistics of a connection.
+struct SendStats {
+  SendStats() : writes(0), frames(0), bytes(0) {
+  }
+  double frames_per_write() const {
+    return writes == 0 ? 0 : static_cast<double>(frames) / writes;
+  }
+  // Completed async_write_some.
+  uint64 writes;
+  uint64 frames;
+  uint64 bytes;
 };
 
 class Connection;
+class IOServiceLoad;
 class RawConnection : public boost::noncopyable {
  private:
   typedef RawConnectionStatus::Locker Locker;
@@ -113,41 +227,136 @@ class RawConnection : public boost::noncopyable {
                 boost::shared_ptr<Connection> connection);
   void Disconnect(StatusPtr status, bool async);
   bool ScheduleWrite(StatusPtr status);
-  // The push will take the ownership of the data
+  // The push will take the ownership of the data.
+  // The writable is set false when the queue is above the high watermark,
+  // the data is queued anyway.
   template <typename T>
-  inline bool PushData(const T &data) {
-    boost::mutex::scoped_lock locker_incoming(incoming_mutex_);
-    InternalPushData(data);
+  inline bool PushData(const T &data, bool *writable = NULL) {
+    SharedConstBuffers::Frame frame;
+    InternalPushData(data, &frame);
+    const int bytes = frame.bytes();
+    atomic_inc(&outbound_bytes_, bytes);
+    outbound_.Push(frame);
+    const int queued = atomic_inc(&queued_bytes_, bytes);
+    if (flush_policy_.high_watermark > 0 &&
+        queued >= flush_policy_.high_watermark && !blocked_) {
+      VLOG(1) << name() << " : " << "Queued bytes " << queued
+              << " reach the high watermark";
+      atomic_or(&blocked_, 1);
+      // The writer may have drained the queue before the bit is set.
+      CheckWritable();
+    }
+    if (writable) {
+      *writable = !blocked_;
+    }
     return true;
   }
+  // The queued bytes are below the high watermark.
+  bool writable() const {
+    return !blocked_;
+  }
+  // Run the callback once the connection is writable, at once if it's
+  // writable now. The callbacks are dropped if the connection closes.
+  void NotifyWritable(const boost::function0<void> &callback);
+  void set_flush_policy(const FlushPolicy &flush_policy) {
+    flush_policy_ = flush_policy;
+  }
+  void set_socket_profile(const SocketProfile &socket_profile) {
+    socket_profile_ = socket_profile;
+  }
   void InitSocket(StatusPtr status,
                   boost::asio::ip::tcp::socket *socket);
   const string name() const {
     return name_;
   }
+  // The counters are written by the io thread, read a snapshot of them.
+  ReceiveStats receive_stats() const {
+    ReceiveStats stats;
+    stats.reads = receive_reads_;
+    stats.direct_reads = receive_direct_reads_;
+    stats.bytes = receive_bytes_;
+    stats.messages = receive_messages_;
+    return stats;
+  }
+  SendStats send_stats() const {
+    SendStats stats;
+    stats.writes = send_writes_;
+    stats.frames = send_frames_;
+    stats.bytes = send_bytes_;
+    return stats;
+  }
+  // The load of the io_service of the socket.
+  IOServiceLoad *load() const {
+    return load_;
+  }
+  // Move the socket to the io_service at the next quiescent point, after
+  // a read completes and no write is in flight. Return false if the boost
+  // can't release the socket from its reactor, it needs boost 1.69.
+  bool Migrate(boost::asio::io_service *io_service) {
+#if BOOST_VERSION < 106900
+    return false;
+#else
+    migrate_to_ = io_service;
+    return true;
+#endif
+  }
   virtual ~RawConnection();
  protected:
   static const char kHeartBeat = 0xb;
   static const int kDefaultTimeoutMs = 30000;
   static const int kRecvDelayFactor = 2;
-  template <class T> void InternalPushData(const T &data);
-
-  SharedConstBuffers *incoming() {
-    return &duplex_[incoming_index_];
-  }
-  SharedConstBuffers *outcoming() {
-    return &duplex_[1 - incoming_index_];
+  static const int kHeartbeatUnsyncWindow = 2;
+  // The peer is dead when nothing is received in it.
+  static const int kDeadTimeoutMs = (kHeartbeatUnsyncWindow + 1) *
+    kDefaultTimeoutMs;
+  // No ping if something is received in it, the OOB heartbeats of the old
+  // peers are sent every period.
+  static const int kIdleTimeoutMs = kDefaultTimeoutMs / 2;
+  // The longest the reader waits for the handlers in flight to migrate.
+  static const int kMigratePauseMs = 10;
+  template <class T> void InternalPushData(
+      const T &data, SharedConstBuffers::Frame *frame);
+  // Move the pushed frames to outcoming_, the writting bit is held.
+  void PopOutbound();
+  // Start the next write, or release the writting bit if nothing to write.
+  void WriteNext(StatusPtr status);
+  // Write the pushed frames now.
+  void Flush(StatusPtr status);
+  void HandleFlushTimer(StatusPtr status, const boost::system::error_code &e);
+  void SetCork(bool cork);
+  // Clear the blocked bit and run the writable callbacks when the queued
+  // bytes drain below the low watermark.
+  void CheckWritable();
+  void RunWritableCallbacks();
+  // Move the socket to the migrate_to_, called by the reader. Retried
+  // after the next read if a write or the flush timer is pending, or the
+  // handlers in flight don't leave in kMigratePauseMs. Return false if the
+  // socket is lost on the way.
+  bool MigrateSocket(StatusPtr status);
+  // Auto tune the buffers every SocketProfile::kAutoTuneBytes.
+  void MaybeAutoTune(int bytes);
+  inline void OOBRecv(StatusPtr status, const boost::system::error_code &e, size_t n);
+  // The peer decodes the in-band ping, otherwise it counts the OOB
+  // heartbeats and needs one every period.
+  virtual bool CanPing() const {
+    return false;
   }
-  void SwitchIO() {
-//    CHECK(outcoming()->empty());
-    // Switch the working vector.
-    incoming_index_ = 1 - incoming_index_;
+  // Send an in-band ping, the peer answers with a pong.
+  virtual bool SendPing(StatusPtr /* status */) {
+    return false;
   }
-  inline void OOBRecv(StatusPtr status, const boost::system::error_code &e, size_t n);
-  inline void OOBSend(StatusPtr status, const boost::system::error_code &e);
+  // The milliseconds since the last byte received.
+  int64 IdleMs() const;
   inline void HandleRead(StatusPtr status, const boost::system::error_code& e, size_t bytes_transferred);
   inline void HandleWrite(StatusPtr status, const boost::system::error_code& e, size_t byte_transferred);
+  // Send the file region in the front of the outcoming by sendfile.
+  void HandleSendFile(StatusPtr status, const boost::system::error_code& e, size_t);
   virtual bool Decode(size_t byte_transferred) = 0;
+  // The storage the decoder wants the next bytes in, empty if none.
+  virtual boost::asio::mutable_buffer DirectBuffer() {
+    return boost::asio::mutable_buffer();
+  }
+  void StartRead(StatusPtr status);
   void StartOOBRecv(StatusPtr status);
   void Heartbeat(StatusPtr status);
   scoped_ptr<boost::asio::ip::tcp::socket> socket_;
@@ -155,18 +364,47 @@ class RawConnection : public boost::noncopyable {
 
   char heartbeat_;
 
-  static const int kBufferSize = 8192;
-  static const int kHeartbeatUnsyncWindow = 2;
-  typedef boost::array<char, kBufferSize> Buffer;
-  Buffer buffer_;
+  // The monotonic milliseconds of the last read.
+  volatile int64 last_receive_ms_;
+  ReceiveBuffer buffer_;
+  // The pending read goes to DirectBuffer() instead of buffer_.
+  bool direct_read_;
+  // The ReceiveStats.
+  volatile uint64 receive_reads_;
+  volatile uint64 receive_direct_reads_;
+  volatile uint64 receive_bytes_;
+  volatile uint64 receive_messages_;
 
-  int incoming_index_;
-  SharedConstBuffers duplex_[2];
-  boost::mutex incoming_mutex_;
+  // The frames pushed by any thread, only the writer pops them.
+  MPSCQueue<SharedConstBuffers::Frame> outbound_;
+  vector<SharedConstBuffers::Frame> popped_;
+  // The buffers in writting, only touched with the writting bit.
+  SharedConstBuffers outcoming_;
+  // The bytes pushed but not in writting yet.
+  volatile int outbound_bytes_;
+  // The bytes pushed but not written yet.
+  volatile int queued_bytes_;
+  // Set while the queued bytes are above the watermarks.
+  volatile int blocked_;
+  vector<boost::function0<void> > writable_callbacks_;
+  boost::mutex writable_callbacks_mutex_;
+  FlushPolicy flush_policy_;
+  // The reading thread is decoding, the flush waits for the end of it.
+  volatile int batching_;
+  scoped_ptr<boost::asio::deadline_timer> flush_timer_;
+  volatile int flush_timer_armed_;
+  bool corked_;
+  // The SendStats.
+  volatile uint64 send_writes_;
+  volatile uint64 send_frames_;
+  volatile uint64 send_bytes_;
+  SocketProfile socket_profile_;
+  // The bytes transferred since the last auto tune.
+  volatile int tune_bytes_;
+  IOServiceLoad *load_;
+  boost::asio::io_service * volatile migrate_to_;
   boost::shared_ptr<Connection> connection_;
 
-  int send_package_;
-  int recv_package_;
   friend class Connection;
 };
 // Represents a protocol implementation.
@@ -179,13 +417,39 @@ public:
   }
 protected:
   inline bool Decode(size_t bytes_transferred);
+  boost::asio::mutable_buffer DirectBuffer() {
+    return decoder_.direct_buffer();
+  }
+  inline bool HandleDecoded();
   virtual bool Handle(const Decoder *decoder) = 0;
   Decoder decoder_;
 };
 
+template <typename Decoder>
+bool RawConnectionImpl<Decoder>::HandleDecoded() {
+  atomic_inc(&receive_messages_, 1);
+  buffer_.OnMessage(decoder_.length());
+  if (!Handle(&decoder_)) {
+    return false;
+  }
+  decoder_.reset();
+  return true;
+}
+
 template <typename Decoder>
 bool RawConnectionImpl<Decoder>::Decode(size_t bytes_transferred) {
   boost::tribool result;
+  if (direct_read_) {
+    result = decoder_.Commit(bytes_transferred);
+    if (result) {
+      VLOG(2) << name() << " : " << "Handle direct read, size: " << decoder_.length();
+      return HandleDecoded();
+    } else if (!result) {
+      VLOG(2) << name() << " : " << "Parse error";
+      return false;
+    }
+    return true;
+  }
   const char *start = buffer_.data();
   const char *end = start + bytes_transferred;
   const char *p = start;
@@ -194,10 +458,9 @@ bool RawConnectionImpl<Decoder>::Decode(size_t bytes_transferred) {
       decoder_.Decode(p, end);
     if (result) {
       VLOG(2) << name() << " : " << "Handle lineformat: size: " << (p - start);
-      if (!Handle(&decoder_)) {
+      if (!HandleDecoded()) {
         return false;
       }
-      decoder_.reset();
     } else if (!result) {
       VLOG(2) << name() << " : " << "Parse error";
       return false;
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "server/raw_connection.hpp"
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+DEFINE_int32(completions, 1000000, "The completions of each thread");
+DEFINE_int32(threads, 4, "The max thread number of the benchmark");
+
+// What every completion handler did before, for comparison.
+class SharedMutexGuard {
+ public:
+  SharedMutexGuard() : closing_(false) {
+  }
+  bool Run() {
+    mutex_.lock_shared();
+    if (closing_) {
+      mutex_.unlock_shared();
+      return false;
+    }
+    mutex_.unlock_shared();
+    return true;
+  }
+ private:
+  boost::shared_mutex mutex_;
+  bool closing_;
+};
+
+class StatusGuard {
+ public:
+  bool Run() {
+    if (!status_.TryEnter()) {
+      return false;
+    }
+    status_.Leave();
+    return true;
+  }
+ private:
+  RawConnectionStatus status_;
+};
+
+class RawConnectionStatusTest : public testing::Test {
+ protected:
+  template <class Guard>
+  static void Complete(Guard *guard, int completions) {
+    for (int i = 0; i < completions; ++i) {
+      CHECK(guard->Run());
+    }
+  }
+  // Return the nanoseconds per completion.
+  template <class Guard>
+  static double Benchmark(int threads, int completions) {
+    Guard guard;
+    boost::posix_time::ptime start =
+      boost::posix_time::microsec_clock::universal_time();
+    boost::thread_group group;
+    for (int i = 0; i < threads; ++i) {
+      group.create_thread(boost::bind(
+          &RawConnectionStatusTest::Complete<Guard>, &guard, completions));
+    }
+    group.join_all();
+    boost::posix_time::time_duration elapsed =
+      boost::posix_time::microsec_clock::universal_time() - start;
+    return elapsed.total_microseconds() * 1000.0 / completions / threads;
+  }
+  static void LeaveLater(RawConnectionStatus *status, volatile bool *left) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    *left = true;
+    status->Leave();
+  }
+};
+
+TEST_F(RawConnectionStatusTest, Close) {
+  RawConnection::StatusPtr status(new RawConnectionStatus);
+  EXPECT_TRUE(status->TryEnter());
+  EXPECT_TRUE(status->Close());
+  EXPECT_TRUE(status->closing());
+  EXPECT_FALSE(status->Close());
+  // No one enters after the close.
+  EXPECT_FALSE(status->TryEnter());
+  // Wait for the handler in flight.
+  volatile bool left = false;
+  boost::thread t(boost::bind(&RawConnectionStatusTest::LeaveLater,
+                              status.get(), &left));
+  status->WaitIdle();
+  EXPECT_TRUE(left);
+  t.join();
+}
+
+static void EnterLater(RawConnectionStatus *status, volatile bool *entered) {
+  status->Enter();
+  *entered = true;
+  status->Leave();
+}
+
+TEST_F(RawConnectionStatusTest, Pause) {
+  RawConnection::StatusPtr status(new RawConnectionStatus);
+  status->Enter();
+  EXPECT_TRUE(status->TryEnter());
+  volatile bool left = false;
+  boost::thread t1(boost::bind(&RawConnectionStatusTest::LeaveLater,
+                               status.get(), &left));
+  // Wait for the other handler in flight.
+  EXPECT_TRUE(status->Pause(10000));
+  EXPECT_TRUE(left);
+  t1.join();
+  // No one enters until the resume.
+  volatile bool entered = false;
+  boost::thread t2(boost::bind(EnterLater, status.get(), &entered));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  EXPECT_FALSE(entered);
+  status->Resume();
+  t2.join();
+  EXPECT_TRUE(entered);
+  status->Leave();
+}
+
+// A handler blocked while entered doesn't hold the pause forever.
+TEST_F(RawConnectionStatusTest, PauseTimeout) {
+  RawConnection::StatusPtr status(new RawConnectionStatus);
+  status->Enter();
+  EXPECT_TRUE(status->TryEnter());
+  EXPECT_FALSE(status->Pause(10));
+  // Resumed, the others enter.
+  volatile bool entered = false;
+  boost::thread t(boost::bind(EnterLater, status.get(), &entered));
+  t.join();
+  EXPECT_TRUE(entered);
+  status->Leave();
+  status->Leave();
+}
+
+TEST_F(RawConnectionStatusTest, Benchmark) {
+  for (int threads = 1; threads <= FLAGS_threads; threads *= 2) {
+    const double shared_mutex_ns =
+      Benchmark<SharedMutexGuard>(threads, FLAGS_completions);
+    const double status_ns =
+      Benchmark<StatusGuard>(threads, FLAGS_completions);
+    LOG(INFO) << "Threads: " << threads
+              << " shared_mutex: " << shared_mutex_ns << " ns/completion"
+              << " in flight counter: " << status_ns << " ns/completion";
+  }
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
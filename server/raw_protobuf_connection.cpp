@@ -35,101 +35,436 @@
 #include "server/raw_connection.hpp"
 #include "server/protobuf_connection.hpp"
 #include "server/raw_protobuf_connection.hpp"
+#include "server/method_cache.hpp"
+#include <protobuf/io/coded_stream.h>
+#include <protobuf/wire_format_lite.h>
 #define RawConnTrace VLOG(2) << name() << ".protobuf : " << __func__ << " "
 RawProtobufConnection::~RawProtobufConnection() {
   VLOG(2) << name() << " : " << "Distroy protobuf connection";
   ReleaseResponseTable();
+  delete []peer_method_indexes_;
 }
 
+// Complete the call with the response, fail it with the reason if the
+// decoder is NULL.
+static void CompleteCall(const ProtobufDecoder *decoder,
+                         const Connection *connection,
+                         const PendingCallTable::Call &call,
+                         const char *reason = "Abort");
+
 void RawProtobufConnection::ReleaseResponseTable() {
-  vector<HandlerFunctor> handlers;
-  {
-    boost::mutex::scoped_lock locker(response_handler_table_mutex_);
-    for (HandlerTable::iterator it = response_handler_table_.begin();
-         it != response_handler_table_.end(); ++it) {
-      handlers.push_back(it->second);
-    }
-    response_handler_table_.clear();
-  }
-  for (int i = 0; i < handlers.size(); ++i) {
+  vector<PendingCallTable::Call> calls;
+  pending_calls_.Clear(&calls);
+  for (size_t i = 0; i < calls.size(); ++i) {
     LOG(WARNING) << name() << " : " << "Call response handler in ReleaseResponseTable NO " << i;
-    handlers[i](NULL, connection_);
+    CompleteCall(NULL, connection_.get(), calls[i]);
   }
-  handlers.clear();
 }
 
 template <>
 void RawConnection::InternalPushData<EncodeData>(
-    const EncodeData &data) {
-  if (data.first == NULL) {
+    const EncodeData &data, SharedConstBuffers::Frame *frame) {
+  if (data.data == NULL) {
     LOG(WARNING) << "Push NULL data!";
     return;
   }
-  incoming()->push(data.first);
-  incoming()->push(data.second);
+  frame->push(data.data, data.offset);
+  if (data.payload != NULL) {
+    frame->push(data.payload);
+  }
+  if (data.shared_payload.get() != NULL) {
+    frame->push(data.shared_payload);
+  }
+  if (data.attachment.file.get() != NULL) {
+    frame->push(data.attachment);
+  }
+}
+
+// Write the varint in front of the p, return the new front.
+static uint8 *PrependVarint(uint32 value, uint8 *p) {
+  uint8 varint[5];
+  const int n = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(
+      value, varint) - varint;
+  p -= n;
+  memcpy(p, varint, n);
+  return p;
+}
+
+// Encode the frame header and the meta into the ret->data, the content
+// field of the meta is payload_size bytes if has_content.
+static void EncodeHeader(const google::protobuf::Message *meta,
+                         bool has_content, int payload_size,
+                         bool binary, uint8 flags, EncodeData *ret) {
+  const int meta_size = meta->ByteSize();
+  // The tag and the length of the MetaData.content field.
+  int field_size = 0;
+  uint8 field[6];
+  if (has_content) {
+    field[0] = google::protobuf::internal::WireFormatLite::MakeTag(
+        ProtobufLineFormat::MetaData::kContentFieldNumber,
+        google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    field_size = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(
+        payload_size, field + 1) - field;
+  } else {
+    payload_size = 0;
+  }
+  const int size = meta_size + field_size + payload_size;
+  string *data = new string;
+  data->resize(kMaxFrameHeaderSize + meta_size + field_size);
+  uint8 *header = reinterpret_cast<uint8 *>(&(*data)[kMaxFrameHeaderSize]);
+  meta->SerializeWithCachedSizesToArray(header);
+  memcpy(header + meta_size, field, field_size);
+  if (binary) {
+    header = PrependVarint(size, header);
+    *--header = flags;
+    *--header = kFrameMagic;
+  } else {
+    *--header = ':';
+    int length = size;
+    do {
+      *--header = '0' + length % 10;
+      length /= 10;
+    } while (length);
+  }
+  ret->data = data;
+  ret->offset = reinterpret_cast<char *>(header) - data->c_str();
+  VLOG(2) << "Encode Message, binary: " << binary
+          << " header size: " << kMaxFrameHeaderSize - ret->offset
+          << " meta size: " << meta_size + field_size
+          << " payload size: " << payload_size;
+}
+
+EncodeData EncodeMessage(const google::protobuf::Message *meta,
+                         const google::protobuf::Message *content,
+                         bool binary, uint8 flags,
+                         int attachment_field,
+                         const FileRegion *attachment) {
+  EncodeData ret;
+  int payload_size = 0;
+  if (content != NULL) {
+    const int content_size = content->ByteSize();
+    // The tag and the length of the attachment field.
+    int attachment_size = 0;
+    uint8 attachment_field_header[10];
+    if (attachment != NULL) {
+      uint8 *p = google::protobuf::io::CodedOutputStream::WriteTagToArray(
+          google::protobuf::internal::WireFormatLite::MakeTag(
+              attachment_field,
+              google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED),
+          attachment_field_header);
+      p = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(
+          attachment->length, p);
+      attachment_size = p - attachment_field_header;
+      ret.attachment = *attachment;
+    }
+    payload_size = content_size + attachment_size + ret.attachment.length;
+    string *payload = new string;
+    payload->resize(content_size + attachment_size);
+    uint8 *p = reinterpret_cast<uint8 *>(&(*payload)[0]);
+    content->SerializeWithCachedSizesToArray(p);
+    memcpy(p + content_size, attachment_field_header, attachment_size);
+    ret.payload = payload;
+  }
+  EncodeHeader(meta, content != NULL, payload_size, binary, flags, &ret);
+  return ret;
+}
+
+EncodeData EncodeMessage(const google::protobuf::Message *meta,
+                         const SharedBlockPtr &content,
+                         bool binary, uint8 flags) {
+  EncodeData ret;
+  ret.shared_payload = content;
+  EncodeHeader(meta, true, content->data().size(), binary, flags, &ret);
+  return ret;
+}
+
+boost::tuple<boost::tribool, const char *> ProtobufDecoder::Decode(
+    const char *begin, const char *end) {
+  VLOG(2) << "Decode size: " << (end - begin);
+  const char *p = begin;
+  while (p < end && state_ != Content) {
+    boost::tribool result = Consume(*p++);
+    if (!result) {
+      return boost::make_tuple(result, p);
+    }
+  }
+  if (state_ != Content) {
+    boost::tribool result = boost::indeterminate;
+    return boost::make_tuple(result, p);
+  }
+  const int available = end - p;
+  if (content_.capacity() == 0) {
+    if (available >= length_) {
+      // The whole content is in the input, parse it without the copy.
+      boost::tribool result = ParseContent(p, length_);
+      return boost::make_tuple(result, p + length_);
+    }
+    content_.reserve(length_);
+  }
+  const int n = min(content_.size(), available);
+  memcpy(content_.data(), p, n);
+  content_.inc_size(n);
+  p += n;
+  if (content_.full()) {
+    boost::tribool result = ParseContent();
+    return boost::make_tuple(result, p);
+  }
+  boost::tribool result = boost::indeterminate;
+  return boost::make_tuple(result, p);
 }
 
 boost::tribool ProtobufDecoder::Consume(char input) {
   switch (state_) {
     case End:
     case Start:
-      {
-        if (!isdigit(input)) {
-          LOG(WARNING) << "Start but is not digit";
-          return false;
-        }
-        state_ = Length;
-        length_store_.clear();
-        length_store_.push_back(input);
+      if (input == kFrameMagic) {
+        state_ = Flags;
+        binary_ = true;
+        length_ = 0;
+        shift_ = 0;
         return boost::indeterminate;
       }
+      if (!isdigit(input)) {
+        LOG(WARNING) << "Start but is not digit";
+        return false;
+      }
+      state_ = Length;
+      binary_ = false;
+      length_ = input - '0';
+      return boost::indeterminate;
     case Length:
       if (input == ':') {
         state_ = Content;
-        length_ = boost::lexical_cast<int>(length_store_);
-        content_.reserve(length_);
-        VLOG(2) << "Length: " << length_store_ << " length size: " << length_store_.size() << " Content size: " << length_;
+        VLOG(2) << "Text frame, content size: " << length_;
         return boost::indeterminate;
       } else if (!isdigit(input)) {
         LOG(WARNING) << "Length is not digit";
         return false;
+      } else if (length_ > (INT_MAX - (input - '0')) / 10) {
+        LOG(WARNING) << "Length overflow";
+        return false;
       } else {
-        length_store_.push_back(input);
+        length_ = length_ * 10 + input - '0';
         return boost::indeterminate;
       }
-    case Content:
-      if (content_.full()) {
+    case Flags:
+      flags_ = input;
+      if (flags_ & FRAME_COMPRESSED) {
+        LOG(WARNING) << "Compressed frame is not supported";
         return false;
       }
-      content_.push_back(input);
-      if (content_.full()) {
-        if (!meta_.ParseFromArray(content_.content(),
-                                  content_.capacity())) {
-          LOG(WARNING) << "Parse content error";
-          return false;
-        }
-        if (meta_.type() == ProtobufLineFormat::MetaData::REQUEST &&
-            !meta_.has_response_identify()) {
-          LOG(WARNING) << "request meta data should have response identify field";
+      state_ = BinaryLength;
+      return boost::indeterminate;
+    case BinaryLength:
+      {
+        const uint32 bits = static_cast<uint8>(input) & 0x7f;
+        if (shift_ > 28 || (shift_ == 28 && bits > 0x7)) {
+          LOG(WARNING) << "Varint length overflow";
           return false;
         }
-        if (meta_.content().empty()) {
-          LOG(WARNING) << "Meta without content: ";
-          return false;
+        length_ |= bits << shift_;
+        shift_ += 7;
+        if (input & 0x80) {
+          return boost::indeterminate;
         }
-        state_ = End;
-        return true;
+        state_ = Content;
+        VLOG(2) << "Binary frame, flags: " << static_cast<int>(flags_)
+                << " content size: " << length_;
+        return boost::indeterminate;
       }
-      return boost::indeterminate;
     default:
       LOG(WARNING) << "Unknown status of ProtobufDecoder";
       return false;
   }
 }
 
+boost::tribool ProtobufDecoder::Commit(int n) {
+  if (state_ != Content || content_.capacity() == 0 || n > content_.size()) {
+    LOG(WARNING) << "Commit " << n << " bytes but the content can't hold it";
+    return false;
+  }
+  content_.inc_size(n);
+  if (content_.full()) {
+    return ParseContent();
+  }
+  return boost::indeterminate;
+}
+
+boost::tribool ProtobufDecoder::ParseContent() {
+  return ParseContent(content_.content(), content_.capacity());
+}
+
+boost::tribool ProtobufDecoder::ParseControl(const char *data, int size) {
+  google::protobuf::io::CodedInputStream input(
+      reinterpret_cast<const uint8 *>(data), size);
+  uint32 type;
+  google::protobuf::uint64 argument = 0;
+  if (!input.ReadVarint32(&type) ||
+      (input.BytesUntilLimit() > 0 && !input.ReadVarint64(&argument))) {
+    LOG(WARNING) << "Parse control frame error";
+    return false;
+  }
+  control_type_ = type;
+  control_argument_ = argument;
+  state_ = End;
+  return true;
+}
+
+boost::tribool ProtobufDecoder::ParseContent(const char *data, int size) {
+  if (flags_ & FRAME_CONTROL) {
+    return ParseControl(data, size);
+  }
+  if (!ParseMeta(data, size)) {
+    LOG(WARNING) << "Parse content error";
+    return false;
+  }
+  if (meta_.type() == ProtobufLineFormat::MetaData::REQUEST &&
+      !meta_.has_response_identify()) {
+    LOG(WARNING) << "request meta data should have response identify field";
+    return false;
+  }
+  if (payload_size_ == 0) {
+    LOG(WARNING) << "Meta without content: ";
+    return false;
+  }
+  state_ = End;
+  return true;
+}
+
+// Merge the fields in the [begin, end) of the data into the meta.
+static bool MergeMeta(const char *data, int begin, int end,
+                      ProtobufLineFormat::MetaData *meta) {
+  if (begin == end) {
+    return true;
+  }
+  google::protobuf::io::CodedInputStream input(
+      reinterpret_cast<const uint8 *>(data + begin), end - begin);
+  return meta->MergePartialFromCodedStream(&input) &&
+    input.ConsumedEntireMessage();
+}
+
+// Parse the meta but the content field, which is left in the data and
+// pointed by the payload_. The last content field wins like the parser.
+bool ProtobufDecoder::ParseMeta(const char *data, int size) {
+  using google::protobuf::internal::WireFormatLite;
+  static const uint32 kContentTag = WireFormatLite::MakeTag(
+      ProtobufLineFormat::MetaData::kContentFieldNumber,
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+  meta_.Clear();
+  payload_ = NULL;
+  payload_size_ = 0;
+  google::protobuf::io::CodedInputStream input(
+      reinterpret_cast<const uint8 *>(data), size);
+  // The fields before the current content field.
+  int begin = 0;
+  while (true) {
+    const int field = size - input.BytesUntilLimit();
+    const uint32 tag = input.ReadTag();
+    if (tag == 0) {
+      break;
+    }
+    if (tag != kContentTag) {
+      if (!WireFormatLite::SkipField(&input, tag)) {
+        return false;
+      }
+      continue;
+    }
+    uint32 length;
+    if (!input.ReadVarint32(&length) ||
+        length > static_cast<uint32>(input.BytesUntilLimit())) {
+      return false;
+    }
+    if (!MergeMeta(data, begin, field, &meta_)) {
+      return false;
+    }
+    payload_ = data + size - input.BytesUntilLimit();
+    payload_size_ = length;
+    input.Skip(length);
+    begin = size - input.BytesUntilLimit();
+  }
+  if (!input.ConsumedEntireMessage() ||
+      !MergeMeta(data, begin, size, &meta_)) {
+    return false;
+  }
+  // The content is required but not in the meta.
+  return payload_ != NULL && meta_.has_type() && meta_.has_identify();
+}
+
+EncodeData EncodeControl(uint8 type, uint64 argument) {
+  EncodeData ret;
+  uint8 content[1 + 10];
+  content[0] = type;
+  const int size = google::protobuf::io::CodedOutputStream::WriteVarint64ToArray(
+      argument, content + 1) - content;
+  string *data = new string;
+  data->resize(kMaxFrameHeaderSize + size);
+  uint8 *header = reinterpret_cast<uint8 *>(&(*data)[kMaxFrameHeaderSize]);
+  memcpy(header, content, size);
+  header = PrependVarint(size, header);
+  *--header = FRAME_CONTROL;
+  *--header = kFrameMagic;
+  ret.data = data;
+  ret.offset = reinterpret_cast<char *>(header) - data->c_str();
+  return ret;
+}
+
+bool RawProtobufConnection::Send(
+    RawConnection::StatusPtr status, const EncodeData &data) {
+  if (!PushData(data)) {
+    delete data.data;
+    delete data.payload;
+    return false;
+  }
+  // The data is owned by the outbound queue now.
+  return ScheduleWrite(status);
+}
+
+bool RawProtobufConnection::SendPing(RawConnection::StatusPtr status) {
+  RawConnTrace << "Ping";
+  return Send(status, EncodeControl(CONTROL_PING));
+}
+
+bool RawProtobufConnection::HandleControl(const ProtobufDecoder *decoder) {
+  switch (decoder->control_type()) {
+    case CONTROL_PING:
+      RawConnTrace << "Pong";
+      // Called in the reading thread, the read holds the status.
+      PushData(EncodeControl(CONTROL_PONG, decoder->control_argument()));
+      return true;
+    case CONTROL_PONG:
+      return true;
+    case CONTROL_CANCEL:
+      RawConnTrace << "Cancel: " << decoder->control_argument();
+      static_cast<ProtobufConnection *>(connection_.get())->CancelServing(
+          decoder->control_argument());
+      return true;
+    case CONTROL_DROP:
+      {
+        RawConnTrace << "Dropped: " << decoder->control_argument();
+        PendingCallTable::Call call;
+        if (pending_calls_.Remove(decoder->control_argument(), &call)) {
+          CompleteCall(NULL, connection_.get(), call, "DeadlineExceeded");
+        }
+        return true;
+      }
+    default:
+      // Skip the unknown control from the newer peers.
+      VLOG(1) << name() << " : " << "Unknown control type: "
+              << static_cast<int>(decoder->control_type());
+      return true;
+  }
+}
+
 bool RawProtobufConnection::Handle(
     const ProtobufDecoder *decoder) {
   CHECK(decoder != NULL);
+  if (decoder->control()) {
+    peer_binary_frame_ = true;
+    return HandleControl(decoder);
+  }
+  if (decoder->binary() || decoder->meta().binary_frame()) {
+    peer_binary_frame_ = true;
+  }
   bool ret = service_connection_->Handle(
       connection_,
       decoder);
@@ -138,19 +473,21 @@ bool RawProtobufConnection::Handle(
     return true;
   }
   const ProtobufLineFormat::MetaData &meta = decoder->meta();
-  HandlerTable::value_type::second_type handler;
-  {
-    boost::mutex::scoped_lock locker(response_handler_table_mutex_);
-    HandlerTable::iterator it = response_handler_table_.find(meta.identify());
-    if (it == response_handler_table_.end()) {
-      VLOG(2) << name() << " : " << "Unknown request";
-      return false;
+  PendingCallTable::Call call;
+  if (!pending_calls_.Remove(meta.identify(), &call)) {
+    if (meta.type() == ProtobufLineFormat::MetaData::RESPONSE) {
+      // The call had been canceled.
+      VLOG(2) << name() << " : " << "Drop the response: " << meta.identify();
+      return true;
     }
-    handler = it->second;
-    response_handler_table_.erase(it);
-    RawConnTrace << "Remove: " << meta.identify() << " table size: " << response_handler_table_.size();
+    VLOG(2) << name() << " : " << "Unknown request";
+    return false;
   }
-  handler(decoder, connection_);
+  RawConnTrace << "Remove: " << meta.identify() << " table size: " << pending_calls_.size();
+  if (meta.has_method_index() && call.method_id >= 0) {
+    SetPeerMethodIndex(call.method_id, meta.method_index());
+  }
+  CompleteCall(decoder, connection_.get(), call);
   return true;
 }
 
@@ -159,32 +496,46 @@ RawProtobufConnection::RawProtobufConnection(
     boost::shared_ptr<Connection> connection,
     ProtobufConnection *service_connection)
   : RawConnectionImpl<ProtobufDecoder>(name, connection),
-    service_connection_(service_connection) {
+    service_connection_(service_connection),
+    peer_binary_frame_(false),
+    peer_method_indexes_(NULL) {
 }
 
-static void CallMethodCallback(
-    const ProtobufDecoder *decoder,
-    boost::shared_ptr<Connection> connection,
-    google::protobuf::RpcController *controller,
-    google::protobuf::Message *response,
-    google::protobuf::Closure *done) {
-  ScopedClosure run(done);
+void RawProtobufConnection::SetPeerMethodIndex(int method_id,
+                                               int method_index) {
+  if (peer_method_indexes_ == NULL) {
+    int *indexes = new int[MethodCache::kMaxMethods];
+    std::fill(indexes, indexes + MethodCache::kMaxMethods, -1);
+    if (!atomic_compare_and_swap(&peer_method_indexes_,
+                                 static_cast<int *>(NULL), indexes)) {
+      delete []indexes;
+    }
+  }
+  peer_method_indexes_[method_id] = method_index;
+}
+
+static void CompleteCall(const ProtobufDecoder *decoder,
+                         const Connection *connection,
+                         const PendingCallTable::Call &call,
+                         const char *reason) {
+  ScopedClosure run(call.done);
   RpcController *rpc_controller = dynamic_cast<RpcController*>(
-      controller);
+      call.controller);
   if (decoder == NULL) {
     VLOG(2) << "NULL Decoder, may call from destructor";
     if (rpc_controller) {
-      rpc_controller->SetFailed("Abort");
+      rpc_controller->SetFailed(reason);
       rpc_controller->Notify();
     }
     return;
   }
   const ProtobufLineFormat::MetaData &meta = decoder->meta();
+  google::protobuf::Message *response = call.response;
   VLOG(2) << connection->name() << " : " << "Handle response message "
           << response->GetDescriptor()->full_name()
           << " identify: " << meta.identify();
-  if (!response->ParseFromArray(meta.content().c_str(),
-                                            meta.content().size())) {
+  if (!response->ParseFromArray(decoder->payload(),
+                               decoder->payload_size())) {
     LOG(WARNING) << connection->name() << " : " << "Fail to parse the response :";
     if (rpc_controller) {
       rpc_controller->SetFailed("Fail to parse the response:");
@@ -203,65 +554,82 @@ void RawProtobufConnection::CallMethod(
     google::protobuf::Message *response,
     google::protobuf::Closure *done) {
   VLOG(2) << name() << " : " << "CallMethod";
-  uint64 request_identify = hash8(method->full_name());
-  uint64 response_identify = hash8(response->GetDescriptor()->full_name());
+  PendingCallTable::Call call;
+  call.id = pending_calls_.NextId();
+  const MethodCache::Entry *method_entry = MethodCache::Get(method);
+  call.method_id = method_entry ? MethodCache::Id(method_entry) : -1;
+  const uint64 request_identify = method_entry ?
+    method_entry->fingerprint : hash8(method->full_name());
+  call.controller = controller;
+  call.response = response;
+  call.done = done;
+  const uint64 response_identify = call.id;
   ProtobufLineFormat::MetaData meta;
   RpcController *rpc_controller = dynamic_cast<RpcController*>(
       controller);
   bool error = false;
   string reason;
   EncodeData data;
-  {
-    boost::mutex::scoped_lock locker(response_handler_table_mutex_);
-    HandlerTable::const_iterator it = response_handler_table_.find(response_identify);
-    while (it != response_handler_table_.end()) {
-      static int seq = 1;
-      ++seq;
-      response_identify += seq;
-      it = response_handler_table_.find(response_identify);
-    }
-    meta.set_identify(request_identify);
-    meta.set_type(ProtobufLineFormat::MetaData::REQUEST);
-    meta.set_response_identify(response_identify);
-    response_handler_table_.insert(make_pair(
-        response_identify,
-        boost::bind(CallMethodCallback, _1, _2, controller, response, done)));
-    error =  !request->AppendToString(meta.mutable_content());
-    if (error) {
-      LOG(WARNING) << name() << " : "
-           << "Fail to serialze request form method: "
-           << method->full_name();
-      reason = "AppendTostringError";
-      goto failed;
+  meta.set_identify(request_identify);
+  if (call.method_id >= 0 && peer_method_indexes_ != NULL &&
+      peer_method_indexes_[call.method_id] >= 0) {
+    meta.set_method_index(peer_method_indexes_[call.method_id]);
+  }
+  meta.set_type(ProtobufLineFormat::MetaData::REQUEST);
+  meta.set_response_identify(response_identify);
+  if (rpc_controller != NULL) {
+    if (rpc_controller->timeout_ms() > 0) {
+      meta.set_timeout_ms(rpc_controller->timeout_ms());
     }
-    VLOG(2) << name() << " Insert: "
-            << response_identify << " to response handler table, size: "
-            << response_handler_table_.size();
+    rpc_controller->set_call(connection_, call.id);
+  }
+  pending_calls_.Insert(call);
+  VLOG(2) << name() << " Insert: "
+          << response_identify << " to response handler table, size: "
+          << pending_calls_.size();
+  if (!peer_binary_frame_) {
+    meta.set_binary_frame(true);
+  }
+  if (!request->IsInitialized()) {
+    LOG(WARNING) << name() << " : "
+                 << "Fail to serialze request form method: "
+                 << method->full_name();
+    reason = "AppendTostringError";
+    goto failed;
+  }
+  if (rpc_controller != NULL &&
+      rpc_controller->encoded_request().get() != NULL) {
+    data = EncodeMessage(&meta, rpc_controller->encoded_request(),
+                         peer_binary_frame_);
+  } else if (rpc_controller != NULL && rpc_controller->attachment() != NULL) {
+    data = EncodeMessage(&meta, request, peer_binary_frame_, 0,
+                         rpc_controller->attachment_field(),
+                         rpc_controller->attachment());
+  } else {
+    data = EncodeMessage(&meta, request, peer_binary_frame_);
   }
-  data = EncodeMessage(&meta);
   error = !PushData(data);
   if (error) {
     LOG(WARNING) << name() << " : " << "PushData error, connection may closed";
     reason = "PushDataError";
-    delete data.first;
-    delete data.second;
+    delete data.data;
+    delete data.payload;
     goto failed;
   }
-  RawConnTrace << " PushData, " << " incoming: " << incoming()->size();
+  RawConnTrace << " PushData";
   error = !ScheduleWrite(status);
   if (error) {
     LOG(WARNING) << name() << " : "
         << "ScheduleWrite error, connection may closed";
     reason = "ScheduleWriteError";
-    delete data.first;
-    delete data.second;
+    // The data is owned by the incoming buffer now.
     goto failed;
   }
   return;
 failed:
-  {
-    boost::mutex::scoped_lock locker(response_handler_table_mutex_);
-    response_handler_table_.erase(response_identify);
+  // The response or the ReleaseResponseTable may have completed it.
+  if (!pending_calls_.Remove(response_identify, &call)) {
+    return;
   }
   if (rpc_controller) {
     rpc_controller->SetFailed(reason);
@@ -271,4 +639,22 @@ failed:
     done->Run();
   }
 }
+bool RawProtobufConnection::CancelCall(
+    RawConnection::StatusPtr status, uint64 call_id) {
+  PendingCallTable::Call call;
+  if (!pending_calls_.Remove(call_id, &call)) {
+    return false;
+  }
+  RawConnTrace << "Cancel: " << call_id;
+  RpcController *rpc_controller = dynamic_cast<RpcController*>(
+      call.controller);
+  if (rpc_controller) {
+    rpc_controller->set_canceled();
+  }
+  if (peer_binary_frame_) {
+    Send(status, EncodeControl(CONTROL_CANCEL, call_id));
+  }
+  CompleteCall(NULL, connection_.get(), call, "Canceled");
+  return true;
+}
 #undef RawConnTrace
@@ -35,6 +35,7 @@
 #define NET2_RAW_PROTOBUF_CONNECTION_HPP_
 #include "base/base.hpp"
 #include "server/connection.hpp"
+#include "server/pending_call_table.hpp"
 #include <server/meta.pb.h>
 #include <boost/function.hpp>
 #include <boost/thread/condition.hpp>
@@ -45,80 +46,172 @@
 #include <protobuf/service.h>
 #include "thread/notifier.hpp"
 // Encoder the Protobuf to line format.
-// The line format is:
+// The text format is:
 // length:content
-typedef pair<const string *, const string *> EncodeData;
-inline EncodeData EncodeMessage(const google::protobuf::Message *msg) {
-  string *content = new string;
-  if (!msg->AppendToString(content)) {
-    delete content;
-    return make_pair(static_cast<const string *>(NULL),
-                     static_cast<const string *>(NULL));
+// The binary format is:
+// magic flags varint(length) content
+// The binary format is only sent to a peer which had set
+// MetaData.binary_frame, so the old peers keep the text format.
+static const char kFrameMagic = 0xb5;
+enum FrameFlag {
+  // Not supported yet, the decoder rejects it.
+  FRAME_COMPRESSED = 0x01,
+  // Two bits of priority, 0 is the default.
+  FRAME_PRIORITY_MASK = 0x06,
+  // The content is a ControlType byte and a varint argument instead of the
+  // MetaData, only sent to the binary peers.
+  FRAME_CONTROL = 0x08,
+};
+enum ControlType {
+  // The peer answers a CONTROL_PING with a CONTROL_PONG of the same
+  // argument.
+  CONTROL_PING = 1,
+  CONTROL_PONG = 2,
+  // The client cancels the call of the argument id.
+  CONTROL_CANCEL = 3,
+  // The server dropped the call of the argument id at the deadline.
+  CONTROL_DROP = 4,
+};
+// Enough for "2147483647:" and magic + flags + 5 bytes varint.
+static const int kMaxFrameHeaderSize = 11;
+// The encoded frame, the header is written in the front of the data, right
+// before the content. The payload is the serialized MetaData.content and
+// sent as a separate buffer, so the payload is only serialized once. The
+// shared_payload is the payload shared with the other frames. The
+// attachment is the tail of the payload sent from the file.
+struct EncodeData {
+  EncodeData() : data(NULL), offset(0), payload(NULL) {
   }
-  string *header = new string(boost::lexical_cast<string>(content->size()));
-  header->push_back(':');
-  VLOG(2) << "Encode Message, header: " << *header
-          << " content size: " << content->size();
-  return make_pair(header, content);
+  const string *data;
+  int offset;
+  const string *payload;
+  SharedBlockPtr shared_payload;
+  FileRegion attachment;
 };
 
+// Encode the meta, and the content message as the MetaData.content field
+// if it's not NULL. The attachment is appended to the content as its
+// bytes field of the attachment_field, the last one wins when parsing.
+EncodeData EncodeMessage(const google::protobuf::Message *meta,
+                         const google::protobuf::Message *content,
+                         bool binary = false, uint8 flags = 0,
+                         int attachment_field = 0,
+                         const FileRegion *attachment = NULL);
+// Encode the meta, and the serialized content shared by the frames of many
+// connections.
+EncodeData EncodeMessage(const google::protobuf::Message *meta,
+                         const SharedBlockPtr &content,
+                         bool binary = false, uint8 flags = 0);
+// Encode a binary control frame.
+EncodeData EncodeControl(uint8 type, uint64 argument = 0);
+
 class ProtobufDecoder {
  public:
   /// Construct ready to parse the request method.
-  ProtobufDecoder() : state_(Start) {
+  ProtobufDecoder() : state_(Start), length_(0), shift_(0), flags_(0),
+    binary_(false), control_type_(0), control_argument_(0),
+    payload_(NULL), payload_size_(0) {
   };
 
   /// Parse some data. The boost::tribool return value is true when a complete request
   /// has been parsed, false if the data is invalid, indeterminate when more
-  /// data is required. The InputIterator return value indicates how much of the
+  /// data is required. The returned pointer indicates how much of the
   /// input has been consumed.
-  template <typename InputIterator>
-  boost::tuple<boost::tribool, InputIterator> Decode(
-      InputIterator begin, InputIterator end) {
-    VLOG(2) << "Decode size: " << (end - begin);
-    while (begin != end) {
-      boost::tribool result = Consume(*begin++);
-      if (result || !result) {
-        return boost::make_tuple(result, begin);
-      }
-    }
-    boost::tribool result = boost::indeterminate;
-    return boost::make_tuple(result, begin);
-  }
+  /// The length prefix is parsed byte by byte, the content is copied in one
+  /// chunk, or parsed in place when the whole content is in the input.
+  /// The input is kept till the reset() when parsed in place.
+  boost::tuple<boost::tribool, const char *> Decode(
+      const char *begin, const char *end);
 
+  // The meta without the content field, see payload().
   const ProtobufLineFormat::MetaData &meta() const {
     return meta_;
   }
+  // The MetaData.content of the current message, points into the input or
+  // the content buffer, valid till the reset().
+  const char *payload() const {
+    return payload_;
+  }
+  int payload_size() const {
+    return payload_size_;
+  }
+  // The content length of the current message.
+  int length() const {
+    return length_;
+  }
+  // The current message came in the binary format.
+  bool binary() const {
+    return binary_;
+  }
+  // The FrameFlag of a binary message.
+  uint8 flags() const {
+    return flags_;
+  }
+  // The current message is a control frame, the meta is not set.
+  bool control() const {
+    return flags_ & FRAME_CONTROL;
+  }
+  uint8 control_type() const {
+    return control_type_;
+  }
+  uint64 control_argument() const {
+    return control_argument_;
+  }
+  // The storage the rest of the content goes to, so a large content can be
+  // read from the socket without the copy. Empty unless the decoder is in
+  // the middle of a content.
+  boost::asio::mutable_buffer direct_buffer() const {
+    if (state_ != Content || content_.capacity() == 0) {
+      return boost::asio::mutable_buffer();
+    }
+    return boost::asio::mutable_buffer(content_.data(), content_.size());
+  }
+  // Notify n bytes had been read into the direct_buffer(), the return value
+  // is the same as Decode().
+  boost::tribool Commit(int n);
   void reset() {
     state_ = Start;
-    length_store_.clear();
     length_ = 0;
+    shift_ = 0;
+    flags_ = 0;
+    binary_ = false;
+    payload_ = NULL;
+    payload_size_ = 0;
     content_.clear();
   }
 private:
-  /// Handle the next character of input.
+  /// Handle the next character of the frame header.
   boost::tribool Consume(char input);
+  // Parse the meta data once the content is full.
+  boost::tribool ParseContent();
+  boost::tribool ParseContent(const char *data, int size);
+  boost::tribool ParseControl(const char *data, int size);
+  bool ParseMeta(const char *data, int size);
 
   /// The current state of the parser.
   enum State {
     Start,
     Length,
+    Flags,
+    BinaryLength,
     Content,
     End
   } state_;
 
-  string length_store_;
   int length_;
+  // The bits of the varint length had been read.
+  int shift_;
+  uint8 flags_;
+  bool binary_;
+  uint8 control_type_;
+  uint64 control_argument_;
+  const char *payload_;
+  int payload_size_;
   Buffer<char> content_;
   ProtobufLineFormat::MetaData meta_;
 };
 
 class RawProtobufConnection : public RawConnectionImpl<ProtobufDecoder> {
- private:
-  typedef boost::function2<void,
-          const ProtobufDecoder*,
-          boost::shared_ptr<Connection> > HandlerFunctor;
-  typedef hash_map<uint64, HandlerFunctor> HandlerTable;
  public:
   RawProtobufConnection(
       const string &name,
@@ -133,12 +226,26 @@ class RawProtobufConnection : public RawConnectionImpl<ProtobufDecoder> {
                   const google::protobuf::Message *request,
                   google::protobuf::Message *response,
                   google::protobuf::Closure *done);
+  // Thread safe, return false if the call had completed.
+  bool CancelCall(RawConnection::StatusPtr status, uint64 call_id);
  private:
   void ReleaseResponseTable();
   virtual bool Handle(const ProtobufDecoder *decoder);
-  // The response handler table is per connection.
-  HandlerTable response_handler_table_;
-  boost::mutex response_handler_table_mutex_;
+  bool HandleControl(const ProtobufDecoder *decoder);
+  bool CanPing() const {
+    return peer_binary_frame_;
+  }
+  bool SendPing(RawConnection::StatusPtr status);
+  void SetPeerMethodIndex(int method_id, int method_index);
+  // Push the frame and schedule the write, delete the frame on failure.
+  bool Send(RawConnection::StatusPtr status, const EncodeData &data);
   ProtobufConnection *service_connection_;
+  // The peer can decode the binary frame.
+  volatile bool peer_binary_frame_;
+  // The calls waiting for the responses, keyed by the response identify.
+  PendingCallTable pending_calls_;
+  // The method index of the peer by the MethodCache id, -1 if not known.
+  // Allocated once the peer sends an index.
+  int *volatile peer_method_indexes_;
 };
 #endif  // NET2_RAW_PROTOBUF_CONNECTION_HPP_
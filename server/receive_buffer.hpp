@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#ifndef RECEIVE_BUFFER_HPP_
+#define RECEIVE_BUFFER_HPP_
+#include "base/base.hpp"
+#include <boost/asio.hpp>
+#include <glog/logging.h>
+// The read statistics of a connection.
+struct ReceiveStats {
+  ReceiveStats() : reads(0), direct_reads(0), bytes(0), messages(0) {
+  }
+  double reads_per_message() const {
+    return messages == 0 ? 0 : static_cast<double>(reads) / messages;
+  }
+  double bytes_per_read() const {
+    return reads == 0 ? 0 : static_cast<double>(bytes) / reads;
+  }
+  // Completed async_read_some, including the direct reads.
+  uint64 reads;
+  // The reads went straight into the decoder's storage.
+  uint64 direct_reads;
+  uint64 bytes;
+  uint64 messages;
+};
+
+// The read window of a connection. The window follows the average size of
+// the recent messages, so small messages use a small buffer and a bulk
+// transfer needs fewer reads per message.
+// Not thread safe, only the reading thread touch it.
+class ReceiveBuffer : public boost::noncopyable {
+ public:
+  static const int kMinWindow = 8192;
+  static const int kMaxWindow = 256 * 1024;
+  ReceiveBuffer() : window_(kMinWindow), capacity_(0), average_(0) {
+  }
+  // The buffer for the next read, the storage is (re)allocated here so it
+  // must not be called while a read is pending.
+  boost::asio::mutable_buffers_1 buffer() {
+    if (capacity_ != window_) {
+      VLOG(2) << "ReceiveBuffer resize from: " << capacity_
+              << " to: " << window_;
+      data_.reset(new char[window_]);
+      capacity_ = window_;
+    }
+    return boost::asio::buffer(data_.get(), capacity_);
+  }
+  const char *data() const {
+    return data_.get();
+  }
+  int window() const {
+    return window_;
+  }
+  // Feed the size of a complete message.
+  void OnMessage(int size) {
+    // Exponential moving average, the latest message weights 1/4.
+    average_ += (size - average_) / 4;
+    const int target = Fit(average_);
+    if (target > window_) {
+      // Grow at once, a bulk transfer shouldn't wait for the average.
+      window_ = target;
+    } else if (target < window_ && average_ <= window_ / 4) {
+      // Shrink by half, avoid flapping on mixed traffic.
+      window_ /= 2;
+    }
+  }
+ private:
+  static int Fit(int size) {
+    int window = kMinWindow;
+    while (window < size && window < kMaxWindow) {
+      window <<= 1;
+    }
+    return window;
+  }
+  scoped_array<char> data_;
+  int window_;
+  int capacity_;
+  int average_;
+};
+#endif  // RECEIVE_BUFFER_HPP_
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "server/receive_buffer.hpp"
+class ReceiveBufferTest : public testing::Test {
+ protected:
+  static const int kMinWindow;
+  static const int kMaxWindow;
+};
+const int ReceiveBufferTest::kMinWindow = ReceiveBuffer::kMinWindow;
+const int ReceiveBufferTest::kMaxWindow = ReceiveBuffer::kMaxWindow;
+
+TEST_F(ReceiveBufferTest, SmallMessage) {
+  ReceiveBuffer b;
+  EXPECT_EQ(b.window(), kMinWindow);
+  for (int i = 0; i < 100; ++i) {
+    b.OnMessage(100);
+  }
+  EXPECT_EQ(b.window(), kMinWindow);
+  EXPECT_EQ(boost::asio::buffer_size(b.buffer()), kMinWindow);
+}
+
+TEST_F(ReceiveBufferTest, GrowAndShrink) {
+  ReceiveBuffer b;
+  // A 640K slice.
+  for (int i = 0; i < 10; ++i) {
+    b.OnMessage(640 * 1024);
+  }
+  EXPECT_EQ(b.window(), kMaxWindow);
+  EXPECT_EQ(boost::asio::buffer_size(b.buffer()), kMaxWindow);
+  // One small message don't shrink the window.
+  b.OnMessage(100);
+  EXPECT_EQ(b.window(), kMaxWindow);
+  for (int i = 0; i < 100; ++i) {
+    b.OnMessage(100);
+  }
+  EXPECT_EQ(b.window(), kMinWindow);
+  EXPECT_EQ(boost::asio::buffer_size(b.buffer()), kMinWindow);
+}
+
+TEST_F(ReceiveBufferTest, Stats) {
+  ReceiveStats stats;
+  EXPECT_EQ(stats.reads_per_message(), 0);
+  EXPECT_EQ(stats.bytes_per_read(), 0);
+  stats.reads = 4;
+  stats.bytes = 8192;
+  stats.messages = 2;
+  EXPECT_EQ(stats.reads_per_message(), 2);
+  EXPECT_EQ(stats.bytes_per_read(), 2048);
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
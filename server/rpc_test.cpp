@@ -33,20 +33,53 @@
 
 #include "server/client_connection.hpp"
 #include "server/server.hpp"
+#include "server/raw_protobuf_connection.hpp"
+#include "server/method_cache.hpp"
 #include <gtest/gtest.h>
 #include "proto/hello.pb.h"
 #include "boost/thread.hpp"
+#include "thread/threadpool.hpp"
+#include "base/atomic.hpp"
+#include <new>
+#include <fstream>
+#include <dirent.h>
+#include <sys/stat.h>
 
 DEFINE_string(server, "localhost", "The test server");
 DEFINE_string(port, "6789", "The test server");
 DEFINE_int32(num_threads, 1, "The test server thread number");
+DEFINE_int32(call_threads, 8, "The threads calling on one connection");
+DEFINE_int32(calls_per_thread, 200, "The calls of each calling thread");
+DEFINE_int32(outstanding_calls, 1000, "The calls in flight on one connection");
+DEFINE_int32(outstanding_rounds, 5, "The rounds of the outstanding calls");
+DEFINE_int32(allocation_calls, 1000, "The calls counting the allocations");
+DEFINE_int32(max_server_allocations, 6,
+             "The bound of the server allocations per served echo");
 DECLARE_bool(logtostderr);
 DECLARE_int32(v);
 
+// The allocations of the threads that turned the counting on, only the
+// server thread of the Allocations test does.
+static __thread bool count_allocations = false;
+static volatile int allocations = 0;
+void *operator new(std::size_t size) {
+  if (count_allocations) {
+    atomic_inc(&allocations, 1);
+  }
+  void *p = malloc(size);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
 
 class EchoServiceImpl : public Hello::EchoService {
  public:
-  EchoServiceImpl() {
+  EchoServiceImpl() : calls_(0) {
   }
 
   virtual void Echo(::google::protobuf::RpcController*,
@@ -54,13 +87,103 @@ class EchoServiceImpl : public Hello::EchoService {
                     Hello::EchoResponse *response,
                     google::protobuf::Closure *done) {
     LOG(INFO) << "Echo ServiceImpl called";
+    atomic_inc(&calls_, 1);
     response->set_echoed(true);
     response->set_text(request->question());
     response->set_close(true);
     done->Run();
   }
+  volatile int calls_;
+};
+
+// Echo without logging, count the allocations of the serving thread from
+// the call after the counting_ is set. Count the calls reusing the request
+// and the done of the last call.
+class QuietEchoServiceImpl : public Hello::EchoService2 {
+ public:
+  QuietEchoServiceImpl()
+    : last_request_(NULL), last_done_(NULL), reused_(0), counting_(false) {
+  }
+  virtual void Echo1(::google::protobuf::RpcController*,
+                     const Hello::EchoRequest *request,
+                     Hello::EchoResponse *response,
+                     google::protobuf::Closure *done) {
+    count_allocations = counting_;
+    if (request == last_request_ && done == last_done_) {
+      ++reused_;
+    }
+    last_request_ = request;
+    last_done_ = done;
+    response->set_echoed(true);
+    response->set_text(request->question());
+    done->Run();
+  }
+  const Hello::EchoRequest *last_request_;
+  google::protobuf::Closure *last_done_;
+  int reused_;
+  volatile bool counting_;
 };
 
+// Answer the Echo1 with the reversed question.
+class ReverseServiceImpl : public Hello::EchoService2 {
+ public:
+  virtual void Echo1(::google::protobuf::RpcController*,
+                     const Hello::EchoRequest *request,
+                     Hello::EchoResponse *response,
+                     google::protobuf::Closure *done) {
+    response->set_echoed(true);
+    response->set_text(string(request->question().rbegin(),
+                              request->question().rend()));
+    done->Run();
+  }
+};
+
+// Hold the Echo1 calls until the test releases them.
+class HoldServiceImpl : public Hello::EchoService2 {
+ public:
+  HoldServiceImpl() : received_(new Notifier("HoldService")),
+    canceled_(new Notifier("HoldServiceCanceled")), controller_(NULL),
+    done_(NULL) {
+  }
+  virtual void Echo1(::google::protobuf::RpcController*,
+                     const Hello::EchoRequest *request,
+                     Hello::EchoResponse *response,
+                     google::protobuf::Closure *done) {
+    response->set_echoed(true);
+    response->set_text(request->question());
+    controller_ = ServiceController::Get(done);
+    controller_->NotifyOnCancel(NewClosure(boost::bind(
+        &Notifier::Notify, canceled_)));
+    done_ = done;
+    received_->Notify();
+  }
+  boost::shared_ptr<Notifier> received_;
+  boost::shared_ptr<Notifier> canceled_;
+  ServiceController *controller_;
+  google::protobuf::Closure *done_;
+};
+
+// Sleep in the Echo1 for the milliseconds in the question, record the
+// order of the calls.
+class SleepServiceImpl : public Hello::EchoService2 {
+ public:
+  virtual void Echo1(::google::protobuf::RpcController*,
+                     const Hello::EchoRequest *request,
+                     Hello::EchoResponse *response,
+                     google::protobuf::Closure *done) {
+    const int ms = boost::lexical_cast<int>(request->question());
+    boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+    {
+      boost::mutex::scoped_lock locker(mutex_);
+      order_.push_back(request->client_threadid());
+    }
+    response->set_echoed(true);
+    response->set_text(request->question());
+    done->Run();
+  }
+  vector<string> order_;
+  boost::mutex mutex_;
+};
 
 class EchoTest : public testing::Test {
  public:
@@ -99,6 +222,38 @@ class EchoTest : public testing::Test {
   void CallDone() {
     LOG(INFO) << "Call done is called";
   }
+
+  // Push the calls without waiting for the responses, serialized by the
+  // mutex if it's not NULL.
+  void PushEcho(int calls, boost::mutex *mutex,
+                boost::shared_ptr<RpcController> *controller,
+                Hello::EchoResponse *response) {
+    Hello::EchoRequest request;
+    request.set_question("push");
+    for (int i = 0; i < calls; ++i) {
+      controller[i].reset(new RpcController("Push"));
+      if (mutex != NULL) {
+        boost::mutex::scoped_lock locker(*mutex);
+        stub_->Echo(controller[i].get(), &request, &response[i], NULL);
+      } else {
+        stub_->Echo(controller[i].get(), &request, &response[i], NULL);
+      }
+    }
+  }
+  // Call the echo one by one, return the number of the succeeded calls.
+  void CallEcho(int calls, int *succeeded) {
+    for (int i = 0; i < calls; ++i) {
+      Hello::EchoRequest request;
+      Hello::EchoResponse response;
+      request.set_question(boost::lexical_cast<string>(i));
+      RpcController controller;
+      stub_->Echo(&controller, &request, &response, NULL);
+      if (controller.Wait(10000) && !controller.Failed() &&
+          response.text() == request.question()) {
+        ++*succeeded;
+      }
+    }
+  }
  protected:
   boost::shared_ptr<ProtobufConnection> server_connection_;
   boost::shared_ptr<ClientConnection> client_connection_;
@@ -126,6 +281,756 @@ TEST_F(EchoTest, Test1) {
   client_connection_->Disconnect();
 }
 
+TEST_F(EchoTest, LargeMessage) {
+  Hello::EchoRequest request;
+  Hello::EchoResponse response;
+  request.set_question(string(640 * 1024, 'x'));
+  RpcController controller;
+  stub_->Echo(&controller,
+              &request,
+              &response,
+              done_.get());
+  EXPECT_TRUE(controller.Wait(10000));
+  EXPECT_EQ(request.question(), response.text());
+  EXPECT_FALSE(controller.Failed()) << controller.ErrorText();
+  ReceiveStats stats = client_connection_->receive_stats();
+  LOG(INFO) << "reads: " << stats.reads
+            << " direct reads: " << stats.direct_reads
+            << " reads per message: " << stats.reads_per_message()
+            << " bytes per read: " << stats.bytes_per_read();
+  EXPECT_EQ(stats.messages, 1);
+  EXPECT_GT(stats.direct_reads, 0);
+  client_connection_->Disconnect();
+}
+
+// The calls pushed within the flush delay go out in one write.
+TEST_F(EchoTest, Coalesce) {
+  boost::shared_ptr<ClientConnection> connection(new ClientConnection(
+      "EchoTestCoalesceClient", FLAGS_server, FLAGS_port));
+  FlushPolicy flush_policy;
+  flush_policy.max_delay_us = 200000;
+  connection->set_flush_policy(flush_policy);
+  CHECK(connection->Connect());
+  Hello::EchoService::Stub stub(connection.get());
+  const int kCalls = 10;
+  Hello::EchoRequest request[kCalls];
+  Hello::EchoResponse response[kCalls];
+  RpcController controller[kCalls];
+  for (int i = 0; i < kCalls; ++i) {
+    request[i].set_question(boost::lexical_cast<string>(i));
+    stub.Echo(&controller[i], &request[i], &response[i], NULL);
+  }
+  for (int i = 0; i < kCalls; ++i) {
+    EXPECT_TRUE(controller[i].Wait(10000));
+    EXPECT_FALSE(controller[i].Failed()) << controller[i].ErrorText();
+    EXPECT_EQ(request[i].question(), response[i].text());
+  }
+  SendStats stats = connection->send_stats();
+  LOG(INFO) << "writes: " << stats.writes
+            << " frames per write: " << stats.frames_per_write();
+  EXPECT_EQ(stats.frames, kCalls);
+  EXPECT_EQ(stats.writes, 1);
+  connection->Disconnect();
+  client_connection_->Disconnect();
+}
+
+// The question is sent from the file by sendfile.
+TEST_F(EchoTest, FileAttachment) {
+  char filename[] = "/tmp/rpc_testXXXXXX";
+  const int fd = mkstemp(filename);
+  ASSERT_GE(fd, 0);
+  const string content(640 * 1024, 'x');
+  ASSERT_EQ(write(fd, "head", 4), 4);
+  ASSERT_EQ(write(fd, content.c_str(), content.size()), content.size());
+  close(fd);
+  boost::shared_ptr<SharedFile> file = SharedFile::Open(filename);
+  unlink(filename);
+  ASSERT_TRUE(file.get() != NULL);
+  Hello::EchoRequest request;
+  Hello::EchoResponse response;
+  request.set_question("");
+  RpcController controller;
+  controller.set_attachment(Hello::EchoRequest::kQuestionFieldNumber,
+                            FileRegion(file, 4, content.size()));
+  stub_->Echo(&controller, &request, &response, NULL);
+  EXPECT_TRUE(controller.Wait(10000));
+  EXPECT_FALSE(controller.Failed()) << controller.ErrorText();
+  EXPECT_TRUE(response.text() == content);
+  // The empty region doesn't close the connection.
+  controller.Reset();
+  controller.set_attachment(Hello::EchoRequest::kQuestionFieldNumber,
+                            FileRegion(file, 4, 0));
+  stub_->Echo(&controller, &request, &response, NULL);
+  EXPECT_TRUE(controller.Wait(10000));
+  EXPECT_FALSE(controller.Failed()) << controller.ErrorText();
+  EXPECT_EQ(response.text(), "");
+  // The write after the region finishes on the same connection.
+  controller.Reset();
+  request.set_question("after");
+  stub_->Echo(&controller, &request, &response, NULL);
+  EXPECT_TRUE(controller.Wait(10000));
+  EXPECT_FALSE(controller.Failed()) << controller.ErrorText();
+  EXPECT_EQ(response.text(), "after");
+  EXPECT_TRUE(client_connection_->IsConnected());
+  client_connection_->Disconnect();
+}
+
+// One serialized request is sent on two connections.
+TEST_F(EchoTest, SharedRequest) {
+  boost::shared_ptr<ClientConnection> connection(new ClientConnection(
+      "EchoTestSharedRequestClient", FLAGS_server, FLAGS_port));
+  CHECK(connection->Connect());
+  Hello::EchoRequest request;
+  request.set_question("shared");
+  string serialized;
+  request.SerializeToString(&serialized);
+  SharedBlockPtr block = SharedBlock::Create(&serialized);
+  Hello::EchoService::Stub stub(connection.get());
+  Hello::EchoResponse response[2];
+  RpcController controller[2];
+  controller[0].set_encoded_request(block);
+  controller[1].set_encoded_request(block);
+  stub_->Echo(&controller[0], &request, &response[0], NULL);
+  stub.Echo(&controller[1], &request, &response[1], NULL);
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_TRUE(controller[i].Wait(10000));
+    EXPECT_FALSE(controller[i].Failed()) << controller[i].ErrorText();
+    EXPECT_EQ(response[i].text(), "shared");
+  }
+  controller[0].Reset();
+  controller[1].Reset();
+  // Released by the connections after written.
+  EXPECT_EQ(block->refs(), 1);
+  connection->Disconnect();
+  client_connection_->Disconnect();
+}
+
+static void Writable(volatile int *called) {
+  atomic_inc(called, 1);
+}
+
+// The connection is not writable above the high watermark, and the
+// callback runs when the queue drains.
+TEST_F(EchoTest, Backpressure) {
+  boost::shared_ptr<ClientConnection> connection(new ClientConnection(
+      "EchoTestBackpressureClient", FLAGS_server, FLAGS_port));
+  FlushPolicy flush_policy;
+  // Hold the request in the queue for a while.
+  flush_policy.max_delay_us = 200000;
+  flush_policy.high_watermark = 1024;
+  flush_policy.low_watermark = 0;
+  connection->set_flush_policy(flush_policy);
+  CHECK(connection->Connect());
+  EXPECT_TRUE(connection->writable());
+  Hello::EchoService::Stub stub(connection.get());
+  Hello::EchoRequest request;
+  Hello::EchoResponse response;
+  request.set_question(string(4096, 'x'));
+  RpcController controller;
+  stub.Echo(&controller, &request, &response, NULL);
+  EXPECT_FALSE(connection->writable());
+  volatile int called = 0;
+  EXPECT_TRUE(connection->NotifyWritable(boost::bind(Writable, &called)));
+  EXPECT_EQ(called, 0);
+  EXPECT_TRUE(controller.Wait(10000));
+  EXPECT_EQ(request.question(), response.text());
+  for (int i = 0; i < 1000 && called == 0; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  EXPECT_EQ(called, 1);
+  EXPECT_TRUE(connection->writable());
+  // Run at once when writable.
+  EXPECT_TRUE(connection->NotifyWritable(boost::bind(Writable, &called)));
+  EXPECT_EQ(called, 2);
+  connection->Disconnect();
+  EXPECT_FALSE(connection->NotifyWritable(boost::bind(Writable, &called)));
+  client_connection_->Disconnect();
+}
+
+// Write the meta in the text frame of the old peers.
+static void WriteTextFrame(boost::asio::ip::tcp::socket *socket,
+                           const ProtobufLineFormat::MetaData &meta) {
+  const string frame = boost::lexical_cast<string>(meta.ByteSize()) + ":" +
+    meta.SerializeAsString();
+  boost::asio::write(*socket, boost::asio::buffer(frame));
+}
+
+// Read one frame from the socket into the decoder.
+static bool ReadFrame(boost::asio::ip::tcp::socket *socket,
+                      ProtobufDecoder *decoder) {
+  boost::tribool result = boost::indeterminate;
+  char buffer[4096];
+  while (boost::indeterminate(result)) {
+    const size_t n = socket->read_some(boost::asio::buffer(buffer));
+    const char *end;
+    boost::tie(result, end) = decoder->Decode(buffer, buffer + n);
+  }
+  return result ? true : false;
+}
+
+// No ping right after the traffic, but a peer without the binary frame
+// gets the OOB heartbeat every period.
+TEST_F(EchoTest, HeartbeatSuppressed) {
+  Hello::EchoRequest request;
+  Hello::EchoResponse response;
+  request.set_question("hello");
+  RpcController controller;
+  stub_->Echo(&controller, &request, &response, NULL);
+  EXPECT_TRUE(controller.Wait(10000));
+  const SendStats before = client_connection_->send_stats();
+  client_connection_->Expired();
+  const SendStats after = client_connection_->send_stats();
+  EXPECT_EQ(before.frames, after.frames);
+  EXPECT_TRUE(client_connection_->IsConnected());
+  // An old server, answering in the text frame.
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::acceptor acceptor(io_service,
+      boost::asio::ip::tcp::endpoint(
+          boost::asio::ip::address_v4::loopback(), 0));
+  boost::shared_ptr<ClientConnection> connection(new ClientConnection(
+      "EchoTestLegacyClient", "127.0.0.1",
+      boost::lexical_cast<string>(acceptor.local_endpoint().port())));
+  ASSERT_TRUE(connection->Connect());
+  boost::asio::ip::tcp::socket socket(io_service);
+  acceptor.accept(socket);
+  Hello::EchoService::Stub stub(connection.get());
+  RpcController legacy_controller;
+  Hello::EchoResponse legacy_response;
+  stub.Echo(&legacy_controller, &request, &legacy_response, NULL);
+  ProtobufDecoder decoder;
+  ASSERT_TRUE(ReadFrame(&socket, &decoder));
+  ProtobufLineFormat::MetaData meta;
+  meta.set_type(ProtobufLineFormat::MetaData::RESPONSE);
+  meta.set_identify(decoder.meta().response_identify());
+  response.SerializeToString(meta.mutable_content());
+  WriteTextFrame(&socket, meta);
+  EXPECT_TRUE(legacy_controller.Wait(10000));
+  EXPECT_EQ(legacy_response.text(), request.question());
+  connection->Expired();
+  // The OOB receive doesn't wait for the byte.
+  char heartbeat = 0;
+  boost::system::error_code ec = boost::asio::error::would_block;
+  for (int i = 0; i < 100 && ec; ++i) {
+    socket.receive(boost::asio::buffer(&heartbeat, sizeof(heartbeat)),
+                   boost::asio::socket_base::message_out_of_band, ec);
+    if (ec) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+  }
+  EXPECT_FALSE(ec) << ec.message();
+  EXPECT_EQ(heartbeat, 0xb);
+  connection->Disconnect();
+  client_connection_->Disconnect();
+}
+
+// Many threads push the requests onto the same connection.
+TEST_F(EchoTest, ConcurrentCalls) {
+  vector<int> succeeded(FLAGS_call_threads, 0);
+  boost::posix_time::ptime start =
+    boost::posix_time::microsec_clock::universal_time();
+  boost::thread_group threads;
+  for (int i = 0; i < FLAGS_call_threads; ++i) {
+    threads.create_thread(boost::bind(
+        &EchoTest::CallEcho, this, FLAGS_calls_per_thread, &succeeded[i]));
+  }
+  threads.join_all();
+  boost::posix_time::time_duration elapsed =
+    boost::posix_time::microsec_clock::universal_time() - start;
+  for (int i = 0; i < FLAGS_call_threads; ++i) {
+    EXPECT_EQ(succeeded[i], FLAGS_calls_per_thread);
+  }
+  LOG(WARNING) << "Backend: " << IOServicePool::backend()
+               << " threads: " << FLAGS_call_threads
+               << " calls: " << FLAGS_call_threads * FLAGS_calls_per_thread
+               << " calls per second: "
+               << FLAGS_call_threads * FLAGS_calls_per_thread /
+                  (elapsed.total_microseconds() / 1000000.0);
+  client_connection_->Disconnect();
+}
+
+// Many threads push the calls onto one connection without waiting, so the
+// pushes contend on the outbound queue. The mutex rounds serialize the
+// pushes like the old incoming_mutex_ did.
+TEST_F(EchoTest, PushContention) {
+  const int calls = FLAGS_calls_per_thread;
+  for (int threads = 1; threads <= FLAGS_call_threads; threads *= 2) {
+    double push_qps[2];
+    for (int locked = 0; locked < 2; ++locked) {
+      boost::mutex mutex;
+      vector<boost::shared_ptr<RpcController> > controller(threads * calls);
+      vector<Hello::EchoResponse> response(threads * calls);
+      boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::universal_time();
+      boost::thread_group pushers;
+      for (int i = 0; i < threads; ++i) {
+        pushers.create_thread(boost::bind(
+            &EchoTest::PushEcho, this, calls, locked ? &mutex : NULL,
+            &controller[i * calls], &response[i * calls]));
+      }
+      pushers.join_all();
+      boost::posix_time::time_duration elapsed =
+        boost::posix_time::microsec_clock::universal_time() - start;
+      push_qps[locked] = threads * calls /
+        (elapsed.total_microseconds() / 1000000.0);
+      int succeeded = 0;
+      for (int i = 0; i < threads * calls; ++i) {
+        if (controller[i]->Wait(10000) && !controller[i]->Failed() &&
+            response[i].text() == "push") {
+          ++succeeded;
+        }
+      }
+      EXPECT_EQ(succeeded, threads * calls);
+    }
+    LOG(WARNING) << "Backend: " << IOServicePool::backend()
+                 << " threads: " << threads
+                 << " mutex pushes per second: " << push_qps[1]
+                 << " lock free pushes per second: " << push_qps[0];
+  }
+  client_connection_->Disconnect();
+}
+
+// The bulk throughput on the loopback, compare the builds of the backends.
+TEST_F(EchoTest, Throughput) {
+  const int kCalls = 64;
+  const int kSize = 256 * 1024;
+  Hello::EchoRequest request;
+  request.set_question(string(kSize, 'x'));
+  Hello::EchoResponse response[kCalls];
+  RpcController controller[kCalls];
+  boost::posix_time::ptime start =
+    boost::posix_time::microsec_clock::universal_time();
+  for (int i = 0; i < kCalls; ++i) {
+    stub_->Echo(&controller[i], &request, &response[i], NULL);
+  }
+  for (int i = 0; i < kCalls; ++i) {
+    EXPECT_TRUE(controller[i].Wait(10000));
+    EXPECT_EQ(response[i].text().size(), kSize);
+  }
+  boost::posix_time::time_duration elapsed =
+    boost::posix_time::microsec_clock::universal_time() - start;
+  LOG(WARNING) << "Backend: " << IOServicePool::backend()
+               << " echo " << kCalls << " x " << kSize << " bytes: "
+               << 2.0 * kCalls * kSize / elapsed.total_microseconds()
+               << " MB/s";
+  client_connection_->Disconnect();
+}
+
+// The calls of two services, sent by the method index after the first
+// responses.
+TEST_F(EchoTest, MethodIndex) {
+  ReverseServiceImpl reverse_service;
+  server_connection_->RegisterService(&reverse_service);
+  Hello::EchoService2::Stub reverse_stub(client_connection_.get());
+  for (int i = 0; i < 5; ++i) {
+    Hello::EchoRequest request;
+    request.set_question("ab" + boost::lexical_cast<string>(i));
+    Hello::EchoResponse response, reverse_response;
+    RpcController controller, reverse_controller;
+    stub_->Echo(&controller, &request, &response, NULL);
+    reverse_stub.Echo1(&reverse_controller, &request, &reverse_response,
+                       NULL);
+    ASSERT_TRUE(controller.Wait(10000));
+    ASSERT_TRUE(reverse_controller.Wait(10000));
+    EXPECT_EQ(response.text(), request.question());
+    EXPECT_EQ(reverse_response.text(),
+              boost::lexical_cast<string>(i) + "ba");
+  }
+  client_connection_->Disconnect();
+}
+
+// A peer sending an index out of the int range gets the call dispatched by
+// the fingerprint.
+TEST_F(EchoTest, HugeMethodIndex) {
+  boost::asio::io_service io_service;
+  boost::asio::ip::tcp::resolver resolver(io_service);
+  boost::asio::ip::tcp::resolver::query query(FLAGS_server, FLAGS_port);
+  boost::asio::ip::tcp::socket socket(io_service);
+  socket.connect(*resolver.resolve(query));
+  const uint32 indexes[] = { 0x80000000u, 0xffffffffu };
+  for (int i = 0; i < 2; ++i) {
+    Hello::EchoRequest request;
+    request.set_question("huge" + boost::lexical_cast<string>(i));
+    ProtobufLineFormat::MetaData meta;
+    meta.set_type(ProtobufLineFormat::MetaData::REQUEST);
+    meta.set_identify(MethodCache::Fingerprint(
+        Hello::EchoService::descriptor()->method(0)));
+    meta.set_response_identify(i);
+    meta.set_method_index(indexes[i]);
+    request.SerializeToString(meta.mutable_content());
+    WriteTextFrame(&socket, meta);
+    ProtobufDecoder decoder;
+    ASSERT_TRUE(ReadFrame(&socket, &decoder));
+    EXPECT_EQ(decoder.meta().type(), ProtobufLineFormat::MetaData::RESPONSE);
+    EXPECT_EQ(decoder.meta().identify(), i);
+    EXPECT_EQ(decoder.meta().method_index(), 0);
+    Hello::EchoResponse response;
+    ASSERT_TRUE(response.ParseFromArray(decoder.payload(),
+                                        decoder.payload_size()));
+    EXPECT_EQ(response.text(), request.question());
+  }
+  socket.close();
+  client_connection_->Disconnect();
+}
+
+static void WaitNotifier(boost::shared_ptr<Notifier> notifier) {
+  notifier->Wait();
+}
+
+TEST_F(EchoTest, Cancel) {
+  HoldServiceImpl hold_service;
+  server_connection_->RegisterService(&hold_service);
+  Hello::EchoService2::Stub hold_stub(client_connection_.get());
+  // The first response tells the client the server takes the cancel.
+  int succeeded = 0;
+  CallEcho(1, &succeeded);
+  Hello::EchoRequest request;
+  request.set_question("cancel");
+  Hello::EchoResponse response;
+  RpcController controller;
+  hold_stub.Echo1(&controller, &request, &response, NULL);
+  ASSERT_TRUE(hold_service.received_->Wait(10000));
+  EXPECT_FALSE(hold_service.controller_->IsCanceled());
+  // The client fails the call at once, the server sees the cancel.
+  controller.StartCancel();
+  EXPECT_TRUE(controller.Wait(1000));
+  EXPECT_TRUE(controller.Failed());
+  EXPECT_EQ(controller.ErrorText(), "Canceled");
+  EXPECT_TRUE(controller.IsCanceled());
+  EXPECT_TRUE(hold_service.canceled_->Wait(10000));
+  EXPECT_TRUE(hold_service.controller_->IsCanceled());
+  hold_service.done_->Run();
+  // The connection still serves the calls.
+  CallEcho(3, &succeeded);
+  EXPECT_EQ(succeeded, 4);
+  // Too late to cancel the completed call.
+  RpcController completed_controller;
+  stub_->Echo(&completed_controller, &request, &response, NULL);
+  ASSERT_TRUE(completed_controller.Wait(10000));
+  completed_controller.StartCancel();
+  EXPECT_FALSE(completed_controller.IsCanceled());
+  EXPECT_FALSE(completed_controller.Failed());
+  // The call queued behind a slow one never runs. The executor is held by
+  // the slow task until the cancel is read.
+  ThreadPool pool("CancelQueued", 1);
+  pool.Start();
+  server_connection_->SetExecutor(
+      Hello::EchoService::descriptor()->method(0), &pool);
+  boost::shared_ptr<Notifier> slow(new Notifier("Slow"));
+  pool.PushTask(boost::bind(WaitNotifier, slow));
+  const int calls = echo_service_.calls_;
+  RpcController queued_controller;
+  stub_->Echo(&queued_controller, &request, &response, NULL);
+  queued_controller.StartCancel();
+  EXPECT_TRUE(queued_controller.IsCanceled());
+  // The inline call after the cancel shows the cancel is read.
+  hold_service.received_.reset(new Notifier("HoldService"));
+  controller.Reset();
+  hold_stub.Echo1(&controller, &request, &response, NULL);
+  ASSERT_TRUE(hold_service.received_->Wait(10000));
+  hold_service.done_->Run();
+  EXPECT_TRUE(controller.Wait(10000));
+  slow->Notify();
+  CallEcho(1, &succeeded);
+  EXPECT_EQ(succeeded, 5);
+  EXPECT_EQ(echo_service_.calls_, calls + 1);
+  client_connection_->Disconnect();
+  pool.Stop();
+}
+
+// The call is canceled when the wait times out, the late response isn't
+// written into the freed response.
+TEST_F(EchoTest, WaitTimeout) {
+  HoldServiceImpl hold_service;
+  server_connection_->RegisterService(&hold_service);
+  Hello::EchoService2::Stub hold_stub(client_connection_.get());
+  int succeeded = 0;
+  CallEcho(1, &succeeded);
+  Hello::EchoRequest request;
+  request.set_question("timeout");
+  Hello::EchoResponse *response = new Hello::EchoResponse;
+  RpcController controller;
+  hold_stub.Echo1(&controller, &request, response, NULL);
+  ASSERT_TRUE(hold_service.received_->Wait(10000));
+  EXPECT_FALSE(controller.Wait(100));
+  EXPECT_TRUE(controller.IsCanceled());
+  EXPECT_TRUE(controller.Failed());
+  EXPECT_EQ(controller.ErrorText(), "Canceled");
+  delete response;
+  EXPECT_TRUE(hold_service.canceled_->Wait(10000));
+  hold_service.done_->Run();
+  CallEcho(3, &succeeded);
+  EXPECT_EQ(succeeded, 4);
+  client_connection_->Disconnect();
+}
+
+TEST_F(EchoTest, Deadline) {
+  HoldServiceImpl hold_service;
+  server_connection_->RegisterService(&hold_service);
+  Hello::EchoService2::Stub hold_stub(client_connection_.get());
+  Hello::EchoRequest request;
+  request.set_question("deadline");
+  Hello::EchoResponse response;
+  RpcController controller;
+  controller.set_timeout_ms(100);
+  hold_stub.Echo1(&controller, &request, &response, NULL);
+  ASSERT_TRUE(hold_service.received_->Wait(10000));
+  EXPECT_FALSE(hold_service.controller_->IsCanceled());
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  EXPECT_TRUE(hold_service.controller_->IsCanceled());
+  // The late response still completes the call.
+  hold_service.done_->Run();
+  EXPECT_TRUE(hold_service.canceled_->Wait(10000));
+  EXPECT_TRUE(controller.Wait(10000));
+  EXPECT_FALSE(controller.Failed());
+  EXPECT_EQ(response.text(), request.question());
+  client_connection_->Disconnect();
+}
+
+// The slow method runs in the thread pool, the io_service still serves the
+// other connections, and the inline methods of the same connection.
+TEST_F(EchoTest, Executor) {
+  ThreadPool pool("SleepService", 1);
+  pool.Start();
+  SleepServiceImpl sleep_service;
+  server_connection_->RegisterService(&sleep_service, &pool);
+  Hello::EchoService2::Stub sleep_stub(client_connection_.get());
+  Hello::EchoRequest request;
+  request.set_question("500");
+  Hello::EchoResponse response;
+  RpcController controller;
+  sleep_stub.Echo1(&controller, &request, &response, NULL);
+  boost::shared_ptr<ClientConnection> connection(new ClientConnection(
+      "EchoTestExecutorClient", FLAGS_server, FLAGS_port));
+  ASSERT_TRUE(connection->Connect());
+  Hello::EchoService::Stub stub(connection.get());
+  Hello::EchoRequest echo_request;
+  echo_request.set_question("fast");
+  Hello::EchoResponse echo_response;
+  RpcController echo_controller;
+  stub.Echo(&echo_controller, &echo_request, &echo_response, NULL);
+  Hello::EchoResponse inline_response;
+  RpcController inline_controller;
+  stub_->Echo(&inline_controller, &echo_request, &inline_response, NULL);
+  EXPECT_TRUE(echo_controller.Wait(300));
+  EXPECT_TRUE(inline_controller.Wait(300));
+  EXPECT_EQ(inline_response.text(), echo_request.question());
+  {
+    // Still sleeping.
+    boost::mutex::scoped_lock locker(sleep_service.mutex_);
+    EXPECT_TRUE(sleep_service.order_.empty());
+  }
+  EXPECT_TRUE(controller.Wait(10000));
+  EXPECT_EQ(response.text(), request.question());
+  connection->Disconnect();
+  client_connection_->Disconnect();
+  pool.Stop();
+}
+
+// The calls of one connection start in order in the thread pool, and the
+// queued call past the deadline is dropped.
+TEST_F(EchoTest, ExecutorOrder) {
+  ThreadPool pool("SleepService", 4);
+  pool.Start();
+  SleepServiceImpl sleep_service;
+  server_connection_->RegisterService(&sleep_service, &pool);
+  Hello::EchoService2::Stub sleep_stub(client_connection_.get());
+  const int kCalls = 20;
+  Hello::EchoRequest request[kCalls];
+  Hello::EchoResponse response[kCalls];
+  RpcController controller[kCalls];
+  for (int i = 0; i < kCalls; ++i) {
+    request[i].set_question(i == 0 ? "300" : boost::lexical_cast<string>(i % 3));
+    request[i].set_client_threadid(boost::lexical_cast<string>(i));
+    sleep_stub.Echo1(&controller[i], &request[i], &response[i], NULL);
+  }
+  for (int i = 0; i < kCalls; ++i) {
+    EXPECT_TRUE(controller[i].Wait(10000));
+    EXPECT_FALSE(controller[i].Failed());
+  }
+  ASSERT_EQ(sleep_service.order_.size(), kCalls);
+  for (int i = 0; i < kCalls; ++i) {
+    EXPECT_EQ(sleep_service.order_[i], request[i].client_threadid());
+  }
+  // Queued behind a slow call.
+  Hello::EchoRequest slow_request, late_request;
+  slow_request.set_question("300");
+  late_request.set_question("0");
+  Hello::EchoResponse slow_response, late_response;
+  RpcController slow_controller, late_controller;
+  late_controller.set_timeout_ms(50);
+  sleep_stub.Echo1(&slow_controller, &slow_request, &slow_response, NULL);
+  sleep_stub.Echo1(&late_controller, &late_request, &late_response, NULL);
+  EXPECT_TRUE(late_controller.Wait(10000));
+  EXPECT_TRUE(late_controller.Failed());
+  EXPECT_EQ(late_controller.ErrorText(), "DeadlineExceeded");
+  EXPECT_TRUE(slow_controller.Wait(10000));
+  EXPECT_FALSE(slow_controller.Failed());
+  client_connection_->Disconnect();
+  pool.Stop();
+}
+
+// The server allocations per call once the pools are warm, counted from
+// one served call to the same point of the next. Besides the reading and
+// the dispatch, the response encoding and the write queue allocate about
+// five times per call.
+TEST_F(EchoTest, Allocations) {
+  QuietEchoServiceImpl quiet_service;
+  server_connection_->RegisterService(&quiet_service);
+  Hello::EchoService2::Stub stub(client_connection_.get());
+  Hello::EchoRequest request;
+  request.set_question("hello");
+  Hello::EchoResponse response;
+  const int calls = 2 * FLAGS_allocation_calls + 1;
+  for (int i = 0; i < calls; ++i) {
+    // Count from the served call allocation_calls until the last one.
+    quiet_service.counting_ = i >= FLAGS_allocation_calls && i < calls - 1;
+    RpcController controller;
+    stub.Echo1(&controller, &request, &response, NULL);
+    ASSERT_TRUE(controller.Wait(10000));
+    ASSERT_FALSE(controller.Failed()) << controller.ErrorText();
+  }
+  const double per_call = static_cast<double>(allocations) /
+    FLAGS_allocation_calls;
+  LOG(INFO) << "Server allocations per call: " << per_call;
+  EXPECT_LT(per_call, FLAGS_max_server_allocations);
+  // The calls in turn reuse one pooled context.
+  EXPECT_EQ(quiet_service.reused_, calls - 1);
+  client_connection_->Disconnect();
+}
+
+// The calls per second with many calls waiting for the responses.
+TEST_F(EchoTest, OutstandingCalls) {
+  const int n = FLAGS_outstanding_calls;
+  Hello::EchoRequest request;
+  request.set_question("outstanding");
+  boost::posix_time::ptime start =
+    boost::posix_time::microsec_clock::universal_time();
+  int succeeded = 0;
+  for (int k = 0; k < FLAGS_outstanding_rounds; ++k) {
+    vector<Hello::EchoResponse> response(n);
+    vector<boost::shared_ptr<RpcController> > controller(n);
+    for (int i = 0; i < n; ++i) {
+      controller[i].reset(new RpcController("Outstanding"));
+      stub_->Echo(controller[i].get(), &request, &response[i], NULL);
+    }
+    for (int i = 0; i < n; ++i) {
+      if (controller[i]->Wait(10000) && !controller[i]->Failed() &&
+          response[i].text() == request.question()) {
+        ++succeeded;
+      }
+    }
+  }
+  boost::posix_time::time_duration elapsed =
+    boost::posix_time::microsec_clock::universal_time() - start;
+  EXPECT_EQ(succeeded, n * FLAGS_outstanding_rounds);
+  LOG(WARNING) << "Backend: " << IOServicePool::backend()
+               << " outstanding: " << n
+               << " calls per second: "
+               << n * FLAGS_outstanding_rounds /
+                  (elapsed.total_microseconds() / 1000000.0);
+  client_connection_->Disconnect();
+}
+
+// Echo the calls on the connection, count the succeeded calls.
+static void EchoOn(Connection *connection, int calls, int *succeeded) {
+  Hello::EchoService::Stub stub(connection);
+  for (int i = 0; i < calls; ++i) {
+    Hello::EchoRequest request;
+    Hello::EchoResponse response;
+    request.set_question(boost::lexical_cast<string>(i));
+    RpcController controller;
+    stub.Echo(&controller, &request, &response, NULL);
+    if (controller.Wait(10000) && !controller.Failed() &&
+        response.text() == request.question()) {
+      ++*succeeded;
+    }
+  }
+}
+
+// The entries of the epoll sets of the process on a closed fd, left by a
+// socket still open under another fd.
+static int StaleEpollEntries() {
+  int stale = 0;
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == NULL) {
+    return 0;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const string fd_path = string("/proc/self/fd/") + entry->d_name;
+    char target[64];
+    const int n = readlink(fd_path.c_str(), target, sizeof(target) - 1);
+    if (n < 0 || string(target, n) != "anon_inode:[eventpoll]") {
+      continue;
+    }
+    std::ifstream fdinfo((string("/proc/self/fdinfo/") + entry->d_name).c_str());
+    string line;
+    while (std::getline(fdinfo, line)) {
+      // The fd may be reused by another file, compare the inode.
+      int fd;
+      unsigned long ino;
+      struct stat st;
+      if (sscanf(line.c_str(), "tfd: %d events: %*x data: %*x pos:%*d ino:%lx",
+                 &fd, &ino) == 2 &&
+          (fstat(fd, &st) < 0 || st.st_ino != ino)) {
+        ++stale;
+      }
+    }
+  }
+  closedir(dir);
+  return stale;
+}
+
+// The migrated socket leaves nothing behind in the old io_service, which
+// keeps serving the other connections.
+TEST_F(EchoTest, Migrate) {
+  boost::shared_ptr<IOServicePool> pool(new IOServicePool("Migrate", 2, 2));
+  boost::shared_ptr<ClientConnection> connection(new ClientConnection(
+      "EchoTestMigrateClient", FLAGS_server, FLAGS_port));
+  connection->set_io_service_pool(pool);
+  ASSERT_TRUE(connection->Connect());
+  const int from = connection->load() == &pool->load(0) ? 0 : 1;
+  EXPECT_EQ(pool->load(from).connections(), 1);
+  EXPECT_TRUE(connection->Migrate(&pool->get_io_service(1 - from)));
+  // The socket moves after the next response is read.
+  int succeeded = 0;
+  EchoOn(connection.get(), 10, &succeeded);
+  EXPECT_EQ(succeeded, 10);
+  EXPECT_EQ(connection->load(), &pool->load(1 - from));
+  EXPECT_EQ(pool->load(from).connections(), 0);
+  EXPECT_EQ(pool->load(1 - from).connections(), 1);
+  EXPECT_EQ(StaleEpollEntries(), 0);
+  // The next connections go to the old io_service, and reuse the reactor
+  // state of the migrated socket.
+  vector<boost::shared_ptr<ClientConnection> > others;
+  for (int i = 0; i < 2; ++i) {
+    others.push_back(boost::shared_ptr<ClientConnection>(new ClientConnection(
+        "EchoTestMigrateOther" + boost::lexical_cast<string>(i),
+        FLAGS_server, FLAGS_port)));
+    others.back()->set_io_service_pool(pool);
+    ASSERT_TRUE(others.back()->Connect());
+  }
+  EXPECT_EQ(others[0]->load(), &pool->load(from));
+  // The traffic on both io_services at the same time.
+  boost::thread_group threads;
+  vector<int> calls_succeeded(others.size() + 1, 0);
+  threads.create_thread(boost::bind(
+      EchoOn, connection.get(), 200, &calls_succeeded[0]));
+  for (size_t i = 0; i < others.size(); ++i) {
+    threads.create_thread(boost::bind(
+        EchoOn, others[i].get(), 200, &calls_succeeded[i + 1]));
+  }
+  threads.join_all();
+  for (size_t i = 0; i < calls_succeeded.size(); ++i) {
+    EXPECT_EQ(calls_succeeded[i], 200);
+  }
+  for (size_t i = 0; i < others.size(); ++i) {
+    others[i]->Disconnect();
+  }
+  connection->Disconnect();
+  pool->Stop();
+}
+
 int main(int argc, char **argv) {
   FLAGS_v = 4;
   FLAGS_logtostderr = true;
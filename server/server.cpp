@@ -34,39 +34,128 @@
 #include "glog/logging.h"
 #include "server/server.hpp"
 #include "server/protobuf_connection.hpp"
+#include "server/token_bucket.hpp"
+#include "base/time.hpp"
 #include <boost/bind.hpp>
-class AcceptorHandler {
+#include <map>
+typedef boost::asio::detail::socket_option::boolean<
+  SOL_SOCKET, SO_REUSEPORT> ReusePort;
+
+// Accept the connections on one listen socket. The handlers hold the
+// acceptor, it's deleted after the last one after the Release.
+class Acceptor : public boost::enable_shared_from_this<Acceptor> {
  public:
-  AcceptorHandler(boost::asio::ip::tcp::acceptor *acceptor,
-                  boost::asio::ip::tcp::socket **socket_pptr,
-                  const string host,
-                  Server *server,
-                  Connection *connection_template)
-    : acceptor_(acceptor), socket_pptr_(socket_pptr), host_(host), server_(server), connection_template_(connection_template) {
-  }
-  void operator()(const boost::system::error_code& e) {
-    if (!e) {
-      VLOG(2) << "HandleAccept " << host_;
-      boost::asio::ip::tcp::socket *socket = *socket_pptr_;
-      if (socket && socket->is_open()) {
-        VLOG(2) << "Socket is connected";
-        boost::asio::io_service &io_service = socket->get_io_service();
-        *socket_pptr_ = new boost::asio::ip::tcp::socket(io_service);
-        acceptor_->async_accept(**socket_pptr_, *this);
-        server_->HandleAccept(e, socket, connection_template_);
-      } else {
-        acceptor_->async_accept(**socket_pptr_, *this);
-      }
-    } else {
-      VLOG(1) << "HandleAccept error: " << e.message();
-      server_->ReleaseAcceptor(host_);
+  Acceptor(boost::asio::io_service *io_service,
+           const boost::asio::ip::tcp &protocol,
+           const string &name,
+           const AcceptPolicy &policy,
+           Server *server,
+           Connection *connection_template)
+    : acceptor_(*io_service), timer_(*io_service), protocol_(protocol),
+      name_(name),
+      policy_(policy), bucket_(policy.rate, policy.burst),
+      socket_(NULL), server_(server),
+      connection_template_(connection_template) {
+  }
+  ~Acceptor() {
+    delete socket_;
+  }
+  boost::asio::ip::tcp::acceptor *acceptor() {
+    return &acceptor_;
+  }
+  // Wait for the next connection.
+  void Accept() {
+    const int64 wait_us = bucket_.WaitUs(MonotonicUs());
+    if (wait_us > 0) {
+      VLOG(2) << name_ << " accept after " << wait_us << "us";
+      timer_.expires_from_now(boost::posix_time::microseconds(wait_us));
+      timer_.async_wait(boost::bind(
+          &Acceptor::HandleTimer, shared_from_this(), _1));
+      return;
+    }
+    if (socket_ == NULL) {
+      socket_ = NewSocket();
     }
+    acceptor_.async_accept(*socket_, boost::bind(
+        &Acceptor::HandleAccept, shared_from_this(), _1));
+  }
+  void Release() {
+    boost::system::error_code e;
+    timer_.cancel(e);
+    acceptor_.close(e);
   }
  private:
-  string host_;
-  // Have the ownership.
-  boost::asio::ip::tcp::acceptor *acceptor_;
-  boost::asio::ip::tcp::socket **socket_pptr_;
+  void HandleTimer(const boost::system::error_code &e) {
+    if (e || !acceptor_.is_open()) {
+      VLOG(2) << name_ << " accept timer: " << e.message();
+      return;
+    }
+    Accept();
+  }
+  void HandleAccept(const boost::system::error_code &e) {
+    if (e) {
+      VLOG(1) << "HandleAccept error: " << e.message();
+      server_->ReleaseAcceptor(name_);
+      return;
+    }
+    VLOG(2) << "HandleAccept " << name_;
+    boost::asio::ip::tcp::socket *socket = socket_;
+    socket_ = NULL;
+    if (socket->is_open()) {
+      bucket_.Take(MonotonicUs());
+      server_->HandleAccept(e, socket, connection_template_);
+    } else {
+      delete socket;
+    }
+    Drain();
+    Accept();
+  }
+  // Take the connections queued in the backlog without going back to the
+  // reactor, until the batch or the rate is used up.
+  void Drain() {
+    for (int i = 1; i < policy_.max_accepts; ++i) {
+      if (bucket_.WaitUs(MonotonicUs()) > 0) {
+        return;
+      }
+      const int fd = ::accept4(acceptor_.native(), NULL, NULL,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          LOG(WARNING) << name_ << " accept error: " << strerror(errno);
+        }
+        return;
+      }
+      boost::asio::ip::tcp::socket *socket = NewSocket();
+      boost::system::error_code e;
+      socket->assign(protocol_, fd, e);
+      if (e) {
+        LOG(WARNING) << name_ << " assign error: " << e.message();
+        ::close(fd);
+        delete socket;
+        continue;
+      }
+      bucket_.Take(MonotonicUs());
+      server_->HandleAccept(e, socket, connection_template_);
+    }
+  }
+  // The connection owns and deletes its socket.
+  // The SO_REUSEPORT acceptors keep the connections on their io_service,
+  // otherwise the connection goes to the least loaded one.
+  boost::asio::ip::tcp::socket *NewSocket() {
+    boost::asio::io_service *io_service = &acceptor_.get_io_service();
+    if (!server_->reuse_port_) {
+      io_service = &server_->io_service_pool_.get_least_loaded_io_service();
+    }
+    return new boost::asio::ip::tcp::socket(*io_service);
+  }
+  boost::asio::ip::tcp::acceptor acceptor_;
+  boost::asio::deadline_timer timer_;
+  boost::asio::ip::tcp protocol_;
+  string name_;
+  AcceptPolicy policy_;
+  TokenBucket bucket_;
+  // The socket of the pending accept.
+  boost::asio::ip::tcp::socket *socket_;
   // Haven't the ownership.
   Server *server_;
   Connection *connection_template_;
@@ -84,7 +173,10 @@ Server::Server(int io_service_number,
   : io_service_pool_("ServerIOService",
                      io_service_number, worker_threads),
     notifier_(new Notifier("ServerNotifier", 1)),
-    drain_timeout_(drain_timeout) {
+    connection_registry_(io_service_number),
+    accept_status_(new RawConnectionStatus),
+    drain_timeout_(drain_timeout),
+    reuse_port_(false) {
 }
 
 void Server::ReleaseAcceptor(const string &host) {
@@ -94,78 +186,152 @@ void Server::ReleaseAcceptor(const string &host) {
     VLOG(2) << "Can't find " << host;
     return;
   }
-  it->second.Release();
+  it->second->Release();
+  acceptor_table_.erase(it);
 }
 
 void Server::Listen(const string &address,
                     const string &port,
                     Connection* connection_template) {
-  // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
   VLOG(2) << "Server running";
   io_service_pool_.Start();
   timer_master_.Start();
+  if (rebalance_policy_.interval_sec > 0 && load_balancer_.get() == NULL) {
+    load_balancer_.reset(new LoadBalancer(rebalance_policy_.high_gap,
+                                          rebalance_policy_.low_gap));
+    timer_master_.Register(shared_from_this());
+  }
   const string host(address + "::" + port);
-  boost::asio::ip::tcp::acceptor *acceptor = new boost::asio::ip::tcp::acceptor(io_service_pool_.get_io_service());
-  boost::asio::ip::tcp::resolver resolver(acceptor->get_io_service());
+  boost::asio::ip::tcp::resolver resolver(io_service_pool_.get_io_service(0));
   boost::asio::ip::tcp::resolver::query query(address, port);
   boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
+  if (!reuse_port_) {
+    Accept(endpoint, &io_service_pool_.get_io_service(), host,
+           connection_template);
+    return;
+  }
+  for (int i = 0; i < io_service_pool_.size(); ++i) {
+    Accept(endpoint, &io_service_pool_.get_io_service(i),
+           host + "#" + boost::lexical_cast<string>(i), connection_template);
+  }
+}
+
+void Server::Accept(const boost::asio::ip::tcp::endpoint &endpoint,
+                    boost::asio::io_service *io_service,
+                    const string &name,
+                    Connection *connection_template) {
+  // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
+  // The accepted sockets stay on the io_service of the acceptor.
+  boost::shared_ptr<Acceptor> acceptor_holder(new Acceptor(
+      io_service, endpoint.protocol(), name, accept_policy_, this,
+      connection_template));
+  boost::asio::ip::tcp::acceptor *acceptor = acceptor_holder->acceptor();
   acceptor->open(endpoint.protocol());
   acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+  if (reuse_port_) {
+    acceptor->set_option(ReusePort(true));
+  }
+  // The accepted sockets inherit the buffer sizes.
+  connection_template->socket_profile().ApplyBuffers(acceptor);
   acceptor->bind(endpoint);
   acceptor->listen();
-  boost::asio::ip::tcp::socket **socket_pptr = new (boost::asio::ip::tcp::socket*);
-  *socket_pptr = new boost::asio::ip::tcp::socket(io_service_pool_.get_io_service());
+  // The backlog is drained by the accept4 until it would block.
+  boost::asio::ip::tcp::acceptor::non_blocking_io non_blocking_io(true);
+  acceptor->io_control(non_blocking_io);
   {
     boost::mutex::scoped_lock locker(acceptor_table_mutex_);
-    acceptor_table_.insert(make_pair(host, AcceptorResource(acceptor, socket_pptr)));
+    acceptor_table_.insert(make_pair(name, acceptor_holder));
   }
-  acceptor->async_accept(**socket_pptr, AcceptorHandler(acceptor, socket_pptr, host, this, connection_template));
+  VLOG(1) << "Listen on " << name;
+  acceptor_holder->Accept();
 }
 
 void Server::Stop() {
   VLOG(2) << "Server stop";
-  stop_mutex_.lock();
+  boost::mutex::scoped_lock stop_locker(stop_mutex_);
   if (!io_service_pool_.IsRunning()) {
     VLOG(2) << "Server already stopped";
-    stop_mutex_.unlock();
     return;
   }
-  {
-    boost::mutex::scoped_lock locker(channel_table_mutex_);
-    for (ChannelTable::iterator it = channel_table_.begin();
-         it != channel_table_.end(); ++it) {
-      VLOG(2) << "Close: " << (*it)->name();
-      (*it)->Disconnect();
-      notifier_->Dec(1);
-    }
+  // No connection is inserted after the accepts in flight leave.
+  accept_status_->Close();
+  accept_status_->WaitIdle();
+  vector<boost::shared_ptr<Connection> > connections;
+  connection_registry_.Clear(&connections);
+  for (size_t i = 0; i < connections.size(); ++i) {
+    VLOG(2) << "Close: " << connections[i]->name();
+    connections[i]->Disconnect();
     notifier_->Dec(1);
-    channel_table_.clear();
   }
+  notifier_->Dec(1);
   // All channel had been flushed.
   notifier_->Wait();
   {
     boost::mutex::scoped_lock locker(acceptor_table_mutex_);
     for (AcceptorTable::iterator it = acceptor_table_.begin(); it != acceptor_table_.end(); ++it) {
       VLOG(2) << "Delete acceptor on " << it->first;
-      it->second.Release();
+      it->second->Release();
     }
     acceptor_table_.clear();
   }
+  // The Rebalance on the timer thread uses the io_services.
+  timer_master_.Stop();
   LOG(WARNING) << "Stop io service pool";
   io_service_pool_.Stop();
-  stop_mutex_.unlock();
-  timer_master_.Stop();
+  // No handler runs after the io_service pool stops.
+  accept_status_.reset(new RawConnectionStatus);
   LOG(WARNING) << "Server stopped";
-  CHECK(channel_table_.empty());
+  CHECK_EQ(connection_registry_.size(), 0);
+}
+
+void Server::Rebalance() {
+  vector<double> scores(io_service_pool_.size());
+  for (size_t i = 0; i < scores.size(); ++i) {
+    scores[i] = io_service_pool_.load(i).score();
+  }
+  int hot = -1, cold = -1;
+  const bool move = load_balancer_->Check(scores, &hot, &cold);
+  vector<boost::shared_ptr<Connection> > connections;
+  connection_registry_.Get(&connections);
+  const int64 now_ms = MonotonicMs();
+  IOServiceLoad *hot_load = move ? &io_service_pool_.load(hot) : NULL;
+  TrafficTable traffic_table;
+  Connection *hottest = NULL;
+  int64 hottest_bytes = 0;
+  int hot_connections = 0;
+  for (size_t i = 0; i < connections.size(); ++i) {
+    Connection *connection = connections[i].get();
+    const Traffic last = traffic_table_[connection];
+    Traffic &traffic = traffic_table[connection];
+    traffic.bytes = connection->receive_stats().bytes +
+      connection->send_stats().bytes;
+    traffic.moved_ms = last.moved_ms;
+    if (hot_load == NULL || connection->load() != hot_load) {
+      continue;
+    }
+    ++hot_connections;
+    if (now_ms - traffic.moved_ms < rebalance_policy_.cooldown_sec * 1000) {
+      continue;
+    }
+    if (traffic.bytes - last.bytes > hottest_bytes) {
+      hottest = connection;
+      hottest_bytes = traffic.bytes - last.bytes;
+    }
+  }
+  // Moving the only connection just moves the heat.
+  if (hottest != NULL && hot_connections > 1) {
+    VLOG(1) << "Rebalance " << hottest->name() << " from io_service " << hot
+            << " score: " << scores[hot] << " to io_service " << cold
+            << " score: " << scores[cold];
+    hottest->Migrate(&io_service_pool_.get_io_service(cold));
+    traffic_table[hottest].moved_ms = now_ms;
+  }
+  traffic_table_.swap(traffic_table);
 }
 
 void Server::ConnectionClosed(Connection *connection) {
-  boost::mutex::scoped_lock locker(channel_table_mutex_);
-  int size1 = channel_table_.size();
-  boost::shared_ptr<Connection> conn = connection->shared_from_this();
-  VLOG(2) << "ConnectionClosed: " << conn.get();
-  if (channel_table_.find(conn) != channel_table_.end()) {
-    channel_table_.erase(conn);
+  VLOG(2) << "ConnectionClosed: " << connection;
+  if (connection_registry_.Remove(connection)) {
     notifier_->Dec(1);
     VLOG(1) << "Remove connection:" << connection->name();
   }  else {
@@ -173,37 +339,39 @@ void Server::ConnectionClosed(Connection *connection) {
   }
 }
 
-void Server::HandleAccept(const boost::system::error_code& e,
+void Server::HandleAccept(const boost::system::error_code& /* e */,
                           boost::asio::ip::tcp::socket *socket,
                           Connection *connection_template) {
   VLOG(2) << "HandleAccept";
-  stop_mutex_.lock_shared();
-  if (!io_service_pool_.IsRunning()) {
+  RawConnectionStatus *accept_status = accept_status_.get();
+  if (!accept_status->TryEnter()) {
     delete socket;
-    stop_mutex_.unlock_shared();
     VLOG(2) << "HandleAccept but already stopped.";
     return;
   }
+  const int shard = io_service_pool_.index(socket->get_io_service());
   // The socket ownership transfer to Connection.
   boost::shared_ptr<Connection> connection = connection_template->Span(
       socket);
   if (connection.get() == NULL) {
     LOG(WARNING) << "Span a NULL connection!";
+    accept_status->Leave();
     return;
   }
-  {
-    boost::mutex::scoped_lock locker(channel_table_mutex_);
-    boost::shared_ptr<Server> s = this->shared_from_this();
-    if (!connection->RegisterAsyncCloseListener(s)) {
-      LOG(WARNING) << "RegisterAsyncCloseListener failed";
-      connection->Disconnect();
-      return;
+  // Inserted before the listener, so the ConnectionClosed always finds it.
+  notifier_->Inc(1);
+  connection_registry_.Insert(std::max(shard, 0), connection);
+  boost::shared_ptr<Server> s = this->shared_from_this();
+  if (!connection->RegisterAsyncCloseListener(s)) {
+    // Closed before the listener is registered.
+    VLOG(1) << "RegisterAsyncCloseListener failed: " << connection->name();
+    if (connection_registry_.Remove(connection.get())) {
+      notifier_->Dec(1);
     }
-    channel_table_.insert(connection);
-    timer_master_.Register(connection);
-    VLOG(2) << "Insert: " << connection.get();
-    notifier_->Inc(1);
+    accept_status->Leave();
+    return;
   }
+  accept_status->Leave();
+  timer_master_.Register(connection);
   VLOG(2) << "Insert " << connection->name();
-  stop_mutex_.unlock_shared();
 }
@@ -42,14 +42,41 @@
 #include <boost/shared_ptr.hpp>
 #include "server/io_service_pool.hpp"
 #include "server/connection.hpp"
+#include "server/connection_registry.hpp"
 #include "thread/notifier.hpp"
 #include "server/timer_master.hpp"
 class Connection;
 
-class AcceptorHandler;
+class Acceptor;
+// How the acceptor takes the connections off the listen backlog.
+struct AcceptPolicy {
+  AcceptPolicy() : max_accepts(16), rate(0), burst(16) {
+  }
+  // The connections accepted in one wakeup of the acceptor.
+  int max_accepts;
+  // The accepts per second, 0 for no limit. The backlog holds the
+  // connections over the rate.
+  int rate;
+  int burst;
+};
+// When the server moves the hot connections off the busy io_services.
+struct RebalancePolicy {
+  RebalancePolicy()
+    : interval_sec(0), high_gap(0.5), low_gap(0.2), cooldown_sec(30) {
+  }
+  // Check the loads every interval, 0 to never move the connections.
+  int interval_sec;
+  // The gap of the IOServiceLoad::score() between the busiest and the
+  // idlest io_service to start moving, and to stop.
+  double high_gap;
+  double low_gap;
+  // A moved connection stays at least it.
+  int cooldown_sec;
+};
 // The top-level class of the Server.
 class Server
-  : private boost::noncopyable, public boost::enable_shared_from_this<Server>, public Connection::AsyncCloseListener {
+  : private boost::noncopyable, public boost::enable_shared_from_this<Server>, public Connection::AsyncCloseListener,
+    public Timer {
 private:
   static const int kDefaultDrainTimeout = LONG_MAX;
 public:
@@ -63,29 +90,73 @@ public:
   void Listen(const string &address, const string &port,
               Connection* connection_template);
 
+  /// Listen by one SO_REUSEPORT acceptor per io_service, the kernel spreads
+  /// the accepts and the connections stay on the io_service accepted them.
+  /// Set before the Listen.
+  void set_reuse_port(bool reuse_port) {
+    reuse_port_ = reuse_port;
+  }
+
+  /// Pin the io_service threads to the cpus, set before the Listen.
+  void set_cpus(const vector<int> &cpus) {
+    io_service_pool_.set_cpus(cpus);
+  }
+
+  /// Set before the Listen.
+  void set_accept_policy(const AcceptPolicy &accept_policy) {
+    accept_policy_ = accept_policy;
+  }
+
+  /// Move the hot connections to balance the io_services, set before the
+  /// Listen.
+  void set_rebalance_policy(const RebalancePolicy &rebalance_policy) {
+    rebalance_policy_ = rebalance_policy;
+  }
+
+  /// Move one connection from the busiest io_service to the idlest if
+  /// they are out of balance, run by the timer.
+  void Rebalance();
+
+  /// The number of the connections accepted and not closed.
+  int connection_size() {
+    return connection_registry_.size();
+  }
+
+  /// The io_services of the connections, to query their loads.
+  IOServicePool *io_service_pool() {
+    return &io_service_pool_;
+  }
+
   /// Stop the Server.
   void Stop();
 private:
-  struct AcceptorResource {
-    boost::asio::ip::tcp::acceptor *acceptor;
-    boost::asio::ip::tcp::socket **socket_pptr;
-    AcceptorResource(boost::asio::ip::tcp::acceptor *in_acceptor,
-                     boost::asio::ip::tcp::socket **in_socket_pptr)
-      : acceptor(in_acceptor), socket_pptr(in_socket_pptr) {
-    }
-    void Release() {
-      acceptor->close();
-      delete acceptor;
-      (*socket_pptr)->close();
-      delete *socket_pptr;
-      delete socket_pptr;
-    }
-  };
-  typedef hash_map<string, AcceptorResource> AcceptorTable;
+  typedef hash_map<string, boost::shared_ptr<Acceptor> > AcceptorTable;
   void ReleaseAcceptor(const string &host);
+  // Open the acceptor on the io_service, registered as the name.
+  void Accept(const boost::asio::ip::tcp::endpoint &endpoint,
+              boost::asio::io_service *io_service,
+              const string &name,
+              Connection *connection_template);
 
   void ConnectionClosed(Connection *);
-  typedef hash_set<boost::shared_ptr<Connection> > ChannelTable;
+  // The rebalance timer.
+  bool period() const {
+    return io_service_pool_.IsRunning();
+  }
+  int timeout() const {
+    return rebalance_policy_.interval_sec;
+  }
+  void Expired() {
+    Rebalance();
+  }
+  // The bytes of the connection at the last rebalance, and when it moved.
+  struct Traffic {
+    Traffic() : bytes(0), moved_ms(0) {
+    }
+    int64 bytes;
+    int64 moved_ms;
+  };
+  typedef hash_map<Connection *, Traffic> TrafficTable;
   // Handle completion of an asynchronous accept operation.
   void HandleAccept(const boost::system::error_code& e,
                     boost::asio::ip::tcp::socket *socket,
@@ -93,15 +164,23 @@ private:
   // The pool of io_service objects used to perform asynchronous operations.
   IOServicePool io_service_pool_;
   TimerMaster timer_master_;
-  friend class AcceptorHandler;
+  friend class Acceptor;
   boost::shared_ptr<Notifier> notifier_;
-  ChannelTable channel_table_;
-  boost::mutex channel_table_mutex_;
+  // Sharded by the io_service of the connection.
+  ConnectionRegistry connection_registry_;
 
   AcceptorTable acceptor_table_;
   boost::mutex acceptor_table_mutex_;
 
-  boost::shared_mutex stop_mutex_;
+  boost::mutex stop_mutex_;
+  // The accepts in flight, the Stop closes it and waits them out.
+  boost::intrusive_ptr<RawConnectionStatus> accept_status_;
   int drain_timeout_;
+  bool reuse_port_;
+  AcceptPolicy accept_policy_;
+  RebalancePolicy rebalance_policy_;
+  scoped_ptr<LoadBalancer> load_balancer_;
+  // Only touched by the timer thread.
+  TrafficTable traffic_table_;
 };
 #endif // NET2_SERVER_HPP
@@ -35,71 +35,287 @@
 #define SHARED_CONST_BUFFERS_HPP_
 #include "base/base.hpp"
 #include <boost/asio.hpp>
+#include <boost/intrusive_ptr.hpp>
+// An opened file shared by the file regions, closed with the last one.
+class SharedFile : public boost::noncopyable {
+ public:
+  static boost::shared_ptr<SharedFile> Open(const string &filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      LOG(WARNING) << "Fail to open file " << filename
+                   << " error: " << strerror(errno);
+      return boost::shared_ptr<SharedFile>();
+    }
+    return boost::shared_ptr<SharedFile>(new SharedFile(fd));
+  }
+  ~SharedFile() {
+    ::close(fd_);
+  }
+  int fd() const {
+    return fd_;
+  }
+ private:
+  explicit SharedFile(int fd) : fd_(fd) {
+  }
+  int fd_;
+};
+
+// A region of the file, written to the socket by sendfile without copying
+// it to the user space.
+struct FileRegion {
+  FileRegion() : offset(0), length(0) {
+  }
+  FileRegion(const boost::shared_ptr<SharedFile> &f, int64 o, int l)
+    : file(f), offset(o), length(l) {
+  }
+  boost::shared_ptr<SharedFile> file;
+  int64 offset;
+  int length;
+};
+
+// An immutable block pushed onto the outbound queues of many connections
+// at once, released when the last connection has written it.
+class SharedBlock : public boost::noncopyable {
+ public:
+  // Take the content of the data.
+  static boost::intrusive_ptr<SharedBlock> Create(string *data) {
+    SharedBlock *block = new SharedBlock;
+    block->data_.swap(*data);
+    return boost::intrusive_ptr<SharedBlock>(block);
+  }
+  const string &data() const {
+    return data_;
+  }
+  int refs() const {
+    return intrusive_count_;
+  }
+ private:
+  SharedBlock() : intrusive_count_(0) {
+  }
+  string data_;
+  volatile int intrusive_count_;
+  template <class T> friend void intrusive_ptr_add_ref(T *t);
+  template <class T> friend void intrusive_ptr_release(T *t);
+};
+typedef boost::intrusive_ptr<SharedBlock> SharedBlockPtr;
+
 class SharedConstBuffers {
  private:
   struct Store {
     vector<const string *> data;
+    vector<SharedBlock *> blocks;
     ~Store() {
-      for (int i = 0; i < data.size(); ++i) {
+      Clear();
+    }
+    // Keep the capacity of the vectors.
+    void Clear() {
+      for (size_t i = 0; i < data.size(); ++i) {
         VLOG(2) << "SharedConstBuffers Store delete: " << data[i];
         delete data[i];
       }
       data.clear();
+      for (size_t i = 0; i < blocks.size(); ++i) {
+        intrusive_ptr_release(blocks[i]);
+      }
+      blocks.clear();
     }
   };
  public:
-  // Implement the ConstBufferSequence requirements.
+  // The buffers of one outbound frame, pushed together so the frames of
+  // the different producers don't interleave. The file region is sent
+  // after the buffers.
+  struct Frame {
+    static const int kMaxBuffers = 4;
+    Frame() : size(0) {
+    }
+    void push(const string *d, int offset = 0) {
+      CHECK_LT(size, kMaxBuffers);
+      CHECK(file.file.get() == NULL);
+      data[size] = d;
+      offsets[size] = offset;
+      blocks[size] = NULL;
+      ++size;
+    }
+    // Hold a reference of the block until it's written.
+    void push(const SharedBlockPtr &block, int offset = 0) {
+      push(&block->data(), offset);
+      blocks[size - 1] = block.get();
+      intrusive_ptr_add_ref(block.get());
+    }
+    void push(const FileRegion &region) {
+      CHECK(file.file.get() == NULL);
+      file = region;
+    }
+    int bytes() const {
+      int n = file.length;
+      for (int i = 0; i < size; ++i) {
+        n += data[i]->size() - offsets[i];
+      }
+      return n;
+    }
+    const string *data[kMaxBuffers];
+    int offsets[kMaxBuffers];
+    // The block of the data, NULL if the data is owned by the frame.
+    SharedBlock *blocks[kMaxBuffers];
+    int size;
+    FileRegion file;
+  };
+  // Implement the ConstBufferSequence requirements, the sequence ends
+  // before the next file region.
   typedef boost::asio::const_buffer value_type;
   typedef vector<boost::asio::const_buffer>::const_iterator const_iterator;
   const const_iterator begin() const {
     return buffer_.begin() + start_;
   }
   const const_iterator end() const {
-    return buffer_.end();
+    return buffer_.begin() + file_end_;
   }
-  SharedConstBuffers() : start_(0), store_(new Store) {
+  // The asio writes at most 64 buffers in one call, and no more than the
+  // IOV_MAX.
+  static const int kMaxBatchBuffers = 64 < IOV_MAX ? 64 : IOV_MAX;
+  // A ConstBufferSequence of the front buffers to write, at most
+  // kMaxBatchBuffers. The asio copies the batch instead of the whole
+  // sequence, it's valid until the next push or clear.
+  class Batch {
+   public:
+    typedef boost::asio::const_buffer value_type;
+    typedef SharedConstBuffers::const_iterator const_iterator;
+    Batch(const_iterator begin, const_iterator end)
+      : begin_(begin), end_(end) {
+    }
+    const_iterator begin() const {
+      return begin_;
+    }
+    const_iterator end() const {
+      return end_;
+    }
+   private:
+    const_iterator begin_, end_;
+  };
+  Batch batch() const {
+    return Batch(begin(), buffer_.begin() +
+                 std::min(file_end_, start_ + kMaxBatchBuffers));
+  }
+  SharedConstBuffers() : store_(new Store), start_(0), file_end_(0),
+    size_(0) {
   }
-  void push(const string *data) {
-    VLOG(2) << "SharedConstBuffers push: " << data;
+  // Push the data from the offset, take the ownership of the data.
+  void push(const string *data, int offset = 0) {
+    VLOG(2) << "SharedConstBuffers push: " << data << " offset: " << offset;
     store_->data.push_back(data);
-    buffer_.push_back(boost::asio::const_buffer(data->c_str(), data->size()));
+    PushBuffer(data, offset);
+  }
+  // Push the block from the offset, hold a reference of it.
+  void push(const SharedBlockPtr &block, int offset = 0) {
+    intrusive_ptr_add_ref(block.get());
+    store_->blocks.push_back(block.get());
+    PushBuffer(&block->data(), offset);
+  }
+  // The empty region is skipped, the sendfile can't tell it from the end
+  // of the file.
+  void push(const FileRegion &region) {
+    VLOG(2) << "SharedConstBuffers push file: " << region.file->fd()
+            << " offset: " << region.offset << " length: " << region.length;
+    if (region.length == 0) {
+      return;
+    }
+    buffer_.push_back(boost::asio::const_buffer(
+        static_cast<const char *>(NULL), region.length));
+    files_.push_back(region);
+    size_ += region.length;
+  }
+  // Take the ownership of the data and the block references of the frame.
+  void push(const Frame &frame) {
+    for (int i = 0; i < frame.size; ++i) {
+      if (frame.blocks[i] != NULL) {
+        store_->blocks.push_back(frame.blocks[i]);
+        PushBuffer(frame.data[i], frame.offsets[i]);
+      } else {
+        push(frame.data[i], frame.offsets[i]);
+      }
+    }
+    if (frame.file.file.get()) {
+      push(frame.file);
+    }
+  }
+  // The file region in the front, NULL if the front is in the memory.
+  const FileRegion *file() const {
+    if (start_ == static_cast<int>(buffer_.size()) || file_end_ != start_) {
+      return NULL;
+    }
+    return &files_[start_];
   }
   void clear() {
     VLOG(2) << "Clear SharedConstBuffers";
     buffer_.clear();
-    store_.reset(new Store);
+    files_.clear();
+    // Reuse the store unless a copy of the buffers still holds it.
+    if (store_.unique()) {
+      store_->Clear();
+    } else {
+      store_.reset(new Store);
+    }
     start_ = 0;
+    file_end_ = 0;
+    size_ = 0;
   }
   bool empty() const {
-    return (start_ == buffer_.size());
+    return (start_ == static_cast<int>(buffer_.size()));
   }
   int size() const {
-    int s = 0;
-    for (int i = start_; i < buffer_.size(); ++i) {
-      const int bsize = boost::asio::buffer_size(buffer_[i]);
-      s += bsize;
-    }
-    return s;
+    return size_;
   }
+  // Consume the bytes in the front, only walks the buffers consumed.
   void consume(int size) {
-    for (int i = start_; i < buffer_.size(); ++i) {
+    size_ -= std::min(size, size_);
+    int i = start_;
+    for (; i < static_cast<int>(buffer_.size()); ++i) {
       const int bsize = boost::asio::buffer_size(buffer_[i]);
       if (size > bsize) {
         size -= bsize;
       } else if (size == bsize) {
-        start_ = i + 1;
-        return;
+        ++i;
+        break;
       } else {
-        buffer_[i] = buffer_[i] + size;
-        start_ = i;
-        return;
+        if (files_[i].file.get()) {
+          files_[i].offset += size;
+          files_[i].length -= size;
+          buffer_[i] = boost::asio::const_buffer(
+              static_cast<const char *>(NULL), files_[i].length);
+        } else {
+          buffer_[i] = buffer_[i] + size;
+        }
+        break;
+      }
+    }
+    start_ = i;
+    if (file_end_ < start_) {
+      file_end_ = start_;
+      while (file_end_ < static_cast<int>(files_.size()) &&
+             files_[file_end_].file.get() == NULL) {
+        ++file_end_;
       }
     }
-    start_ = buffer_.size();
   }
  private:
+  void PushBuffer(const string *data, int offset) {
+    if (file_end_ == static_cast<int>(buffer_.size())) {
+      ++file_end_;
+    }
+    buffer_.push_back(boost::asio::const_buffer(data->c_str() + offset,
+                                                data->size() - offset));
+    files_.push_back(FileRegion());
+    size_ += data->size() - offset;
+  }
   vector<boost::asio::const_buffer> buffer_;
+  // The file regions at the same index of the buffer_, the buffer is a
+  // placeholder of the length.
+  vector<FileRegion> files_;
   boost::shared_ptr<Store> store_;
   int start_;
+  // The first file region from the start_, or the end of the buffer_.
+  int file_end_;
+  // The bytes from the start_.
+  int size_;
 };
 #endif // SHARED_CONST_BUFFERS_HPP_
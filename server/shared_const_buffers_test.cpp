@@ -35,6 +35,9 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include "server/shared_const_buffers.hpp"
+#include <sys/uio.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+DEFINE_int32(frames, 10000, "The frames queued in the benchmark");
 class SharedConstBuffersTest : public testing::Test {
  public:
  protected:
@@ -47,6 +50,41 @@ class SharedConstBuffersTest : public testing::Test {
     return ret;
   }
   static const int kPoolSize = 100;
+  // Write the frames queued to the /dev/null in the batches, return the
+  // nanoseconds per frame.
+  static double WriteFrames(int frames, int *writes) {
+    SharedConstBuffers p;
+    for (int i = 0; i < frames; ++i) {
+      SharedConstBuffers::Frame frame;
+      frame.push(new string(16, 'h'));
+      frame.push(new string(48, 'p'));
+      p.push(frame);
+    }
+    const int fd = open("/dev/null", O_WRONLY);
+    CHECK_GE(fd, 0);
+    boost::posix_time::ptime start =
+      boost::posix_time::microsec_clock::universal_time();
+    *writes = 0;
+    while (!p.empty()) {
+      struct iovec iov[SharedConstBuffers::kMaxBatchBuffers];
+      int n = 0;
+      SharedConstBuffers::Batch batch = p.batch();
+      for (SharedConstBuffers::const_iterator it = batch.begin();
+           it != batch.end(); ++it, ++n) {
+        iov[n].iov_base = const_cast<char *>(
+            boost::asio::buffer_cast<const char *>(*it));
+        iov[n].iov_len = boost::asio::buffer_size(*it);
+      }
+      const int written = writev(fd, iov, n);
+      CHECK_GT(written, 0);
+      p.consume(written);
+      ++*writes;
+    }
+    boost::posix_time::time_duration elapsed =
+      boost::posix_time::microsec_clock::universal_time() - start;
+    close(fd);
+    return elapsed.total_microseconds() * 1000.0 / frames;
+  }
 };
 
 TEST_F(SharedConstBuffersTest, Test1) {
@@ -72,6 +110,110 @@ TEST_F(SharedConstBuffersTest, Test1) {
   EXPECT_EQ(GetP(p1), "helloworld");
 }
 
+TEST_F(SharedConstBuffersTest, FileRegion) {
+  char filename[] = "/tmp/shared_const_buffers_testXXXXXX";
+  const int fd = mkstemp(filename);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  boost::shared_ptr<SharedFile> file = SharedFile::Open(filename);
+  unlink(filename);
+  ASSERT_TRUE(file.get() != NULL);
+  SharedConstBuffers::Frame frame;
+  frame.push(new string("head"));
+  frame.push(FileRegion(file, 10, 100));
+  EXPECT_EQ(frame.bytes(), 104);
+  SharedConstBuffers p;
+  p.push(frame);
+  p.push(new string("tail"));
+  EXPECT_EQ(p.size(), 108);
+  // The memory buffers end before the file region.
+  EXPECT_TRUE(p.file() == NULL);
+  EXPECT_EQ(GetP(p), "head");
+  p.consume(4);
+  ASSERT_TRUE(p.file() != NULL);
+  EXPECT_TRUE(p.begin() == p.end());
+  p.consume(60);
+  ASSERT_TRUE(p.file() != NULL);
+  EXPECT_EQ(p.file()->offset, 70);
+  EXPECT_EQ(p.file()->length, 40);
+  p.consume(42);
+  EXPECT_TRUE(p.file() == NULL);
+  EXPECT_EQ(GetP(p), "il");
+  p.consume(2);
+  EXPECT_TRUE(p.empty());
+}
+
+TEST_F(SharedConstBuffersTest, EmptyFileRegion) {
+  char filename[] = "/tmp/shared_const_buffers_testXXXXXX";
+  const int fd = mkstemp(filename);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  boost::shared_ptr<SharedFile> file = SharedFile::Open(filename);
+  unlink(filename);
+  ASSERT_TRUE(file.get() != NULL);
+  SharedConstBuffers::Frame frame;
+  frame.push(new string("head"));
+  frame.push(FileRegion(file, 10, 0));
+  EXPECT_EQ(frame.bytes(), 4);
+  SharedConstBuffers p;
+  p.push(frame);
+  p.push(new string("tail"));
+  EXPECT_EQ(p.size(), 8);
+  // Never left in the front for the sendfile.
+  EXPECT_TRUE(p.file() == NULL);
+  EXPECT_EQ(GetP(p), "headtail");
+  p.consume(8);
+  EXPECT_TRUE(p.file() == NULL);
+  EXPECT_TRUE(p.empty());
+}
+
+TEST_F(SharedConstBuffersTest, SharedBlock) {
+  string data("hello");
+  SharedBlockPtr block = SharedBlock::Create(&data);
+  EXPECT_EQ(block->data(), "hello");
+  SharedConstBuffers p1, p2;
+  p1.push(block);
+  SharedConstBuffers::Frame frame;
+  frame.push(block, 1);
+  p2.push(frame);
+  EXPECT_EQ(block->refs(), 3);
+  EXPECT_EQ(GetP(p1), "hello");
+  EXPECT_EQ(GetP(p2), "ello");
+  p1.clear();
+  EXPECT_EQ(block->refs(), 2);
+  p2.consume(4);
+  p2.clear();
+  EXPECT_EQ(block->refs(), 1);
+}
+
+TEST_F(SharedConstBuffersTest, Batch) {
+  const int kMax = SharedConstBuffers::kMaxBatchBuffers;
+  SharedConstBuffers p;
+  for (int i = 0; i < kMax * 2; ++i) {
+    p.push(new string("x"));
+  }
+  EXPECT_EQ(p.size(), kMax * 2);
+  SharedConstBuffers::Batch batch = p.batch();
+  EXPECT_EQ(batch.end() - batch.begin(), kMax);
+  p.consume(kMax + 1);
+  EXPECT_EQ(p.size(), kMax - 1);
+  batch = p.batch();
+  EXPECT_EQ(batch.end() - batch.begin(), kMax - 1);
+}
+
+// The cost per frame stays flat with the deep queue.
+TEST_F(SharedConstBuffersTest, Benchmark) {
+  for (int frames = FLAGS_frames / 10; frames <= FLAGS_frames * 10;
+       frames *= 10) {
+    int writes = 0;
+    const double ns = WriteFrames(frames, &writes);
+    LOG(INFO) << "Frames: " << frames << " writes: " << writes
+              << " " << ns << " ns/frame";
+    const int kMax = SharedConstBuffers::kMaxBatchBuffers;
+    EXPECT_EQ(writes, (frames * 2 + kMax - 1) / kMax);
+  }
+}
+
 int main(int argc, char **argv) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#ifndef SOCKET_PROFILE_HPP_
+#define SOCKET_PROFILE_HPP_
+#include "base/base.hpp"
+#include <boost/asio.hpp>
+#include <glog/logging.h>
+#include <netinet/tcp.h>
+// The TCP_INFO of a socket, implement the GettableSocketOption requirements.
+class TcpInfo {
+ public:
+  TcpInfo() {
+    memset(&info_, 0, sizeof(info_));
+  }
+  template <typename Protocol>
+  int level(const Protocol &) const {
+    return IPPROTO_TCP;
+  }
+  template <typename Protocol>
+  int name(const Protocol &) const {
+    return TCP_INFO;
+  }
+  template <typename Protocol>
+  struct tcp_info *data(const Protocol &) {
+    return &info_;
+  }
+  template <typename Protocol>
+  const struct tcp_info *data(const Protocol &) const {
+    return &info_;
+  }
+  template <typename Protocol>
+  size_t size(const Protocol &) const {
+    return sizeof(info_);
+  }
+  template <typename Protocol>
+  void resize(const Protocol &, size_t /* s */) {
+  }
+  const struct tcp_info &info() const {
+    return info_;
+  }
+ private:
+  struct tcp_info info_;
+};
+
+// The socket options of the connections, set on the connection template
+// passed to Server::Listen or on a ClientConnection before Connect.
+struct SocketProfile {
+  // Grow the buffers after so many bytes transferred when auto tune.
+  static const int kAutoTuneBytes = 1024 * 1024;
+  typedef boost::asio::detail::socket_option::boolean<
+    IPPROTO_TCP, TCP_QUICKACK> QuickAck;
+  typedef boost::asio::detail::socket_option::integer<
+    IPPROTO_TCP, TCP_USER_TIMEOUT> UserTimeout;
+#ifdef SO_BUSY_POLL
+  typedef boost::asio::detail::socket_option::integer<
+    SOL_SOCKET, SO_BUSY_POLL> BusyPoll;
+#endif
+  SocketProfile()
+    : send_buffer_size(0), receive_buffer_size(0), no_delay(true),
+      quick_ack(false), user_timeout_ms(0), busy_poll_us(0),
+      keep_alive(true), auto_tune(false), link_bandwidth(0),
+      max_buffer_size(16 * 1024 * 1024) {
+  }
+  // For the slices. The kernel tunes the buffers unless they're set, the
+  // buffers set by the caller grow to the bandwidth delay product.
+  static SocketProfile Bulk() {
+    SocketProfile profile;
+    profile.auto_tune = true;
+    return profile;
+  }
+  // Small rpcs, ack and poll at once.
+  static SocketProfile Latency() {
+    SocketProfile profile;
+    profile.quick_ack = true;
+    profile.busy_poll_us = 50;
+    return profile;
+  }
+  // The buffer sizes must be set before connect or listen to get the
+  // window scale, the accepted sockets inherit them from the acceptor.
+  // Setting them turns off the kernel auto tuning, so only the sizes set
+  // by the caller are applied.
+  template <typename Socket>
+  void ApplyBuffers(Socket *socket) const {
+    boost::system::error_code ec;
+    if (send_buffer_size > 0) {
+      socket->set_option(
+          boost::asio::socket_base::send_buffer_size(send_buffer_size), ec);
+      if (ec) {
+        LOG(WARNING) << "Set SO_SNDBUF error: " << ec.message();
+      }
+    }
+    if (receive_buffer_size > 0) {
+      socket->set_option(
+          boost::asio::socket_base::receive_buffer_size(receive_buffer_size),
+          ec);
+      if (ec) {
+        LOG(WARNING) << "Set SO_RCVBUF error: " << ec.message();
+      }
+    }
+  }
+  // The options of the connected socket, the buffers are applied before
+  // the connect or the listen.
+  void Apply(boost::asio::ip::tcp::socket *socket) const {
+    boost::system::error_code ec;
+    socket->set_option(boost::asio::socket_base::keep_alive(keep_alive), ec);
+    if (ec) {
+      LOG(WARNING) << "Set SO_KEEPALIVE error: " << ec.message();
+    }
+    socket->set_option(boost::asio::socket_base::linger(false, 0), ec);
+    if (ec) {
+      LOG(WARNING) << "Set SO_LINGER error: " << ec.message();
+    }
+    socket->set_option(boost::asio::ip::tcp::no_delay(no_delay), ec);
+    if (ec) {
+      LOG(WARNING) << "Set TCP_NODELAY error: " << ec.message();
+    }
+    if (quick_ack) {
+      socket->set_option(QuickAck(true), ec);
+      if (ec) {
+        LOG(WARNING) << "Set TCP_QUICKACK error: " << ec.message();
+      }
+    }
+    if (user_timeout_ms > 0) {
+      socket->set_option(UserTimeout(user_timeout_ms), ec);
+      if (ec) {
+        LOG(WARNING) << "Set TCP_USER_TIMEOUT error: " << ec.message();
+      }
+    }
+#ifdef SO_BUSY_POLL
+    if (busy_poll_us > 0) {
+      socket->set_option(BusyPoll(busy_poll_us), ec);
+      if (ec) {
+        LOG(WARNING) << "Set SO_BUSY_POLL error: " << ec.message();
+      }
+    }
+#endif
+  }
+  // The bandwidth delay product from the TCP_INFO of the socket, the
+  // largest of the congestion window, the receive space and the link
+  // bandwidth times the rtt.
+  int BandwidthDelayProduct(const struct tcp_info &info) const {
+    int64 bdp = static_cast<int64>(info.tcpi_snd_cwnd) * info.tcpi_snd_mss;
+    bdp = max(bdp, static_cast<int64>(info.tcpi_rcv_space));
+    if (link_bandwidth > 0) {
+      bdp = max(bdp, link_bandwidth * info.tcpi_rtt / 1000000);
+    }
+    return min(bdp, static_cast<int64>(max_buffer_size));
+  }
+  // Grow the buffers to twice of the bandwidth delay product, return the
+  // new buffer size or 0 if unchanged. The kernel may cap the size by
+  // net.core.wmem_max and rmem_max. The buffers not set by the caller are
+  // left to the kernel.
+  int AutoTune(boost::asio::ip::tcp::socket *socket) const {
+    if (send_buffer_size <= 0 && receive_buffer_size <= 0) {
+      return 0;
+    }
+    boost::system::error_code ec;
+    TcpInfo info;
+    socket->get_option(info, ec);
+    if (ec) {
+      VLOG(2) << "Get TCP_INFO error: " << ec.message();
+      return 0;
+    }
+    const int target = min(2 * BandwidthDelayProduct(info.info()),
+                           max_buffer_size);
+    // The kernel reports the doubled size.
+    boost::asio::socket_base::send_buffer_size send_buffer;
+    socket->get_option(send_buffer, ec);
+    const int current = send_buffer.value() / 2;
+    if (ec || target <= current) {
+      return 0;
+    }
+    socket->set_option(
+        boost::asio::socket_base::send_buffer_size(target), ec);
+    if (ec) {
+      LOG(WARNING) << "Set SO_SNDBUF error: " << ec.message();
+      return 0;
+    }
+    socket->set_option(
+        boost::asio::socket_base::receive_buffer_size(target), ec);
+    if (ec) {
+      LOG(WARNING) << "Set SO_RCVBUF error: " << ec.message();
+    }
+    socket->get_option(send_buffer, ec);
+    if (ec || send_buffer.value() / 2 <= current) {
+      return 0;
+    }
+    VLOG(1) << "Auto tune the buffers from: " << current
+            << " to: " << send_buffer.value() / 2
+            << " rtt: " << info.info().tcpi_rtt
+            << " cwnd: " << info.info().tcpi_snd_cwnd;
+    return send_buffer.value() / 2;
+  }
+  // 0 for the system default.
+  int send_buffer_size;
+  int receive_buffer_size;
+  bool no_delay;
+  // Reset after each read, the ack is not delayed.
+  bool quick_ack;
+  // Disconnect when the sent data is not acked in it, 0 for the default.
+  int user_timeout_ms;
+  int busy_poll_us;
+  bool keep_alive;
+  // Grow the buffers to the bandwidth delay product while transferring.
+  bool auto_tune;
+  // The expected bandwidth in bytes per second, 0 for unknown.
+  int64 link_bandwidth;
+  int max_buffer_size;
+};
+#endif  // SOCKET_PROFILE_HPP_
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "server/socket_profile.hpp"
+class SocketProfileTest : public testing::Test {
+ protected:
+  void SetUp() {
+    boost::asio::ip::tcp::endpoint endpoint(
+        boost::asio::ip::address::from_string("127.0.0.1"), 0);
+    acceptor_.reset(new boost::asio::ip::tcp::acceptor(io_service_));
+    acceptor_->open(endpoint.protocol());
+    acceptor_->bind(endpoint);
+    client_.reset(new boost::asio::ip::tcp::socket(io_service_));
+    server_.reset(new boost::asio::ip::tcp::socket(io_service_));
+  }
+  // Connect the client with the profile, return the accepted socket.
+  void Connect(const SocketProfile &profile) {
+    profile.ApplyBuffers(acceptor_.get());
+    acceptor_->listen();
+    client_->open(boost::asio::ip::tcp::v4());
+    profile.ApplyBuffers(client_.get());
+    client_->connect(acceptor_->local_endpoint());
+    acceptor_->accept(*server_);
+    profile.Apply(server_.get());
+  }
+  boost::asio::io_service io_service_;
+  boost::scoped_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
+  boost::scoped_ptr<boost::asio::ip::tcp::socket> client_;
+  boost::scoped_ptr<boost::asio::ip::tcp::socket> server_;
+};
+
+TEST_F(SocketProfileTest, Apply) {
+  SocketProfile profile = SocketProfile::Latency();
+  profile.send_buffer_size = 64 * 1024;
+  profile.user_timeout_ms = 5000;
+  Connect(profile);
+  boost::asio::ip::tcp::no_delay no_delay;
+  server_->get_option(no_delay);
+  EXPECT_TRUE(no_delay.value());
+  boost::asio::socket_base::send_buffer_size send_buffer;
+  server_->get_option(send_buffer);
+  EXPECT_GE(send_buffer.value(), profile.send_buffer_size);
+  SocketProfile::UserTimeout user_timeout;
+  server_->get_option(user_timeout);
+  EXPECT_EQ(user_timeout.value(), profile.user_timeout_ms);
+  client_->get_option(send_buffer);
+  EXPECT_GE(send_buffer.value(), profile.send_buffer_size);
+}
+
+// The buffers are left to the kernel unless they're set.
+TEST_F(SocketProfileTest, Bulk) {
+  boost::asio::ip::tcp::socket socket(io_service_);
+  socket.open(boost::asio::ip::tcp::v4());
+  boost::asio::socket_base::send_buffer_size default_buffer;
+  socket.get_option(default_buffer);
+  SocketProfile profile = SocketProfile::Bulk();
+  profile.ApplyBuffers(&socket);
+  boost::asio::socket_base::send_buffer_size send_buffer;
+  socket.get_option(send_buffer);
+  EXPECT_EQ(send_buffer.value(), default_buffer.value());
+  EXPECT_EQ(profile.AutoTune(&socket), 0);
+}
+
+TEST_F(SocketProfileTest, BandwidthDelayProduct) {
+  SocketProfile profile;
+  struct tcp_info info;
+  memset(&info, 0, sizeof(info));
+  info.tcpi_snd_cwnd = 10;
+  info.tcpi_snd_mss = 1448;
+  info.tcpi_rtt = 100000;
+  EXPECT_EQ(profile.BandwidthDelayProduct(info), 14480);
+  info.tcpi_rcv_space = 100000;
+  EXPECT_EQ(profile.BandwidthDelayProduct(info), 100000);
+  // 100 MB/s over 100 ms.
+  profile.link_bandwidth = 100 * 1024 * 1024;
+  EXPECT_EQ(profile.BandwidthDelayProduct(info), 10 * 1024 * 1024);
+  profile.max_buffer_size = 4 * 1024 * 1024;
+  EXPECT_EQ(profile.BandwidthDelayProduct(info), profile.max_buffer_size);
+}
+
+TEST_F(SocketProfileTest, AutoTune) {
+  SocketProfile profile;
+  profile.send_buffer_size = 4096;
+  profile.link_bandwidth = 1024 * 1024 * 1024;
+  Connect(profile);
+  const string data(1024 * 1024, 'x');
+  char buffer[64 * 1024];
+  int sent = 0;
+  // The small writes always fit in the receive buffer, so the blocking
+  // write don't wait on the reader.
+  while (sent < data.size()) {
+    sent += client_->write_some(boost::asio::buffer(data.data() + sent,
+                                                    16 * 1024));
+    while (server_->available() > 0) {
+      server_->read_some(boost::asio::buffer(buffer));
+    }
+  }
+  TcpInfo info;
+  client_->get_option(info);
+  EXPECT_GT(info.info().tcpi_rtt, 0);
+  const int size = profile.AutoTune(client_.get());
+  EXPECT_GT(size, profile.send_buffer_size);
+  boost::asio::socket_base::send_buffer_size send_buffer;
+  client_->get_option(send_buffer);
+  EXPECT_EQ(send_buffer.value() / 2, size);
+  // Already large enough.
+  EXPECT_EQ(profile.AutoTune(client_.get()), 0);
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
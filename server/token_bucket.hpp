@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#ifndef NET2_TOKEN_BUCKET_HPP_
+#define NET2_TOKEN_BUCKET_HPP_
+#include "base/base.hpp"
+// Limit the rate of the events to rate per second with the burst, not
+// thread safe. The time is passed in so the callers share one clock read.
+class TokenBucket {
+ public:
+  // 0 rate for no limit.
+  explicit TokenBucket(int rate = 0, int burst = 1)
+    : rate_(rate), burst_(std::max(burst, 1)), tokens_(burst_),
+      last_us_(0) {
+  }
+  // Take a token, return false if none.
+  bool Take(int64 now_us) {
+    if (rate_ <= 0) {
+      return true;
+    }
+    Refill(now_us);
+    if (tokens_ < 1) {
+      return false;
+    }
+    tokens_ -= 1;
+    return true;
+  }
+  // The microseconds until a token is ready, 0 if ready now.
+  int64 WaitUs(int64 now_us) {
+    if (rate_ <= 0) {
+      return 0;
+    }
+    Refill(now_us);
+    if (tokens_ >= 1) {
+      return 0;
+    }
+    return static_cast<int64>((1 - tokens_) * 1000000 / rate_) + 1;
+  }
+ private:
+  void Refill(int64 now_us) {
+    if (last_us_ == 0 || now_us < last_us_) {
+      last_us_ = now_us;
+      return;
+    }
+    tokens_ = std::min<double>(
+        burst_, tokens_ + (now_us - last_us_) * rate_ / 1000000.0);
+    last_us_ = now_us;
+  }
+  int rate_;
+  int burst_;
+  double tokens_;
+  int64 last_us_;
+};
+#endif  // NET2_TOKEN_BUCKET_HPP_
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "server/token_bucket.hpp"
+
+TEST(TokenBucketTest, Unlimited) {
+  TokenBucket bucket;
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(bucket.Take(1));
+  }
+  EXPECT_EQ(bucket.WaitUs(1), 0);
+}
+
+TEST(TokenBucketTest, Rate) {
+  // 1000 per second, 10 in a burst.
+  TokenBucket bucket(1000, 10);
+  int64 now = 1000000;
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(bucket.Take(now));
+  }
+  EXPECT_FALSE(bucket.Take(now));
+  EXPECT_GT(bucket.WaitUs(now), 0);
+  EXPECT_LE(bucket.WaitUs(now), 1001);
+  now += 1000;
+  EXPECT_EQ(bucket.WaitUs(now), 0);
+  EXPECT_TRUE(bucket.Take(now));
+  EXPECT_FALSE(bucket.Take(now));
+  // Never more than the burst.
+  now += 1000000;
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(bucket.Take(now));
+  }
+  EXPECT_FALSE(bucket.Take(now));
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
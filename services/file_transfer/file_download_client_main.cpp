@@ -107,6 +107,7 @@ int main(int argc, char* argv[]) {
   for (int i = 0; i < kConnectionNumber; ++i) {
     const string name("FileDownloadTest2Client." + boost::lexical_cast<string>(i));
     boost::shared_ptr<ClientConnection> r(new ClientConnection(name, FLAGS_address, FLAGS_port));
+    r->set_socket_profile(SocketProfile::Bulk());
     CHECK(!r->IsConnected());
     CHECK(r->Connect());
     r->RegisterService(local_file_transfer_service.get());
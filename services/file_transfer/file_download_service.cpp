@@ -71,9 +71,14 @@ class DownloadTasker {
     FileTransfer::DownloadCompleteRequest request;
     request.set_src_filename(client_->src_filename());
     request.set_local_filename(client_->dest_filename());
+    // Serialize the request once for all the channels.
+    string serialized;
+    request.SerializeToString(&serialized);
+    const SharedBlockPtr encoded_request = SharedBlock::Create(&serialized);
     for (ChannelTable::iterator it = channels_.begin();
          it != channels_.end(); ++it) {
       boost::shared_ptr<RpcController> controller(new RpcController);
+      controller->set_encoded_request(encoded_request);
       boost::shared_ptr<FileTransfer::DownloadCompleteResponse> response(
           new FileTransfer::DownloadCompleteResponse);
       FileTransfer::FileDownloadNotifyService::Stub stub(it->get());
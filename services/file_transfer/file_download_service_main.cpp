@@ -62,6 +62,8 @@ int main(int argc, char* argv[]) {
   scoped_ptr<Server> server;
   VLOG(2) << "New server connection";
   server_connection.reset(new ProtobufConnection("Server"));
+  // The slices are bulk transfers.
+  server_connection->set_socket_profile(SocketProfile::Bulk());
   server.reset(new Server(1, FLAGS_num_threads));
   FileDownloadServiceImpl file_download_service(FLAGS_doc_root, FLAGS_num_threads);
   server_connection->RegisterService(&file_download_service);
@@ -62,17 +62,38 @@ class TransferTask : virtual public Connection::AsyncCloseListener, virtual publ
   int id() const {
     return id_;
   }
-  void set_status(boost::shared_ptr<SliceStatus> status) {
-    status_ = status;
+  // Send the slice, the content is sent from the file instead of the
+  // request content. Thread safe, many slices can be in flight.
+  void SyncSlice(boost::shared_ptr<SliceStatus> status,
+                 const FileTransfer::Slice &slice,
+                 const FileRegion &content);
+  // The slices in flight.
+  int slices() {
+    boost::mutex::scoped_lock locker(calls_mutex_);
+    return calls_.size();
   }
-  void SyncSlice();
   bool SyncCheckBook(const FileTransfer::CheckBook *checkbook);
-  FileTransfer::SliceRequest *mutable_request() {
-    return &slice_request_;
+  // Return false if the tasker is in the task queue already.
+  bool set_queued() {
+    return atomic_compare_and_swap(&queued_, 0, 1);
+  }
+  // Called when the tasker is popped from the task queue.
+  void clear_queued() {
+    atomic_and(&queued_, 0);
   }
   bool IsConnected() const {
     return connection_->IsConnected();
   }
+  // The outbound queue of the channel is below the high watermark.
+  bool writable() const {
+    return connection_->writable();
+  }
+  // Resume the tasker when the channel drains, return false if the channel
+  // is closed.
+  bool WaitWritable() {
+    return connection_->NotifyWritable(
+        boost::bind(&TransferTask::Writable, shared_from_this()));
+  }
   ~TransferTask() {
     VLOG(2) << "~TransferTask" << id_;
   }
@@ -82,7 +103,7 @@ class TransferTask : virtual public Connection::AsyncCloseListener, virtual publ
       return;
     }
     boost::shared_ptr<FileTransferClient> client = file_transfer_.lock();
-    VLOG(2) << "ChannelClosed channel: " << connection_->name() << " tasker:" << id_ << " slice: " << (status_.get() ? status_->index() : -1);
+    VLOG(2) << "ChannelClosed channel: " << connection_->name() << " tasker:" << id_ << " slices: " << slices();
     if (file_transfer_.expired()) {
       LOG(WARNING) << "FileTransfer had expired";
       return;
@@ -91,9 +112,17 @@ class TransferTask : virtual public Connection::AsyncCloseListener, virtual publ
       LOG(WARNING) << "FileTransfer had stopped";
       return;
     }
-    client->ChannelClosed(shared_from_this(), status_);
+    client->ChannelClosed(shared_from_this(), statuses());
   }
  private:
+  // A slice in flight.
+  struct SliceCall {
+    boost::shared_ptr<SliceStatus> status;
+    FileTransfer::SliceRequest request;
+    FileTransfer::SliceResponse response;
+    RpcController controller;
+  };
+  typedef list<boost::shared_ptr<SliceCall> > SliceCallList;
   TransferTask(
       boost::weak_ptr<FileTransferClient> file_transfer,
       boost::shared_ptr<Connection> connection, int id, int timeout);
@@ -104,24 +133,50 @@ class TransferTask : virtual public Connection::AsyncCloseListener, virtual publ
     return period_;
   }
   virtual void Expired();
-  void SyncSliceDone();
+  void SyncSliceDone(boost::shared_ptr<SliceCall> call);
+  void Writable();
+  // The status of the slices in flight.
+  vector<boost::shared_ptr<SliceStatus> > statuses() {
+    vector<boost::shared_ptr<SliceStatus> > ret;
+    boost::mutex::scoped_lock locker(calls_mutex_);
+    for (SliceCallList::const_iterator it = calls_.begin();
+         it != calls_.end(); ++it) {
+      ret.push_back((*it)->status);
+    }
+    return ret;
+  }
   static const int kRetry = 2;
   boost::shared_ptr<Connection> connection_;
   FileTransfer::FileTransferService::Stub stub_;
-  FileTransfer::SliceRequest slice_request_;
-  FileTransfer::SliceResponse slice_response_;
   FileTransfer::CheckBookResponse checkbook_response_;
   RpcController controller_;
   boost::weak_ptr<FileTransferClient> file_transfer_;
-  boost::shared_ptr<SliceStatus> status_;
+  SliceCallList calls_;
+  boost::mutex calls_mutex_;
   int id_;
   int timeout_;
   bool period_;
+  volatile int queued_;
 };
 
+bool FileTransferClient::QueueTask(boost::shared_ptr<TransferTask> tasker) {
+  if (!tasker->IsConnected() || !tasker->set_queued()) {
+    return false;
+  }
+  transfer_task_queue_.Push(tasker);
+  return true;
+}
+
+void FileTransferClient::ResumeTask(boost::shared_ptr<TransferTask> tasker) {
+  VLOG(2) << "ResumeTask, tasker: " << tasker->id();
+  if (QueueTask(tasker) && IsRunning()) {
+    ScheduleTask();
+  }
+}
+
 void FileTransferClient::ChannelClosed(
     boost::shared_ptr<TransferTask> tasker,
-    boost::shared_ptr<SliceStatus> status) {
+    const vector<boost::shared_ptr<SliceStatus> > &statuses) {
   VLOG(2) << "FileTransferClient::ChannelClosed, tasker: " << tasker->id();
   {
     boost::mutex::scoped_lock locker(transfer_task_set_mutex_);
@@ -129,9 +184,11 @@ void FileTransferClient::ChannelClosed(
   }
   {
     boost::mutex::scoped_lock locker(transfering_slice_mutex_);
-    if (status.get() != NULL && status->status() != SliceStatus::DONE) {
-      VLOG(1) << "Reset slice: " << status->index() << " to idle";
-      status->set_status(SliceStatus::IDLE);
+    for (size_t i = 0; i < statuses.size(); ++i) {
+      if (statuses[i]->status() != SliceStatus::DONE) {
+        VLOG(1) << "Reset slice: " << statuses[i]->index() << " to idle";
+        statuses[i]->set_status(SliceStatus::IDLE);
+      }
     }
   }
   if (IsRunning()) {
@@ -154,7 +211,7 @@ void FileTransferClient::PushChannel(Connection *channel) {
     boost::mutex::scoped_lock locker(transfer_task_set_mutex_);
     transfer_task_set_.insert(tasker);
   }
-  transfer_task_queue_.Push(tasker);
+  QueueTask(tasker);
   if (IsRunning()) {
     ScheduleTask();
   }
@@ -168,7 +225,7 @@ FileTransferClient::FileTransferClient(const string &host, const string &port,
   threadpool_(new ThreadPool(
       "FileTransferClientThreadPool", thread_pool_size)),
   sync_checkbook_failed_(0), finished_(false), status_(SYNC_CHECKBOOK),
-  timeout_(kDefaultTimeOutSec),
+  writable_waits_(0), timeout_(kDefaultTimeOutSec),
   timer_master_(new TimerMaster), running_(false) {
 }
 
@@ -294,12 +351,11 @@ void FileTransferClient::SyncCheckBook() {
     LOG(WARNING) << "Get null tasker, return";
     return;
   }
+  tasker->clear_queued();
   if (!tasker->SyncCheckBook(checkbook_.get())) {
     LOG(WARNING) << "Transfer checkbook failed, tasker: " << tasker->IsConnected();
     ++sync_checkbook_failed_;
-    if (tasker->IsConnected()) {
-      transfer_task_queue_.Push(tasker);
-    }
+    QueueTask(tasker);
     if (IsRunning()) {
       ScheduleTask();
     }
@@ -307,9 +363,7 @@ void FileTransferClient::SyncCheckBook() {
     status_ = PREPARE_SLICE;
     checkbook_->mutable_meta()->set_synced_with_dest(true);
     checkbook_->Save(checkbook_->GetCheckBookSrcFileName());
-    if (tasker->IsConnected()) {
-      transfer_task_queue_.Push(tasker);
-    }
+    QueueTask(tasker);
     ScheduleTask();
   }
 }
@@ -342,8 +396,8 @@ void FileTransferClient::PrepareSlice() {
   VLOG(1) << "PrepareSlice";
   // Open the source file.
   const FileTransfer::MetaData &meta = checkbook_->meta();
-  src_file_.open(meta.src_filename());
-  if (!src_file_.is_open()) {
+  src_file_ = SharedFile::Open(meta.src_filename());
+  if (src_file_.get() == NULL) {
     LOG(WARNING) << "Fail to open source file: "
       << meta.src_filename();
     ScheduleTask();
@@ -371,7 +425,17 @@ void FileTransferClient::ScheduleSlice() {
     LOG(WARNING) << "Get null tasker, return";
     return;
   }
+  tasker->clear_queued();
   VLOG(2) << "Get tasker " << tasker->id() << " tasker queue size: " << transfer_task_queue_.size();
+  if (!tasker->writable()) {
+    // The receiver is slow, park the tasker until its channel drains.
+    VLOG(2) << "Tasker " << tasker->id() << " is not writable, wait";
+    atomic_inc(&writable_waits_, 1);
+    if (!tasker->WaitWritable()) {
+      VLOG(2) << "Tasker " << tasker->id() << " is closed";
+    }
+    return;
+  }
   boost::shared_ptr<SliceStatus> slice;
   bool in_transfering = false;
   bool call_finish_handler = false;
@@ -423,9 +487,7 @@ void FileTransferClient::ScheduleSlice() {
   if (slice.get() == NULL) {
     VLOG(2) << "Get null slice, push back the tasker";
     boost::this_thread::yield();
-    if (tasker->IsConnected()) {
-      transfer_task_queue_.Push(tasker);
-    }
+    QueueTask(tasker);
     return;
   }
   VLOG(2) << "Transfer, tasker: " << tasker->id() << " slice: " << slice->index();
@@ -435,28 +497,25 @@ void FileTransferClient::ScheduleSlice() {
 void FileTransferClient::SyncSlice(
     boost::shared_ptr<SliceStatus> slice,
     boost::shared_ptr<TransferTask> tasker) {
-  FileTransfer::SliceRequest *request = tasker->mutable_request();
-  request->Clear();
-  tasker->set_status(slice);
-  const int index = slice->index();
-  const FileTransfer::Slice &slice_meta = checkbook_->slice(index);
-  const int length = slice_meta.length();
-  const int offset = slice_meta.offset();
-  request->mutable_slice()->CopyFrom(slice_meta);
-  request->mutable_content()->assign(
-      src_file_.data() + offset, length);
-  tasker->SyncSlice();
+  const FileTransfer::Slice &slice_meta = checkbook_->slice(slice->index());
+  tasker->SyncSlice(slice, slice_meta, FileRegion(
+      src_file_, slice_meta.offset(), slice_meta.length()));
+  // Keep sending on the channel until it's not writable, the tasker waits
+  // for the channel to drain when it's popped again.
+  if (tasker->slices() < kMaxSlicesInFlight && QueueTask(tasker)) {
+    ScheduleTask();
+  }
 }
 
 void TransferTask::Expired() {
   VLOG(2) << connection_->name() << " : " << "TransferTask Timeouted";
-  if (status_.get() == NULL) {
-    VLOG(2) << "Transfer : " << id() << " timeout but have null status";
+  const vector<boost::shared_ptr<SliceStatus> > statuses = this->statuses();
+  if (statuses.empty()) {
+    VLOG(2) << "Transfer : " << id() << " timeout but have no slice";
     return;
   }
   connection_->Disconnect();
-  VLOG(2) << "slice " << status_->index() << " timeouted, status: "
-    << status_->status();
+  VLOG(2) << statuses.size() << " slices timeouted";
   boost::shared_ptr<FileTransferClient> client = file_transfer_.lock();
   if (file_transfer_.expired()) {
     LOG(WARNING) << "TransferTask timeout but file_transfer is expired";
@@ -468,38 +527,61 @@ void TransferTask::Expired() {
     period_ = false;
     return;
   }
-  client->ChannelClosed(shared_from_this(), status_);
+  client->ChannelClosed(shared_from_this(), statuses);
 }
 
-void TransferTask::SyncSlice() {
-  VLOG(1) << "SyncSlice: Channel: " << connection_->name() << " tasker: " << id() << " slice: " << status_->index()
+void TransferTask::SyncSlice(boost::shared_ptr<SliceStatus> status,
+                             const FileTransfer::Slice &slice,
+                             const FileRegion &content) {
+  VLOG(1) << "SyncSlice: Channel: " << connection_->name() << " tasker: " << id() << " slice: " << status->index()
       << "timeout: " << timeout_;
-  controller_.Reset();
-  slice_response_.Clear();
-  stub_.ReceiveSlice(&controller_,
-                     &slice_request_,
-                     &slice_response_,
+  boost::shared_ptr<SliceCall> call(new SliceCall);
+  call->status = status;
+  call->request.mutable_slice()->CopyFrom(slice);
+  call->request.set_content("");
+  call->controller.set_attachment(
+      FileTransfer::SliceRequest::kContentFieldNumber, content);
+  {
+    boost::mutex::scoped_lock locker(calls_mutex_);
+    calls_.push_back(call);
+  }
+  stub_.ReceiveSlice(&call->controller,
+                     &call->request,
+                     &call->response,
                      NewClosure(boost::bind(
                          &TransferTask::SyncSliceDone,
-                         shared_from_this())));
+                         shared_from_this(), call)));
 }
 
-void TransferTask::SyncSliceDone() {
-  VLOG(1) << "SyncSliceDone: Channel: " << connection_->name() << " tasker: " << id() << " slice: " << status_->index();
+void TransferTask::Writable() {
+  boost::shared_ptr<FileTransferClient> client = file_transfer_.lock();
+  if (client.get() == NULL || !client->IsRunning()) {
+    VLOG(2) << "Tasker " << id_ << " writable but file_transfer is stopped";
+    return;
+  }
+  client->ResumeTask(shared_from_this());
+}
+
+void TransferTask::SyncSliceDone(boost::shared_ptr<SliceCall> call) {
+  const boost::shared_ptr<SliceStatus> &status = call->status;
+  VLOG(1) << "SyncSliceDone: Channel: " << connection_->name() << " tasker: " << id() << " slice: " << status->index();
+  {
+    boost::mutex::scoped_lock locker(calls_mutex_);
+    calls_.remove(call);
+  }
   bool ret = false;
-  if (controller_.Failed() || !slice_response_.succeed()) {
+  if (call->controller.Failed() || !call->response.succeed()) {
     VLOG(2) << "transfer id: " << id_ << " slice: "
-            << slice_request_.slice().offset()
+            << call->request.slice().offset()
             << " Failed";
     // Retry.
-    controller_.Reset();
     ret = false;
   } else {
     ret = true;
   }
-  VLOG(2) << "SyncSliceDone: " << id() << " " << status_->index() << " " << ret;
-  if (status_->status() == SliceStatus::TRANSFERING) {
-    VLOG(2) << "Reschedule slice: " << status_->index();
+  VLOG(2) << "SyncSliceDone: " << id() << " " << status->index() << " " << ret;
+  if (status->status() == SliceStatus::TRANSFERING) {
+    VLOG(2) << "Reschedule slice: " << status->index();
     boost::shared_ptr<FileTransferClient> lock_file_transfer = file_transfer_.lock();
     if (file_transfer_.expired()) {
       VLOG(2) << "FileTransferClient had expired";
@@ -509,16 +591,14 @@ void TransferTask::SyncSliceDone() {
       VLOG(2) << "FileTransferClient had stopped";
       return;
     }
-    lock_file_transfer->SyncSliceDone(shared_from_this(), ret, status_);
+    lock_file_transfer->SyncSliceDone(shared_from_this(), ret, status);
   }
 }
 
 void FileTransferClient::SyncSliceDone(
     boost::shared_ptr<TransferTask> tasker, bool succeed, boost::shared_ptr<SliceStatus> status) {
   VLOG(2) << "SyncSlice: " << status->index() << " result: " << succeed;
-  if (tasker->IsConnected()) {
-    transfer_task_queue_.Push(tasker);
-  }
+  QueueTask(tasker);
   {
     boost::mutex::scoped_lock locker(transfering_slice_mutex_);
     if (succeed) {
@@ -535,7 +615,7 @@ TransferTask::TransferTask(
     boost::weak_ptr<FileTransferClient> file_transfer,
     boost::shared_ptr<Connection> connection, int id, int timeout)
     : connection_(connection), stub_(connection_.get()), id_(id), file_transfer_(file_transfer),
-      timeout_(timeout), period_(true) {
+      timeout_(timeout), period_(true), queued_(0) {
 }
 
 boost::shared_ptr<TransferTask> TransferTask::Create(
@@ -83,9 +83,15 @@ class FileTransferClient : public boost::enable_shared_from_this<FileTransferCli
       int threadpool_size);
   // The percent * 1000, 1000 means transfer finished.
   int Percent();
+  // The times a tasker waited for its channel to drain.
+  int writable_waits() const {
+    return writable_waits_;
+  }
   const string GetCheckBookDestFileName() const;
  private:
   static const int kDefaultTimeOutSec = 10;
+  // The slices in flight on one channel, besides the high watermark.
+  static const int kMaxSlicesInFlight = 16;
   enum Status {
     SYNC_CHECKBOOK = 0,
     PREPARE_SLICE,
@@ -110,7 +116,12 @@ class FileTransferClient : public boost::enable_shared_from_this<FileTransferCli
       boost::shared_ptr<TransferTask> tasker,
       bool succeed, boost::shared_ptr<SliceStatus> status);
   void ChannelClosed(boost::shared_ptr<TransferTask> tasker,
-                     boost::shared_ptr<SliceStatus> status);
+                     const vector<boost::shared_ptr<SliceStatus> > &statuses);
+  // Push the tasker into the task queue unless it's queued already or
+  // closed, return true if pushed.
+  bool QueueTask(boost::shared_ptr<TransferTask> tasker);
+  // Push back the tasker parked for its channel to drain.
+  void ResumeTask(boost::shared_ptr<TransferTask> tasker);
   static const int kSyncCheckBookRetry = 3;
   typedef deque<boost::shared_ptr<TransferTask> > TransferTaskQueue;
   typedef list<boost::shared_ptr<SliceStatus> > SliceStatusLink;
@@ -122,7 +133,7 @@ class FileTransferClient : public boost::enable_shared_from_this<FileTransferCli
   boost::mutex transfer_task_set_mutex_;
   hash_set<boost::shared_ptr<TransferTask> > transfer_task_set_;
   scoped_ptr<CheckBook> checkbook_;
-  boost::iostreams::mapped_file_source src_file_;
+  boost::shared_ptr<SharedFile> src_file_;
   boost::mutex sync_checkbook_mutex_;
   boost::mutex prepare_slice_mutex_;
   boost::mutex transfering_slice_mutex_;
@@ -130,6 +141,7 @@ class FileTransferClient : public boost::enable_shared_from_this<FileTransferCli
   Status status_;
   int sync_checkbook_failed_;
   bool finished_;
+  volatile int writable_waits_;
   string host_, port_, src_filename_, dest_filename_;
   scoped_ptr<boost::asio::io_service> io_service_;
   scoped_ptr<boost::asio::io_service::work> work_;
@@ -182,6 +182,40 @@ TEST_F(FileTransferTest, Test2) {
   boost::filesystem::remove(dest_path);
 }
 
+// The slices are pipelined on one channel until it's not writable.
+TEST_F(FileTransferTest, Backpressure) {
+  const int kSliceNumber = 10;
+  const int kFileSize = CheckBook::GetSliceSize()  * kSliceNumber + 1;
+  string content;
+  CreateFile(kFileSize, &content);
+  const string dest_filename = "111";
+  file_transfer_client_.reset(FileTransferClient::Create(
+      FLAGS_server, FLAGS_port, kTestFile, dest_filename, FLAGS_num_threads));
+  boost::shared_ptr<Notifier> ns(new Notifier("NotifyBackpressure"));
+  file_transfer_client_->set_finish_listener(ns->notify_handler());
+  file_transfer_client_->Start();
+  FlushPolicy flush_policy;
+  // Hold the slices in the queue for a while, one slice reaches the high
+  // watermark.
+  flush_policy.max_bytes = 16 * 1024 * 1024;
+  flush_policy.max_delay_us = 100000;
+  flush_policy.high_watermark = CheckBook::GetSliceSize();
+  flush_policy.low_watermark = 0;
+  client_connection_->set_flush_policy(flush_policy);
+  CHECK(!client_connection_->IsConnected());
+  CHECK(client_connection_->Connect());
+  file_transfer_client_->PushChannel(client_connection_.get());
+  ns->Wait();
+  EXPECT_GT(file_transfer_client_->writable_waits(), 0);
+  boost::filesystem::path dest_path(FLAGS_doc_root);
+  dest_path /= dest_filename;
+  ASSERT_TRUE(FileEqual(kTestFile, dest_path.file_string()));
+  client_connection_->Disconnect();
+  file_transfer_client_->Stop();
+  boost::filesystem::remove(kTestFile);
+  boost::filesystem::remove(dest_path);
+}
+
 TEST_F(FileTransferTest, Test3) {
   const int kConnectionNumber = FLAGS_num_connections;
   const int kSliceNumber = 10;
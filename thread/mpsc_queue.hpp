@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#ifndef MPSC_QUEUE_HPP_
+#define MPSC_QUEUE_HPP_
+#include "base/atomic.hpp"
+#include "base/basictypes.hpp"
+#include <boost/noncopyable.hpp>
+#include <vector>
+// Lock free multi producers single consumer queue.
+// The producers push onto an intrusive stack with compare and swap, the
+// consumer takes the whole stack at once and reverses it, so the values
+// of one producer pop in the push order. The nodes come from a fixed pool
+// of the queue, a node is only allocated when the pool is empty.
+template <class Type>
+class MPSCQueue : public boost::noncopyable {
+ public:
+  static const int kPoolSize = 16;
+  explicit MPSCQueue(int pool_size = kPoolSize)
+    : head_(NULL), pool_(pool_size > 0 ? new Node[pool_size] : NULL),
+      pool_size_(pool_size), free_(0) {
+    for (int i = 0; i < pool_size_; ++i) {
+      pool_[i].free_next = i + 1 < pool_size_ ? i + 2 : 0;
+    }
+    if (pool_size_ > 0) {
+      free_ = 1;
+    }
+  }
+  ~MPSCQueue() {
+    Node *node = head_;
+    while (node) {
+      Node *next = node->next;
+      if (!pooled(node)) {
+        delete node;
+      }
+      node = next;
+    }
+    delete [] pool_;
+  }
+  void Push(const Type &t) {
+    Node *node = Allocate();
+    node->value = t;
+    Node *head;
+    do {
+      head = head_;
+      node->next = head;
+    } while (!atomic_compare_and_swap(&head_, head, node));
+  }
+  // Append all the values to the values, return the number of values.
+  // Only one thread can pop at a time.
+  int PopAll(std::vector<Type> *values) {
+    Node *node;
+    do {
+      node = head_;
+      if (node == NULL) {
+        return 0;
+      }
+    } while (!atomic_compare_and_swap(&head_, node, static_cast<Node *>(NULL)));
+    Node *reversed = NULL;
+    while (node) {
+      Node *next = node->next;
+      node->next = reversed;
+      reversed = node;
+      node = next;
+    }
+    int n = 0;
+    while (reversed) {
+      Node *next = reversed->next;
+      values->push_back(reversed->value);
+      Release(reversed);
+      reversed = next;
+      ++n;
+    }
+    return n;
+  }
+  bool empty() const {
+    return head_ == NULL;
+  }
+ private:
+  struct Node {
+    Node() : next(NULL), free_next(0) {
+    }
+    Type value;
+    Node *next;
+    // The index + 1 of the next free node in the pool, 0 for none.
+    uint32 free_next;
+  };
+  bool pooled(const Node *node) const {
+    return node >= pool_ && node < pool_ + pool_size_;
+  }
+  // The free list is the index + 1 of the top node in the low 32 bits,
+  // the high 32 bits count the changes, so a node popped and pushed back
+  // between the read and the compare and swap fails it.
+  Node *Allocate() {
+    uint64 free;
+    uint32 index;
+    do {
+      free = free_;
+      index = free & 0xffffffff;
+      if (index == 0) {
+        return new Node;
+      }
+    } while (!atomic_compare_and_swap(
+        &free_, free, ((free >> 32) + 1) << 32 | pool_[index - 1].free_next));
+    return &pool_[index - 1];
+  }
+  void Release(Node *node) {
+    if (!pooled(node)) {
+      delete node;
+      return;
+    }
+    // Drop the references held by the value.
+    node->value = Type();
+    const uint32 index = node - pool_ + 1;
+    uint64 free;
+    do {
+      free = free_;
+      node->free_next = free & 0xffffffff;
+    } while (!atomic_compare_and_swap(&free_, free,
+                                      ((free >> 32) + 1) << 32 | index));
+  }
+  Node * volatile head_;
+  Node *pool_;
+  int pool_size_;
+  volatile uint64 free_;
+};
+#endif  // MPSC_QUEUE_HPP_
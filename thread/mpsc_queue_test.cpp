@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2009, Xiliu Tang (xiliu.tang@gmail.com)
+ * 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright 
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above 
+ *       copyright notice, this list of conditions and the following 
+ *       disclaimer in the documentation and/or other materials provided 
+ *       with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Project Website http://code.google.com/p/server1/
+ */
+
+
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include "base/base.hpp"
+#include "thread/mpsc_queue.hpp"
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <deque>
+DEFINE_int32(producers, 8, "The producer thread number of the benchmark");
+DEFINE_int32(pushes, 100000, "The push number of each producer");
+
+// The value is producer << 32 | sequence.
+typedef long long Value;
+
+// The queue used by RawConnection before, for comparison.
+class MutexQueue {
+ public:
+  void Push(const Value &v) {
+    boost::mutex::scoped_lock locker(mutex_);
+    queue_.push_back(v);
+  }
+  int PopAll(vector<Value> *values) {
+    boost::mutex::scoped_lock locker(mutex_);
+    const int n = queue_.size();
+    values->insert(values->end(), queue_.begin(), queue_.end());
+    queue_.clear();
+    return n;
+  }
+ private:
+  boost::mutex mutex_;
+  std::deque<Value> queue_;
+};
+
+class MPSCQueueTest : public testing::Test {
+ protected:
+  template <class Queue>
+  static void Produce(Queue *queue, int producer, int pushes) {
+    for (int i = 0; i < pushes; ++i) {
+      queue->Push(static_cast<Value>(producer) << 32 | i);
+    }
+  }
+  // Run the producers and a consumer, check the per producer order, return
+  // the pushes per second.
+  template <class Queue>
+  static double Run(int producers, int pushes) {
+    Queue queue;
+    boost::posix_time::ptime start =
+      boost::posix_time::microsec_clock::universal_time();
+    boost::thread_group threads;
+    for (int i = 0; i < producers; ++i) {
+      threads.create_thread(boost::bind(
+          &MPSCQueueTest::Produce<Queue>, &queue, i, pushes));
+    }
+    vector<int> next(producers, 0);
+    vector<Value> values;
+    int total = 0;
+    while (total < producers * pushes) {
+      values.clear();
+      if (queue.PopAll(&values) == 0) {
+        boost::this_thread::yield();
+        continue;
+      }
+      for (int i = 0; i < values.size(); ++i) {
+        const int producer = values[i] >> 32;
+        const int sequence = values[i] & 0xffffffff;
+        EXPECT_EQ(next[producer], sequence);
+        next[producer] = sequence + 1;
+      }
+      total += values.size();
+    }
+    threads.join_all();
+    boost::posix_time::time_duration elapsed =
+      boost::posix_time::microsec_clock::universal_time() - start;
+    EXPECT_EQ(total, producers * pushes);
+    return total / (elapsed.total_microseconds() / 1000000.0);
+  }
+};
+
+TEST_F(MPSCQueueTest, Order) {
+  MPSCQueue<int> queue;
+  vector<int> values;
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(queue.PopAll(&values), 0);
+  for (int i = 0; i < 10; ++i) {
+    queue.Push(i);
+  }
+  EXPECT_FALSE(queue.empty());
+  EXPECT_EQ(queue.PopAll(&values), 10);
+  EXPECT_TRUE(queue.empty());
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(values[i], i);
+  }
+  // The left values are released by the destructor.
+  queue.Push(10);
+}
+
+// The nodes come back to the pool, the pooled values are released.
+TEST_F(MPSCQueueTest, Pool) {
+  MPSCQueue<boost::shared_ptr<int> > queue(4);
+  boost::shared_ptr<int> value(new int(1));
+  vector<boost::shared_ptr<int> > values;
+  for (int round = 0; round < 3; ++round) {
+    // Beyond the pool size.
+    for (int i = 0; i < 10; ++i) {
+      queue.Push(value);
+    }
+    EXPECT_EQ(value.use_count(), 11);
+    EXPECT_EQ(queue.PopAll(&values), 10);
+    values.clear();
+    EXPECT_EQ(value.use_count(), 1);
+  }
+  queue.Push(value);
+}
+
+TEST_F(MPSCQueueTest, Benchmark) {
+  for (int producers = 1; producers <= FLAGS_producers; producers *= 2) {
+    const double mutex_qps = Run<MutexQueue>(producers, FLAGS_pushes);
+    const double mpsc_qps = Run<MPSCQueue<Value> >(producers, FLAGS_pushes);
+    LOG(INFO) << "Producers: " << producers
+              << " mutex queue: " << mutex_qps << " pushes/s"
+              << " mpsc queue: " << mpsc_qps << " pushes/s";
+  }
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
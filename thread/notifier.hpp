@@ -64,7 +64,12 @@ class Notifier : public boost::enable_shared_from_this<Notifier>, public boost::
   }
   // Return true when notified, otherwise return false.
   bool Wait() {
-    return Wait(LONG_MAX);
+    boost::mutex::scoped_lock locker(mutex_);
+    while (!notified_) {
+      VLOG(2) << name_ << " : " << "Wait";
+      notify_.wait(locker);
+    }
+    return true;
   }
   bool Wait(int timeout_ms) {
     boost::mutex::scoped_lock locker(mutex_);